@@ -947,16 +947,11 @@ void findnextfile_wrap_reset(void)
 }
 
 /* Abort the current filename search.  Clean up by setting the current
- * shortcut list to the browser shortcut list, displaying it, and
- * decompiling the compiled regular expression we used in the last
- * search, if any. */
+ * shortcut list to the browser shortcut list, and displaying it. */
 void filesearch_abort(void)
 {
     currmenu = MBROWSER;
     bottombars(MBROWSER);
-#ifdef HAVE_REGEX_H
-    regexp_cleanup();
-#endif
 }
 
 /* Search for a filename. */
@@ -391,7 +391,24 @@ int parse_mbchar(const char *buf, char *chr, size_t *col)
     assert(buf != NULL);
 
 #ifdef ENABLE_UTF8
-    if (use_utf8) {
+    /* An ASCII character is a single byte, and one column wide unless
+     * it's a tab or a control character, so we don't need to ask the
+     * locale about it. */
+    if (use_utf8 && (signed char)*buf >= 0) {
+	if (chr != NULL)
+	    *chr = *buf;
+
+	if (col != NULL) {
+	    if (*buf == '\t')
+		*col += tabsize - *col % tabsize;
+	    else if (is_cntrl_char((unsigned char)*buf))
+		*col += 2;
+	    else
+		(*col)++;
+	}
+
+	return 1;
+    } else if (use_utf8) {
 	/* Get the number of bytes in the multibyte character. */
 	buf_mb_len = mblen(buf, MB_CUR_MAX);
 
@@ -469,6 +486,40 @@ int parse_mbchar(const char *buf, char *chr, size_t *col)
     return buf_mb_len;
 }
 
+/* Return how many of the first len bytes of s are printable ASCII
+ * characters, which are one byte and one column wide each in any
+ * locale, so that runs of them can be counted without parsing them one
+ * by one.  We look at a word's worth of bytes at a time. */
+size_t plain_ascii_len(const char *s, size_t len)
+{
+    const unsigned long ones = ~0UL / 255;
+	/* A word with each byte set to 0x01. */
+    size_t n = 0;
+
+    assert(s != NULL);
+
+    /* A byte is printable ASCII if its high bit is clear, subtracting
+     * 0x20 from it doesn't set the high bit, and adding 0x01 to it
+     * doesn't either.  Since the lowest byte that fails one of these
+     * tests can't get a borrow or a carry from the bytes below it, a
+     * word passes them all only if each of its bytes does. */
+    for (; n + sizeof(unsigned long) <= len; n += sizeof(unsigned
+	long)) {
+	unsigned long w;
+
+	memcpy(&w, s + n, sizeof(unsigned long));
+
+	if ((w | (w - ones * 0x20) | (w + ones)) & (ones * 0x80))
+	    break;
+    }
+
+    while (n < len && (unsigned char)s[n] >= 0x20 &&
+	(unsigned char)s[n] < 0x7F)
+	n++;
+
+    return n;
+}
+
 /* Return the index in buf of the beginning of the multibyte character
  * before the one at pos. */
 size_t move_mbleft(const char *buf, size_t pos)
@@ -536,7 +587,6 @@ int mbstrncasecmp(const char *s1, const char *s2, size_t n)
 {
 #ifdef ENABLE_UTF8
     if (use_utf8) {
-	char *s1_mb, *s2_mb;
 	wchar_t ws1, ws2;
 
 	if (s1 == s2)
@@ -544,37 +594,42 @@ int mbstrncasecmp(const char *s1, const char *s2, size_t n)
 
 	assert(s1 != NULL && s2 != NULL);
 
-	s1_mb = charalloc(MB_CUR_MAX);
-	s2_mb = charalloc(MB_CUR_MAX);
-
-	for (; *s1 != '\0' && *s2 != '\0' && n > 0; s1 +=
-		move_mbright(s1, 0), s2 += move_mbright(s2, 0), n--) {
+	for (; *s1 != '\0' && *s2 != '\0' && n > 0; n--) {
 	    bool bad_s1_mb = FALSE, bad_s2_mb = FALSE;
-	    int s1_mb_len, s2_mb_len;
+	    int s1_mb_len = 1, s2_mb_len = 1;
 
-	    s1_mb_len = parse_mbchar(s1, s1_mb, NULL);
+	    /* ASCII characters don't need converting. */
+	    if ((signed char)*s1 >= 0)
+		ws1 = (unsigned char)*s1;
+	    else {
+		s1_mb_len = parse_mbchar(s1, NULL, NULL);
 
-	    if (mbtowc(&ws1, s1_mb, s1_mb_len) < 0) {
-		mbtowc_reset();
-		ws1 = (unsigned char)*s1_mb;
-		bad_s1_mb = TRUE;
+		if (mbtowc(&ws1, s1, s1_mb_len) < 0) {
+		    mbtowc_reset();
+		    ws1 = (unsigned char)*s1;
+		    bad_s1_mb = TRUE;
+		}
 	    }
 
-	    s2_mb_len = parse_mbchar(s2, s2_mb, NULL);
+	    if ((signed char)*s2 >= 0)
+		ws2 = (unsigned char)*s2;
+	    else {
+		s2_mb_len = parse_mbchar(s2, NULL, NULL);
 
-	    if (mbtowc(&ws2, s2_mb, s2_mb_len) < 0) {
-		mbtowc_reset();
-		ws2 = (unsigned char)*s2_mb;
-		bad_s2_mb = TRUE;
+		if (mbtowc(&ws2, s2, s2_mb_len) < 0) {
+		    mbtowc_reset();
+		    ws2 = (unsigned char)*s2;
+		    bad_s2_mb = TRUE;
+		}
 	    }
 
 	    if (bad_s1_mb != bad_s2_mb || towlower(ws1) !=
 		towlower(ws2))
 		break;
-	}
 
-	free(s1_mb);
-	free(s2_mb);
+	    s1 += s1_mb_len;
+	    s2 += s2_mb_len;
+	}
 
 	return (n > 0) ? towlower(ws1) - towlower(ws2) : 0;
     } else
@@ -606,12 +661,39 @@ char *nstrcasestr(const char *haystack, const char *needle)
 }
 #endif
 
+#ifdef ENABLE_UTF8
+/* Return the lowercase version of the first character of needle, or
+ * WEOF if it's an invalid multibyte character.  mbstrncasecmp() can
+ * only match needle at an ASCII character whose lowercase version this
+ * is, so that the others can be passed over without comparing. */
+static wint_t first_lowered(const char *needle)
+{
+    wchar_t wc;
+
+    if (mbtowc(&wc, needle, MB_CUR_MAX) < 0) {
+	mbtowc_reset();
+	return WEOF;
+    }
+
+    return towlower(wc);
+}
+
+/* Return TRUE if the character at s can't start a case-insensitive
+ * match of a needle whose first_lowered() is first. */
+static bool cant_start_match(const char *s, wint_t first)
+{
+    return ((signed char)*s >= 0 && towlower((unsigned char)*s) !=
+	first);
+}
+#endif
+
 /* This function is equivalent to strcasestr() for multibyte strings. */
 char *mbstrcasestr(const char *haystack, const char *needle)
 {
 #ifdef ENABLE_UTF8
     if (use_utf8) {
 	size_t haystack_len, needle_len;
+	wint_t first;
 
 	assert(haystack != NULL && needle != NULL);
 
@@ -620,9 +702,13 @@ char *mbstrcasestr(const char *haystack, const char *needle)
 
 	haystack_len = mbstrlen(haystack);
 	needle_len = mbstrlen(needle);
+	first = first_lowered(needle);
 
 	for (; *haystack != '\0' && haystack_len >= needle_len;
 		haystack += move_mbright(haystack, 0), haystack_len--) {
+	    if (cant_start_match(haystack, first))
+		continue;
+
 	    if (mbstrncasecmp(haystack, needle, needle_len) == 0)
 		return (char *)haystack;
 	}
@@ -654,8 +740,8 @@ char *revstrstr(const char *haystack, const char *needle, const char
     rev_start_len = strlen(rev_start);
 
     for (; rev_start >= haystack; rev_start--, rev_start_len++) {
-	if (rev_start_len >= needle_len && strncmp(rev_start, needle,
-		needle_len) == 0)
+	if (*rev_start == *needle && rev_start_len >= needle_len &&
+		strncmp(rev_start, needle, needle_len) == 0)
 	    return (char *)rev_start;
     }
 
@@ -684,8 +770,10 @@ char *revstrcasestr(const char *haystack, const char *needle, const char
     rev_start_len = strlen(rev_start);
 
     for (; rev_start >= haystack; rev_start--, rev_start_len++) {
-	if (rev_start_len >= needle_len && strncasecmp(rev_start,
-		needle, needle_len) == 0)
+	if (tolower((unsigned char)*rev_start) ==
+		tolower((unsigned char)*needle) && rev_start_len >=
+		needle_len && strncasecmp(rev_start, needle,
+		needle_len) == 0)
 	    return (char *)rev_start;
     }
 
@@ -700,8 +788,9 @@ char *mbrevstrcasestr(const char *haystack, const char *needle, const
 {
 #ifdef ENABLE_UTF8
     if (use_utf8) {
-	bool begin_line = FALSE;
-	size_t rev_start_len, needle_len;
+	size_t haystack_len, needle_len;
+	wint_t first;
+	const char *found = NULL;
 
 	assert(haystack != NULL && needle != NULL && rev_start != NULL);
 
@@ -709,27 +798,29 @@ char *mbrevstrcasestr(const char *haystack, const char *needle, const
 	    return (char *)rev_start;
 
 	needle_len = mbstrlen(needle);
+	haystack_len = mbstrlen(haystack);
 
-	if (mbstrlen(haystack) < needle_len)
+	if (haystack_len < needle_len)
 	    return NULL;
 
-	rev_start_len = mbstrlen(rev_start);
+	first = first_lowered(needle);
 
-	while (!begin_line) {
-	    if (rev_start_len >= needle_len && mbstrncasecmp(rev_start,
-		needle, needle_len) == 0)
-		return (char *)rev_start;
+	if (!cant_start_match(rev_start, first) && mbstrlen(rev_start) >=
+		needle_len && mbstrncasecmp(rev_start, needle,
+		needle_len) == 0)
+	    return (char *)rev_start;
 
-	    if (rev_start == haystack)
-		begin_line = TRUE;
-	    else {
-		rev_start = haystack + move_mbleft(haystack, rev_start -
-			haystack);
-		rev_start_len++;
-	    }
+	/* Since move_mbleft() has to work its way from the start of the
+	 * string anyway, go forward through the characters before
+	 * rev_start instead, and keep the last match. */
+	for (; haystack < rev_start && haystack_len >= needle_len;
+		haystack += move_mbright(haystack, 0), haystack_len--) {
+	    if (!cant_start_match(haystack, first) &&
+		mbstrncasecmp(haystack, needle, needle_len) == 0)
+		found = haystack;
 	}
 
-	return NULL;
+	return (char *)found;
     } else
 #endif
 	return revstrcasestr(haystack, needle, rev_start);
@@ -764,11 +855,28 @@ size_t mbstrnlen(const char *s, size_t maxlen)
 
 #ifdef ENABLE_UTF8
     if (use_utf8) {
-	size_t n = 0;
+	size_t n = 0, left = strlen(s);
+
+	while (left > 0 && maxlen > 0) {
+	    size_t run = plain_ascii_len(s, (left < maxlen) ? left :
+		maxlen);
+	    int s_len;
+
+	    s += run;
+	    left -= run;
+	    maxlen -= run;
+	    n += run;
 
-	for (; *s != '\0' && maxlen > 0; s += move_mbright(s, 0),
-		maxlen--, n++)
-	    ;
+	    if (left == 0 || maxlen == 0)
+		break;
+
+	    s_len = parse_mbchar(s, NULL, NULL);
+
+	    s += s_len;
+	    left -= s_len;
+	    maxlen--;
+	    n++;
+	}
 
 	return n;
     } else
@@ -25,6 +25,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <signal.h>
 
 #ifdef ENABLE_COLOR
 
@@ -102,9 +104,1043 @@ void color_init(void)
     }
 }
 
+/* Add the byte c to the bitmap map, in both cases if icase is TRUE. */
+void add_firstbyte(unsigned char *map, int c, bool icase)
+{
+    map[c / 8] |= 1 << (c % 8);
+
+    if (icase && isalpha(c)) {
+	int other = islower(c) ? toupper(c) : tolower(c);
+
+	map[other / 8] |= 1 << (other % 8);
+    }
+}
+
+/* Add the bytes for which the ctype function isclass() is TRUE to map,
+ * along with all non-ASCII bytes, since any of them may begin a
+ * multibyte character of the class. */
+void add_firstbyte_class(unsigned char *map, int (*isclass)(int))
+{
+    int c;
+
+    for (c = 1; c < 256; c++)
+	if (c >= 0x80 || isclass == NULL || isclass(c))
+	    add_firstbyte(map, c, FALSE);
+}
+
+/* Add the bytes that the bracket expression at *p, just after its '[',
+ * matches to map, and move *p past its ']'.  Return FALSE if we can't
+ * make sense of it. */
+bool bracket_firstbytes(const char **p, unsigned char *map, bool icase)
+{
+    unsigned char set[32];
+    bool negate = FALSE;
+    const char *ptr = *p;
+    int i;
+
+    memset(set, 0, sizeof(set));
+
+    if (*ptr == '^') {
+	negate = TRUE;
+	ptr++;
+    }
+
+    if (*ptr == ']') {
+	add_firstbyte(set, ']', icase);
+	ptr++;
+    }
+
+    while (*ptr != '\0' && *ptr != ']') {
+	if (*ptr == '[' && (ptr[1] == ':' || ptr[1] == '.' || ptr[1] ==
+		'=')) {
+	    char endclass[3] = {ptr[1], ']', '\0'};
+	    const char *name = ptr + 2, *end = strstr(name, endclass);
+	    int (*isclass)(int) = NULL;
+
+	    if (end == NULL)
+		return FALSE;
+
+	    if (ptr[1] == ':') {
+		if (strncmp(name, "alpha:", 6) == 0)
+		    isclass = isalpha;
+		else if (strncmp(name, "alnum:", 6) == 0)
+		    isclass = isalnum;
+		else if (strncmp(name, "digit:", 6) == 0)
+		    isclass = isdigit;
+		else if (strncmp(name, "xdigit:", 7) == 0)
+		    isclass = isxdigit;
+		else if (strncmp(name, "space:", 6) == 0)
+		    isclass = isspace;
+		else if (strncmp(name, "blank:", 6) == 0)
+		    isclass = isblank;
+		else if (strncmp(name, "punct:", 6) == 0)
+		    isclass = ispunct;
+		else if (strncmp(name, "upper:", 6) == 0 ||
+			strncmp(name, "lower:", 6) == 0)
+		    isclass = icase ? isalpha : (name[0] == 'u') ?
+			isupper : islower;
+	    }
+
+	    add_firstbyte_class(set, isclass);
+	    ptr = end + 2;
+	} else if (ptr[1] == '-' && ptr[2] != ']' && ptr[2] != '\0') {
+	    int c = (unsigned char)ptr[0], last = (unsigned char)ptr[2];
+
+	    /* Ranges depend on the locale, so add both cases of any
+	     * letters in them to be safe. */
+	    for (; c <= last; c++)
+		add_firstbyte(set, c, TRUE);
+	    if (last >= 0x80)
+		add_firstbyte_class(set, NULL);
+	    ptr += 3;
+	} else {
+	    add_firstbyte(set, (unsigned char)*ptr, icase);
+	    ptr++;
+	}
+    }
+
+    if (*ptr != ']')
+	return FALSE;
+
+    /* A negated set can match nearly anything, and since we're
+     * generous with ranges and classes, we can't say what it leaves
+     * out. */
+    if (negate)
+	add_firstbyte_class(map, NULL);
+    else
+	for (i = 0; i < 32; i++)
+	    map[i] |= set[i];
+
+    *p = ptr + 1;
+
+    return TRUE;
+}
+
+/* Add the bytes that a match of the alternation of extended regexes at
+ * *p can begin with to map, and move *p to the unmatched ')' or the
+ * null terminator that ends it.  Return TRUE if it can match the empty
+ * string, or if we can't make sense of it. */
+bool alt_firstbytes(const char **p, unsigned char *map, bool icase)
+{
+    bool nullable = FALSE;
+
+    while (TRUE) {
+	bool seq_nullable = TRUE;
+	    /* Can everything in this branch so far match nothing? */
+
+	while (**p != '\0' && **p != '|' && **p != ')') {
+	    unsigned char atom[32];
+	    bool atom_nullable = FALSE;
+	    const char *ptr = *p;
+	    int i;
+
+	    memset(atom, 0, sizeof(atom));
+
+	    switch (*ptr) {
+		case '(':
+		    *p = ptr + 1;
+		    atom_nullable = alt_firstbytes(p, atom, icase);
+		    if (**p != ')')
+			return TRUE;
+		    (*p)++;
+		    break;
+		case '[':
+		    /* The word boundaries that fixbounds() may produce
+		     * match nothing. */
+		    if (strncmp(ptr, "[[:<:]]", 7) == 0 || strncmp(ptr,
+			"[[:>:]]", 7) == 0) {
+			atom_nullable = TRUE;
+			*p = ptr + 7;
+		    } else {
+			*p = ptr + 1;
+			if (!bracket_firstbytes(p, atom, icase))
+			    return TRUE;
+		    }
+		    break;
+		case '.':
+		    add_firstbyte_class(atom, NULL);
+		    *p = ptr + 1;
+		    break;
+		case '^':
+		case '$':
+		    atom_nullable = TRUE;
+		    *p = ptr + 1;
+		    break;
+		case '\\':
+		    if (ptr[1] == '\0' || isdigit((unsigned char)ptr[1]))
+			return TRUE;
+		    else if (strchr("<>bB`'", ptr[1]) != NULL)
+			atom_nullable = TRUE;
+		    else if (ptr[1] == 'w') {
+			add_firstbyte_class(atom, isalnum);
+			add_firstbyte(atom, '_', FALSE);
+		    } else if (strchr("WsS", ptr[1]) != NULL)
+			add_firstbyte_class(atom, NULL);
+		    else
+			add_firstbyte(atom, (unsigned char)ptr[1], icase);
+		    *p = ptr + 2;
+		    break;
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+		    return TRUE;
+		default:
+		    add_firstbyte(atom, (unsigned char)*ptr, icase);
+		    *p = ptr + 1;
+	    }
+
+	    /* Handle any repetition of the atom. */
+	    while (**p == '*' || **p == '+' || **p == '?' || **p ==
+		'{') {
+		if (**p == '{') {
+		    const char *end = strchr(*p, '}');
+
+		    if (end == NULL || !isdigit((unsigned char)(*p)[1]))
+			return TRUE;
+		    if (atoi(*p + 1) == 0)
+			atom_nullable = TRUE;
+		    *p = end;
+		} else if (**p != '+')
+		    atom_nullable = TRUE;
+		(*p)++;
+	    }
+
+	    if (seq_nullable) {
+		for (i = 0; i < 32; i++)
+		    map[i] |= atom[i];
+		seq_nullable = atom_nullable;
+	    }
+	}
+
+	if (seq_nullable)
+	    nullable = TRUE;
+
+	if (**p != '|')
+	    break;
+
+	(*p)++;
+    }
+
+    return nullable;
+}
+
+/* Work out which bytes a match of the extended regex regex can begin
+ * with, so that edit_draw() can skip running it on lines that don't
+ * contain any of them.  Return a bitmap of them, or NULL if a match can
+ * begin anywhere. */
+unsigned char *regex_firstbytes(const char *regex, bool icase)
+{
+    unsigned char *map = (unsigned char *)nmalloc(32);
+    const char *ptr = regex;
+
+    memset(map, 0, 32);
+
+    if (alt_firstbytes(&ptr, map, icase) || *ptr != '\0') {
+	free(map);
+	map = NULL;
+    }
+
+    return map;
+}
+
+/* Free the count words in the array words, and the array. */
+void free_words(char **words, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+	free(words[i]);
+    free(words);
+}
+
+/* Replace the *count words in *words with every concatenation of one of
+ * them and one of the nsuffixes words in suffixes.  Return FALSE, and
+ * leave *words alone, if that would make more than MAX_KEYWORDS
+ * words. */
+bool append_words(char ***words, size_t *count, char **suffixes, size_t
+	nsuffixes)
+{
+    char **result;
+    size_t i, j, n = 0;
+
+    if (*count * nsuffixes > MAX_KEYWORDS)
+	return FALSE;
+
+    result = (char **)nmalloc(*count * nsuffixes * sizeof(char *));
+
+    for (i = 0; i < *count; i++) {
+	for (j = 0; j < nsuffixes; j++) {
+	    result[n] = charalloc(strlen((*words)[i]) +
+		strlen(suffixes[j]) + 1);
+	    sprintf(result[n], "%s%s", (*words)[i], suffixes[j]);
+	    n++;
+	}
+    }
+
+    free_words(*words, *count);
+    *words = result;
+    *count = n;
+
+    return TRUE;
+}
+
+/* Set *words to the *count one-character words that the bracket
+ * expression at *p matches, and move *p past it.  Return FALSE if it's
+ * not made only of letters, digits, underscores and ranges of those,
+ * or of other punctuation too if punct is TRUE. */
+bool bracket_words(const char **p, char ***words, size_t *count, bool
+	punct)
+{
+    const char *ptr = *p + 1;
+    size_t i;
+
+    *words = NULL;
+    *count = 0;
+
+    if (*ptr == ']' || *ptr == '^')
+	return FALSE;
+
+    for (; *ptr != ']'; ptr++) {
+	int first = (unsigned char)*ptr, last = first, c;
+
+	if (!isalnum(first) && first != '_' && (!punct ||
+		!ispunct(first) || first == '[' || first == '\\'))
+	    break;
+
+	/* A range has to be of digits, or of lowercase or of uppercase
+	 * letters. */
+	if (ptr[1] == '-' && ptr[2] != ']' && ptr[2] != '\0') {
+	    last = (unsigned char)ptr[2];
+	    if (last < first || !((isdigit(first) && isdigit(last)) ||
+		(islower(first) && islower(last)) || (isupper(first) &&
+		isupper(last))))
+		break;
+	    ptr += 2;
+	}
+
+	for (c = first; c <= last; c++) {
+	    if (*count == MAX_KEYWORDS)
+		break;
+	    *words = (char **)nrealloc(*words, (*count + 1) *
+		sizeof(char *));
+	    (*words)[*count] = charalloc(2);
+	    (*words)[*count][0] = (char)c;
+	    (*words)[(*count)++][1] = '\0';
+	}
+
+	if (c <= last)
+	    break;
+    }
+
+    if (*ptr != ']') {
+	free_words(*words, *count);
+	*words = NULL;
+	*count = 0;
+	return FALSE;
+    }
+
+    /* A character that's given twice is still only one word. */
+    for (i = 1; i < *count; i++) {
+	size_t j;
+
+	for (j = 0; j < i; j++) {
+	    if ((*words)[j][0] == (*words)[i][0])
+		break;
+	}
+
+	if (j < i) {
+	    free((*words)[i]);
+	    (*words)[i--] = (*words)[--(*count)];
+	}
+    }
+
+    *p = ptr + 1;
+
+    return TRUE;
+}
+
+/* Set *words to the *count words that the alternation of extended
+ * regexes at *p matches, and move *p to the unmatched ')' or the null
+ * terminator that ends it.  Return FALSE if it's not made only of
+ * letters, digits, underscores, bracket expressions of those,
+ * parentheses, bars and question marks, or if it matches too many
+ * words.  If punct is TRUE, also allow punctuation, escaped with a
+ * backslash where it would have a special meaning. */
+bool alt_keywords(const char **p, char ***words, size_t *count, bool
+	punct)
+{
+    *words = NULL;
+    *count = 0;
+
+    while (TRUE) {
+	char **seq = (char **)nmalloc(sizeof(char *));
+	size_t seqcount = 1, i;
+	    /* The words that this branch so far matches. */
+
+	seq[0] = mallocstrcpy(NULL, "");
+
+	while (**p != '\0' && **p != '|' && **p != ')') {
+	    char **atom;
+	    size_t atomcount;
+	    bool ok;
+
+	    if (**p == '(') {
+		(*p)++;
+		ok = alt_keywords(p, &atom, &atomcount, punct);
+		if (ok && **p == ')')
+		    (*p)++;
+		else
+		    ok = FALSE;
+	    } else if (**p == '[') {
+		ok = bracket_words(p, &atom, &atomcount, punct);
+	    } else if (**p == '\\' && punct) {
+		ok = (ispunct((unsigned char)(*p)[1]) != 0);
+		atom = (char **)nmalloc(2 * sizeof(char *));
+		atom[0] = mallocstrncpy(NULL, *p + 1, 2);
+		atom[0][1] = '\0';
+		atomcount = 1;
+		*p += ok ? 2 : 1;
+	    } else {
+		ok = (isalnum((unsigned char)**p) || **p == '_' || (punct &&
+			strchr("!\"#%&',-/:;<=>@`~", **p) != NULL));
+		atom = (char **)nmalloc(2 * sizeof(char *));
+		atom[0] = mallocstrncpy(NULL, *p, 2);
+		atom[0][1] = '\0';
+		atomcount = 1;
+		(*p)++;
+	    }
+
+	    if (ok && **p == '?') {
+		atom = (char **)nrealloc(atom, (atomcount + 1) *
+			sizeof(char *));
+		atom[atomcount++] = mallocstrcpy(NULL, "");
+		(*p)++;
+	    }
+
+	    if (ok && (**p == '*' || **p == '+' || **p == '?' || **p ==
+		'{'))
+		ok = FALSE;
+
+	    if (ok)
+		ok = append_words(&seq, &seqcount, atom, atomcount);
+
+	    free_words(atom, atomcount);
+
+	    if (!ok) {
+		free_words(seq, seqcount);
+		free_words(*words, *count);
+		*words = NULL;
+		*count = 0;
+		return FALSE;
+	    }
+	}
+
+	if (*count + seqcount > MAX_KEYWORDS) {
+	    free_words(seq, seqcount);
+	    free_words(*words, *count);
+	    *words = NULL;
+	    *count = 0;
+	    return FALSE;
+	}
+
+	*words = (char **)nrealloc(*words, (*count + seqcount) *
+		sizeof(char *));
+	for (i = 0; i < seqcount; i++)
+	    (*words)[(*count)++] = seq[i];
+	free(seq);
+
+	if (**p != '|')
+	    break;
+
+	(*p)++;
+    }
+
+    return TRUE;
+}
+
+/* Return the bucket of a syntax's keyword table that the first len
+ * bytes of word go in. */
+size_t keyword_hash(const char *word, size_t len)
+{
+    size_t hash = 0;
+
+    for (; len > 0; len--, word++)
+	hash = hash * 31 + (unsigned char)*word;
+
+    return hash % KEYWORD_BUCKETS;
+}
+
+/* If the single-line color tmpcolor only matches whole words from a
+ * list, such as "\<(if|else|while)\>" does, add those words to the
+ * keyword table of syntax, so that find_keywords() can match all such
+ * colors in one pass over a line instead of running each regex over it
+ * separately. */
+void add_keywords(syntaxtype *syntax, colortype *tmpcolor)
+{
+    const char *regex = tmpcolor->start_regex, *ptr;
+    size_t len = strlen(regex), count, i;
+    char *middle, **words;
+    bool ok;
+
+    /* Strip off the word boundaries around the list. */
+    if (strncmp(regex, "\\<", 2) == 0 || strncmp(regex, "\\b", 2) == 0)
+	regex += 2;
+    else if (strncmp(regex, "[[:<:]]", 7) == 0)
+	regex += 7;
+    else
+	return;
+
+    len -= regex - tmpcolor->start_regex;
+
+    if (len >= 2 && (strcmp(regex + len - 2, "\\>") == 0 ||
+	strcmp(regex + len - 2, "\\b") == 0))
+	len -= 2;
+    else if (len >= 7 && strcmp(regex + len - 7, "[[:>:]]") == 0)
+	len -= 7;
+    else
+	return;
+
+    middle = mallocstrncpy(NULL, regex, len + 1);
+    middle[len] = '\0';
+    ptr = middle;
+
+    ok = alt_keywords(&ptr, &words, &count, FALSE) && *ptr == '\0';
+
+    free(middle);
+
+    if (!ok) {
+	free_words(words, count);
+	return;
+    }
+
+    if (syntax->keywords == NULL) {
+	syntax->keywords = (keywordtype **)nmalloc(KEYWORD_BUCKETS *
+		sizeof(keywordtype *));
+	for (i = 0; i < KEYWORD_BUCKETS; i++)
+	    syntax->keywords[i] = NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+	char *word = words[i], *c;
+	keywordtype *kw, **bucket;
+
+	/* An empty word can't be matched between word boundaries. */
+	if (*word == '\0') {
+	    free(word);
+	    continue;
+	}
+
+	if (tmpcolor->icase) {
+	    for (c = word; *c != '\0'; c++)
+		*c = tolower((unsigned char)*c);
+	}
+
+	bucket = &syntax->keywords[keyword_hash(word, strlen(word))];
+
+	for (kw = *bucket; kw != NULL; kw = kw->next) {
+	    if (kw->color == tmpcolor && strcmp(kw->word, word) == 0)
+		break;
+	}
+
+	if (kw != NULL) {
+	    free(word);
+	    continue;
+	}
+
+	kw = (keywordtype *)nmalloc(sizeof(keywordtype));
+	kw->word = word;
+	kw->color = tmpcolor;
+	kw->next = *bucket;
+	*bucket = kw;
+    }
+
+    free(words);
+
+    tmpcolor->keywords = TRUE;
+    if (tmpcolor->icase)
+	syntax->icase_keywords = TRUE;
+}
+
+/* Find the words in the line text that the keyword colors of the
+ * current syntax match, in one pass over it, and set *count to how many
+ * matches there are.  Return the matches, in the order of the words in
+ * the line.  The line must be plain ASCII, as only then do letters,
+ * digits and underscores alone make up its words. */
+const colorspan *find_keywords(const char *text, size_t *count)
+{
+    static colorspan *matches = NULL;
+    static size_t matches_size = 0;
+	/* The matches we've found, and how many there's room for. */
+    const syntaxtype *syntax = openfile->syntax;
+    char *lowered = NULL;
+    size_t lowered_size = 0;
+    const char *ptr = text;
+
+    *count = 0;
+
+    while (*ptr != '\0') {
+	const char *word;
+	size_t len;
+	bool upper = FALSE;
+	int pass;
+
+	if (!isalnum((unsigned char)*ptr) && *ptr != '_') {
+	    ptr++;
+	    continue;
+	}
+
+	for (word = ptr; isalnum((unsigned char)*ptr) || *ptr == '_';
+		ptr++) {
+	    if (isupper((unsigned char)*ptr))
+		upper = TRUE;
+	}
+
+	len = ptr - word;
+
+	/* Look the word up as it is, and then, if it has capitals and
+	 * there are case insensitive colors, in lowercase for them. */
+	for (pass = 0; pass < 2; pass++) {
+	    const keywordtype *kw;
+
+	    if (pass == 1) {
+		size_t i;
+
+		if (!upper || !syntax->icase_keywords)
+		    break;
+
+		if (len + 1 > lowered_size) {
+		    lowered_size = len + 1;
+		    lowered = charealloc(lowered, lowered_size);
+		}
+		for (i = 0; i < len; i++)
+		    lowered[i] = tolower((unsigned char)word[i]);
+		lowered[len] = '\0';
+		word = lowered;
+	    }
+
+	    for (kw = syntax->keywords[keyword_hash(word, len)];
+		kw != NULL; kw = kw->next) {
+		if ((pass == 0 || kw->color->icase) && strncmp(kw->word,
+			word, len) == 0 && kw->word[len] == '\0') {
+		    if (*count == matches_size) {
+			matches_size = (matches_size == 0) ? 32 :
+				matches_size * 2;
+			matches = (colorspan *)nrealloc(matches,
+				matches_size * sizeof(colorspan));
+		    }
+		    matches[*count].so = ptr - text - len;
+		    matches[*count].eo = ptr - text;
+		    matches[*count].color = kw->color;
+		    (*count)++;
+		}
+	    }
+	}
+    }
+
+    if (lowered != NULL)
+	free(lowered);
+
+    return matches;
+}
+
+/* Make sure the spans of fileptr, the matches of all single-line
+ * regexes of the current syntax on it, are worked out for its current
+ * text. */
+void calc_spans(filestruct *fileptr)
+{
+    static colorspan *spans = NULL;
+    static size_t spans_size = 0;
+	/* The spans we've found, and how many there's room for. */
+    size_t nspans = 0;
+    unsigned int hash = line_hash(fileptr->data);
+    const colortype *tmpcolor = openfile->colorstrings;
+    unsigned char linebytes[32];
+	/* A bitmap of the bytes in the line. */
+    const colorspan *keywords = NULL;
+    size_t nkeywords = 0;
+	/* The matches of the keyword colors on the line. */
+    const char *ptr;
+    size_t len;
+    int i;
+
+    if (fileptr->spans != NULL) {
+	if (fileptr->spanhash == hash)
+	    return;
+	free(fileptr->spans);
+    }
+
+    /* Go over the line once to see which bytes are in it, so that we
+     * can skip the single-line regexes that can't match it. */
+    memset(linebytes, 0, sizeof(linebytes));
+    for (ptr = fileptr->data; *ptr != '\0'; ptr++)
+	linebytes[(unsigned char)*ptr / 8] |= 1 << ((unsigned char)*ptr %
+		8);
+    len = ptr - fileptr->data;
+
+    /* If the line is plain ASCII, find the words of all keyword colors
+     * on it at once.  Otherwise, leave them to their regexes, which
+     * know which multibyte characters are letters. */
+    for (i = 16; i < 32 && linebytes[i] == 0; i++)
+	;
+    if (i == 32 && openfile->syntax->keywords != NULL)
+	keywords = find_keywords(fileptr->data, &nkeywords);
+
+    for (; tmpcolor != NULL; tmpcolor = tmpcolor->next) {
+	size_t k = 0, kw = 0;
+	regmatch_t startmatch;
+
+	if (tmpcolor->end != NULL)
+	    continue;
+
+	if (tmpcolor->firstbytes != NULL) {
+	    for (i = 0; i < 32 && !(tmpcolor->firstbytes[i] &
+		linebytes[i]); i++)
+		;
+	    if (i == 32)
+		continue;
+	}
+
+	/* We move k past the end of each match.  Even though two
+	 * matches may overlap, we want to ignore them, so that we can
+	 * highlight e.g. C strings correctly. */
+	while (k < len) {
+	    if (tmpcolor->keywords && keywords != NULL) {
+		/* Take the next match of this keyword color from the
+		 * ones we found. */
+		while (kw < nkeywords && keywords[kw].color != tmpcolor)
+		    kw++;
+		if (kw == nkeywords)
+		    break;
+		startmatch.rm_so = keywords[kw].so;
+		startmatch.rm_eo = keywords[kw].eo;
+		kw++;
+	    } else {
+		/* Note the fifth parameter to regexec().  It says not
+		 * to match the beginning-of-line character unless k is
+		 * zero.  If regexec() returns REG_NOMATCH, there are no
+		 * more matches in the line. */
+		if (regexec(tmpcolor->start, &fileptr->data[k], 1,
+			&startmatch, (k == 0) ? 0 : REG_NOTBOL) ==
+			REG_NOMATCH)
+		    break;
+		/* Translate the match to the beginning of the line. */
+		startmatch.rm_so += k;
+		startmatch.rm_eo += k;
+	    }
+
+	    /* Skip over a zero-length regex match. */
+	    if (startmatch.rm_so == startmatch.rm_eo)
+		startmatch.rm_eo++;
+	    else {
+		if (nspans + 1 >= spans_size) {
+		    spans_size = (spans_size == 0) ? 32 : spans_size * 2;
+		    spans = (colorspan *)nrealloc(spans, spans_size *
+			sizeof(colorspan));
+		}
+		spans[nspans].so = startmatch.rm_so;
+		spans[nspans].eo = startmatch.rm_eo;
+		spans[nspans].color = tmpcolor;
+		nspans++;
+	    }
+
+	    k = startmatch.rm_eo;
+	}
+    }
+
+    fileptr->spans = (colorspan *)nmalloc((nspans + 1) *
+	sizeof(colorspan));
+    if (nspans > 0)
+	memcpy(fileptr->spans, spans, nspans * sizeof(colorspan));
+    fileptr->spans[nspans].color = NULL;
+    fileptr->spanhash = hash;
+}
+
+/* The compiled regexes of all syntaxes, so that each regex is compiled
+ * only once, however many colors and buffers use it. */
+static regexcachetype *regex_cache[REGEX_BUCKETS];
+
+/* Return the regex string regex compiled with REG_EXTENDED and cflags,
+ * compiling it only the first time it's asked for.  If it doesn't
+ * compile, return NULL, and set *errstr to the reason if errstr isn't
+ * NULL. */
+regex_t *get_regex(const char *regex, int cflags, char **errstr)
+{
+    size_t hash = (size_t)cflags;
+    const char *ptr;
+    regexcachetype *entry;
+    int rc;
+
+    for (ptr = regex; *ptr != '\0'; ptr++)
+	hash = hash * 31 + (unsigned char)*ptr;
+    hash %= REGEX_BUCKETS;
+
+    for (entry = regex_cache[hash]; entry != NULL; entry = entry->next) {
+	if (entry->cflags == cflags && strcmp(entry->regex, regex) == 0)
+	    return &entry->compiled;
+    }
+
+    entry = (regexcachetype *)nmalloc(sizeof(regexcachetype));
+    rc = regcomp(&entry->compiled, fixbounds(regex), REG_EXTENDED |
+	cflags);
+
+    if (rc != 0) {
+	if (errstr != NULL) {
+	    size_t len = regerror(rc, &entry->compiled, NULL, 0);
+
+	    *errstr = charalloc(len);
+	    regerror(rc, &entry->compiled, *errstr, len);
+	}
+	regfree(&entry->compiled);
+	free(entry);
+	return NULL;
+    }
+
+    entry->regex = mallocstrcpy(NULL, regex);
+    entry->cflags = cflags;
+    entry->next = regex_cache[hash];
+    regex_cache[hash] = entry;
+
+    return &entry->compiled;
+}
+
+/* Free all the compiled regexes. */
+void free_regexes(void)
+{
+    size_t i;
+
+    for (i = 0; i < REGEX_BUCKETS; i++) {
+	while (regex_cache[i] != NULL) {
+	    regexcachetype *entry = regex_cache[i];
+
+	    regex_cache[i] = entry->next;
+	    regfree(&entry->compiled);
+	    free(entry->regex);
+	    free(entry);
+	}
+    }
+}
+
+/* The syntaxes by the file name endings that their extension regexes
+ * match, when those are simple enough to be listed, such as "\.c$"
+ * and "\.(c|h)$" are; the other extension regexes, in the order of
+ * their syntaxes; and the syntaxes that file names turned out to
+ * pick. */
+static syntaxindextype *suffix_table[SYNTAX_BUCKETS];
+static syntaxindextype *regex_exts = NULL;
+static syntaxindextype *name_table[SYNTAX_BUCKETS];
+static bool syntaxes_indexed = FALSE;
+static syntaxtype *default_syntax = NULL;
+	/* The syntax named "default", if there is one. */
+
+/* Return the bucket of the syntax tables that key goes in. */
+size_t syntax_hash(const char *key)
+{
+    size_t hash = 0;
+
+    for (; *key != '\0'; key++)
+	hash = hash * 31 + (unsigned char)*key;
+
+    return hash % SYNTAX_BUCKETS;
+}
+
+/* Add an entry for key, or for ext if key is NULL, that picks syntax,
+ * which is the order'th syntax, to the list at *list. */
+void add_syntax_entry(syntaxindextype **list, char *key, exttype *ext,
+	syntaxtype *syntax, size_t order)
+{
+    syntaxindextype *entry =
+	(syntaxindextype *)nmalloc(sizeof(syntaxindextype));
+
+    entry->key = key;
+    entry->ext = ext;
+    entry->syntax = syntax;
+    entry->order = order;
+    entry->next = *list;
+    *list = entry;
+}
+
+/* Sort the extension regexes of all syntaxes into the table of file
+ * name endings, where that can be done, and into the list of those that
+ * have to be run against file names otherwise. */
+void index_syntaxes(void)
+{
+    syntaxindextype **endregex = &regex_exts;
+    syntaxtype *tmpsyntax;
+    size_t order = 0;
+
+    for (tmpsyntax = syntaxes; tmpsyntax != NULL; tmpsyntax =
+	tmpsyntax->next, order++) {
+	exttype *e;
+
+	/* The default syntax has no extensions, and is used only when
+	 * no other syntax fits.  A syntax without colors is never
+	 * picked. */
+	if (strcmp(tmpsyntax->desc, "default") == 0) {
+	    default_syntax = tmpsyntax;
+	    continue;
+	}
+
+	if (tmpsyntax->color == NULL)
+	    continue;
+
+	for (e = tmpsyntax->extensions; e != NULL; e = e->next) {
+	    size_t len = strlen(e->ext_regex), count = 0, i;
+	    char *middle, **words = NULL;
+	    const char *ptr;
+	    bool ok = FALSE;
+
+	    /* See whether the regex matches only a list of file name
+	     * endings that all start with a dot. */
+	    if (len > 1 && e->ext_regex[len - 1] == '$' &&
+		e->ext_regex[len - 2] != '\\') {
+		middle = mallocstrncpy(NULL, e->ext_regex, len);
+		middle[len - 1] = '\0';
+		ptr = middle;
+
+		ok = alt_keywords(&ptr, &words, &count, TRUE) && *ptr ==
+			'\0' && count > 0;
+
+		for (i = 0; ok && i < count; i++)
+		    ok = (words[i][0] == '.');
+
+		free(middle);
+	    }
+
+	    if (!ok) {
+		free_words(words, count);
+		add_syntax_entry(endregex, NULL, e, tmpsyntax, order);
+		endregex = &(*endregex)->next;
+		continue;
+	    }
+
+	    /* An ending that an earlier syntax already has goes to this
+	     * one, since a later syntax overrides an earlier one. */
+	    for (i = 0; i < count; i++) {
+		syntaxindextype **bucket =
+			&suffix_table[syntax_hash(words[i])];
+		syntaxindextype *entry = *bucket;
+
+		for (; entry != NULL; entry = entry->next) {
+		    if (strcmp(entry->key, words[i]) == 0)
+			break;
+		}
+
+		if (entry == NULL)
+		    add_syntax_entry(bucket, words[i], NULL, tmpsyntax,
+			order);
+		else {
+		    entry->syntax = tmpsyntax;
+		    entry->order = order;
+		    free(words[i]);
+		}
+	    }
+
+	    free(words);
+	}
+    }
+
+    syntaxes_indexed = TRUE;
+}
+
+/* Return the last syntax with an extension regex that matches the file
+ * name filename, or NULL if there's none.  The endings of the file name
+ * are looked up in the table, and only the extension regexes of
+ * syntaxes after the one found there are run against it.  What we find
+ * is remembered for the next time the same file name comes up. */
+syntaxtype *syntax_for_filename(const char *filename)
+{
+    syntaxindextype **bucket;
+    const syntaxindextype *entry;
+    syntaxtype *found = NULL;
+    size_t found_order = 0;
+    const char *dot;
+
+    if (!syntaxes_indexed)
+	index_syntaxes();
+
+    bucket = &name_table[syntax_hash(filename)];
+
+    for (entry = *bucket; entry != NULL; entry = entry->next) {
+	if (strcmp(entry->key, filename) == 0)
+	    return entry->syntax;
+    }
+
+    for (dot = strchr(filename, '.'); dot != NULL; dot = strchr(dot +
+	1, '.')) {
+	for (entry = suffix_table[syntax_hash(dot)]; entry != NULL;
+		entry = entry->next) {
+	    if ((found == NULL || entry->order > found_order) &&
+		strcmp(entry->key, dot) == 0) {
+		found = entry->syntax;
+		found_order = entry->order;
+	    }
+	}
+    }
+
+    /* The list is in the order of the syntaxes, so once an extension
+     * of a syntax has matched, the rest of its extensions are skipped. */
+    for (entry = regex_exts; entry != NULL; entry = entry->next) {
+	exttype *e = entry->ext;
+
+	if (found != NULL && entry->order <= found_order)
+	    continue;
+
+	/* e->ext_regex has already been checked for validity
+	 * elsewhere.  Get its compiled regex if we haven't already. */
+	if (e->ext == NULL)
+	    e->ext = get_regex(e->ext_regex, REG_NOSUB, NULL);
+
+	if (e->ext != NULL && regexec(e->ext, filename, 0, NULL,
+		0) == 0) {
+	    found = entry->syntax;
+	    found_order = entry->order;
+	}
+    }
+
+    add_syntax_entry(bucket, mallocstrcpy(NULL, filename), NULL, found,
+	0);
+
+    return found;
+}
+
+/* Free the tables of syntaxes. */
+void free_syntax_index(void)
+{
+    size_t i;
+
+    for (i = 0; i < SYNTAX_BUCKETS; i++) {
+	while (suffix_table[i] != NULL) {
+	    syntaxindextype *entry = suffix_table[i];
+
+	    suffix_table[i] = entry->next;
+	    free(entry->key);
+	    free(entry);
+	}
+	while (name_table[i] != NULL) {
+	    syntaxindextype *entry = name_table[i];
+
+	    name_table[i] = entry->next;
+	    free(entry->key);
+	    free(entry);
+	}
+    }
+
+    while (regex_exts != NULL) {
+	syntaxindextype *entry = regex_exts;
+
+	regex_exts = entry->next;
+	free(entry);
+    }
+
+    syntaxes_indexed = FALSE;
+    default_syntax = NULL;
+}
+
 /* Update the color information based on the current filename. */
 void color_update(void)
 {
+    syntaxtype *oldsyntax = openfile->syntax;
     syntaxtype *tmpsyntax;
     syntaxtype *defsyntax = NULL;
     colortype *tmpcolor, *defcolor = NULL;
@@ -137,51 +1173,18 @@ void color_update(void)
      * there was no syntax by that name, get the syntax based on the
      * file extension, and then look in the header. */
     if (openfile->colorstrings == NULL) {
-	for (tmpsyntax = syntaxes; tmpsyntax != NULL;
-		tmpsyntax = tmpsyntax->next) {
-	    exttype *e;
-
-	    /* If this is the default syntax, it has no associated
-	     * extensions, which we've checked for elsewhere.  Skip over
-	     * it here, but keep track of its color regexes. */
-	    if (strcmp(tmpsyntax->desc, "default") == 0) {
-		defsyntax = tmpsyntax;
-		defcolor = tmpsyntax->color;
-		continue;
-	    }
-
-	    for (e = tmpsyntax->extensions; e != NULL; e = e->next) {
-		bool not_compiled = (e->ext == NULL);
-
-		/* e->ext_regex has already been checked for validity
-		 * elsewhere.  Compile its specified regex if we haven't
-		 * already. */
-		if (not_compiled) {
-		    e->ext = (regex_t *)nmalloc(sizeof(regex_t));
-		    regcomp(e->ext, fixbounds(e->ext_regex), REG_EXTENDED);
-		}
-
-		/* Set colorstrings if we matched the extension
-		 * regex. */
-		if (regexec(e->ext, openfile->filename, 0, NULL,
-			0) == 0) {
-		    openfile->syntax = tmpsyntax;
-		    openfile->colorstrings = tmpsyntax->color;
-		}
-
-		if (openfile->colorstrings != NULL)
-		    break;
+	tmpsyntax = syntax_for_filename(openfile->filename);
 
-		/* Decompile e->ext_regex's specified regex if we aren't
-		 * going to use it. */
-		if (not_compiled) {
-		    regfree(e->ext);
-		    free(e->ext);
-		    e->ext = NULL;
-		}
-	    }
+	if (tmpsyntax != NULL) {
+	    openfile->syntax = tmpsyntax;
+	    openfile->colorstrings = tmpsyntax->color;
 	}
 
+	/* Keep track of the color regexes of the default syntax. */
+	defsyntax = default_syntax;
+	if (defsyntax != NULL)
+	    defcolor = defsyntax->color;
+
 	/* If we haven't matched anything yet, try the headers */
 	if (openfile->colorstrings == NULL) {
 #ifdef DEBUG
@@ -192,36 +1195,25 @@ void color_update(void)
 		exttype *e;
 
 		for (e = tmpsyntax->headers; e != NULL; e = e->next) {
-		    bool not_compiled = (e->ext == NULL);
-
 		    /* e->ext_regex has already been checked for validity
-		     * elsewhere.  Compile its specified regex if we haven't
+		     * elsewhere.  Get its compiled regex if we haven't
 		     * already. */
-		    if (not_compiled) {
-			e->ext = (regex_t *)nmalloc(sizeof(regex_t));
-			regcomp(e->ext, fixbounds(e->ext_regex), REG_EXTENDED);
-		    }
+		    if (e->ext == NULL)
+			e->ext = get_regex(e->ext_regex, 0, NULL);
 
 		    /* Set colorstrings if we matched the extension
 		     * regex. */
 #ifdef DEBUG
 		fprintf(stderr, "Comparing header regex \"%s\" to fileage \"%s\"...\n", e->ext_regex, openfile->fileage->data);
 #endif
-		    if (regexec(e->ext, openfile->fileage->data, 0, NULL, 0) == 0) {
+		    if (e->ext != NULL && regexec(e->ext,
+			openfile->fileage->data, 0, NULL, 0) == 0) {
 			openfile->syntax = tmpsyntax;
 			openfile->colorstrings = tmpsyntax->color;
 		    }
 
 		    if (openfile->colorstrings != NULL)
 			break;
-
-		    /* Decompile e->ext_regex's specified regex if we aren't
-		     * going to use it. */
-		    if (not_compiled) {
-			regfree(e->ext);
-			free(e->ext);
-			e->ext = NULL;
-		    }
 		}
 	    }
 	}
@@ -238,123 +1230,359 @@ void color_update(void)
     for (tmpcolor = openfile->colorstrings; tmpcolor != NULL;
 	tmpcolor = tmpcolor->next) {
 	/* tmpcolor->start_regex and tmpcolor->end_regex have already
-	 * been checked for validity elsewhere.  Compile their specified
+	 * been checked for validity elsewhere.  Get their compiled
 	 * regexes if we haven't already. */
 	if (tmpcolor->start == NULL) {
-	    tmpcolor->start = (regex_t *)nmalloc(sizeof(regex_t));
-	    regcomp(tmpcolor->start, fixbounds(tmpcolor->start_regex),
-		REG_EXTENDED | (tmpcolor->icase ? REG_ICASE : 0));
+	    tmpcolor->start = get_regex(tmpcolor->start_regex,
+		tmpcolor->icase ? REG_ICASE : 0, NULL);
+	    if (tmpcolor->end_regex == NULL) {
+		tmpcolor->firstbytes =
+			regex_firstbytes(tmpcolor->start_regex,
+			tmpcolor->icase);
+		add_keywords(openfile->syntax, tmpcolor);
+	    }
 	}
 
-	if (tmpcolor->end_regex != NULL && tmpcolor->end == NULL) {
-	    tmpcolor->end = (regex_t *)nmalloc(sizeof(regex_t));
-	    regcomp(tmpcolor->end, fixbounds(tmpcolor->end_regex),
-		REG_EXTENDED | (tmpcolor->icase ? REG_ICASE : 0));
+	if (tmpcolor->end_regex != NULL && tmpcolor->end == NULL)
+	    tmpcolor->end = get_regex(tmpcolor->end_regex,
+		tmpcolor->icase ? REG_ICASE : 0, NULL);
+    }
+
+    /* What we know about the regexes of the old syntax doesn't apply
+     * to the new one. */
+    if (openfile->syntax != oldsyntax) {
+	if (oldsyntax != NULL) {
+	    filestruct *fileptr = openfile->fileage;
+
+	    for (; fileptr != NULL; fileptr = fileptr->next) {
+		if (fileptr->multidata != NULL) {
+		    free(fileptr->multidata);
+		    fileptr->multidata = NULL;
+		}
+		if (fileptr->spans != NULL) {
+		    free(fileptr->spans);
+		    fileptr->spans = NULL;
+		}
+	    }
 	}
+
+	if (openfile->endsearch_from != NULL) {
+	    free(openfile->endsearch_from);
+	    free(openfile->endsearch_found);
+	    openfile->endsearch_from = NULL;
+	    openfile->endsearch_found = NULL;
+	}
+
+	openfile->multi_valid = 0;
+	openfile->idle_top = NULL;
+
+	forget_rows();
     }
 }
 
-/* Reset the multicolor info cache for records for any lines which need
-   to be recalculated */
-void reset_multis_after(filestruct *fileptr, int mindex)
+/* Find the next region of the multi-line regex tmpcolor in text, which
+ * is len bytes long, starting at *pos.  *inside says whether *pos is
+ * inside a region already, in which case the region starts there;
+ * otherwise it starts at the next start match.  It ends after the first
+ * end match following that, or at the end of text if there is none.
+ * Return FALSE if there's no region left.  Otherwise, set *so and *eo
+ * to where the region starts and ends, set *inside to whether it runs
+ * off the end of text, and move *pos past it. */
+bool next_multi_region(const colortype *tmpcolor, const char *text,
+	size_t len, size_t *pos, bool *inside, size_t *so, size_t *eo)
 {
-    filestruct *oof;
-    for (oof = fileptr->next; oof != NULL; oof = oof->next) {
-	alloc_multidata_if_needed(oof);
-	if (oof->multidata == NULL)
-	    continue;
-	if (oof->multidata[mindex] != CNONE)
-	    oof->multidata[mindex] = -1;
-	else
-	    break;
+    regmatch_t match;
+    size_t from = *pos;
+
+    assert(tmpcolor != NULL && tmpcolor->end != NULL && text != NULL);
+
+    if (from > len)
+	return FALSE;
+
+    if (*inside)
+	*so = from;
+    else {
+	if (regexec(tmpcolor->start, text + from, 1, &match, (from ==
+		0) ? 0 : REG_NOTBOL) == REG_NOMATCH)
+	    return FALSE;
+	*so = from + match.rm_so;
+	from += match.rm_eo;
     }
-    for (; oof != NULL; oof = oof->next) {
-	alloc_multidata_if_needed(oof);
-	if (oof->multidata == NULL)
-	    continue;
-	if (oof->multidata[mindex] == CNONE)
-	    oof->multidata[mindex] = -1;
-	else
-	    break;
+
+    if (regexec(tmpcolor->end, text + from, 1, &match, (from == 0) ?
+	0 : REG_NOTBOL) == 0) {
+	*eo = from + match.rm_eo;
+	*inside = FALSE;
+    } else {
+	*eo = len;
+	*inside = TRUE;
     }
-    edit_refresh_needed = TRUE;
+
+    /* Always move forward, even past a zero-length region. */
+    *pos = (*eo > *pos) ? *eo : *pos + 1;
+
+    return TRUE;
 }
 
-void reset_multis_before(filestruct *fileptr, int mindex)
+/* Work out from the state of the multi-line regexes at the start of
+ * fileptr what it is at the start of the line after it.  Return TRUE if
+ * that's different from what we had for that line. */
+bool carry_multis(filestruct *fileptr)
 {
-    filestruct *oof;
-    for (oof = fileptr->prev; oof != NULL; oof = oof->prev) {
-	alloc_multidata_if_needed(oof);
-	if (oof->multidata == NULL)
+    const colortype *tmpcolor = openfile->colorstrings;
+    size_t len = strlen(fileptr->data);
+    bool changed;
+
+    assert(fileptr->next != NULL);
+
+    changed = (fileptr->next->multidata == NULL);
+    alloc_multidata_if_needed(fileptr);
+    alloc_multidata_if_needed(fileptr->next);
+
+    for (; tmpcolor != NULL; tmpcolor = tmpcolor->next) {
+	short *md = &fileptr->next->multidata[tmpcolor->id];
+	size_t pos = 0, so, eo;
+	bool inside;
+
+	if (tmpcolor->end == NULL)
 	    continue;
-	if (oof->multidata[mindex] != CNONE)
-	    oof->multidata[mindex] = -1;
-	else
-	    break;
+
+	inside = (fileptr->multidata[tmpcolor->id] & CSTARTSINSIDE);
+
+	while (next_multi_region(tmpcolor, fileptr->data, len, &pos,
+		&inside, &so, &eo) && !inside)
+	    ;
+
+	if (inside != ((*md & CSTARTSINSIDE) != 0)) {
+	    *md ^= CSTARTSINSIDE;
+	    changed = TRUE;
+	}
     }
-    for (; oof != NULL; oof = oof->prev) {
-	alloc_multidata_if_needed(oof);
-	if (oof->multidata == NULL)
-	    continue;
-	if (oof->multidata[mindex] == CNONE)
-	    oof->multidata[mindex] = -1;
-	else
-	    break;
+
+    return changed;
+}
+
+/* Make sure that the state of the multi-line regexes at the start of
+ * fileptr is worked out, by carrying it forward from the last line
+ * above whose state we know.  While the buffer is partitioned, the
+ * lines at the edges of the partition are cut short, so what we work
+ * out then is only good for painting and isn't kept. */
+void calc_multis(filestruct *fileptr)
+{
+    filestruct *f = fileptr;
+
+    if (fileptr->lineno <= openfile->multi_valid &&
+	fileptr->multidata != NULL)
+	return;
+
+    while (f->prev != NULL && (f->lineno > openfile->multi_valid ||
+	f->multidata == NULL))
+	f = f->prev;
+
+    /* Nothing is open at the start of the first line. */
+    if (f->lineno > openfile->multi_valid || f->multidata == NULL) {
+	int i;
+
+	alloc_multidata_if_needed(f);
+	for (i = 0; i < openfile->syntax->nmultis; i++)
+	    f->multidata[i] &= ~CSTARTSINSIDE;
+    }
+
+    for (; f != fileptr; f = f->next)
+	carry_multis(f);
+
+    if (filepart == NULL)
+	openfile->multi_valid = fileptr->lineno;
+}
+
+/* Forget where the last searches for end matches began and ended, since
+ * lines may have changed or gone away. */
+void forget_endsearches(void)
+{
+    if (openfile->endsearch_from != NULL) {
+	int i;
+
+	for (i = 0; i < openfile->syntax->nmultis; i++)
+	    openfile->endsearch_from[i] = NULL;
+    }
+}
+
+/* Return TRUE if any line after fileptr has an end match of the
+ * multi-line regex tmpcolor.  We don't paint regions that never end.
+ * When asked about consecutive lines, as edit_refresh() does, we carry
+ * the answer over instead of searching all over again. */
+bool multi_ends_later(const filestruct *fileptr, const colortype
+	*tmpcolor)
+{
+    filestruct *from = fileptr->next, *f;
+    int id = tmpcolor->id;
+
+    if (from == NULL)
+	return FALSE;
+
+    if (openfile->endsearch_from == NULL) {
+	openfile->endsearch_from = (filestruct **)nmalloc(
+		openfile->syntax->nmultis * sizeof(filestruct *));
+	openfile->endsearch_found = (filestruct **)nmalloc(
+		openfile->syntax->nmultis * sizeof(filestruct *));
+	forget_endsearches();
     }
 
-    edit_refresh_needed = TRUE;
+    /* If the last search started on this line or the one before it,
+     * and found its end match after this one, that's our answer. */
+    if (openfile->endsearch_from[id] == from || (openfile->
+	endsearch_from[id] == fileptr && openfile->endsearch_found[id] !=
+	fileptr))
+	f = openfile->endsearch_found[id];
+    else {
+	for (f = from; f != NULL; f = f->next) {
+	    alloc_multidata_if_needed(f);
+	    if (!(f->multidata[id] & CENDCHECKED)) {
+		f->multidata[id] |= CENDCHECKED;
+		if (regexec(tmpcolor->end, f->data, 0, NULL, 0) == 0)
+		    f->multidata[id] |= CHASEND;
+	    }
+	    if (f->multidata[id] & CHASEND)
+		break;
+	}
+    }
+
+    openfile->endsearch_from[id] = from;
+    openfile->endsearch_found[id] = f;
+
+    return (f != NULL);
 }
 
-/* Reset one multiline regex info */
-void reset_multis_for_id(filestruct *fileptr, int num)
+/* Lines after line number lineno of the current buffer have been added
+ * or removed, so the multi-line regex states we know of after it have
+ * to be worked out again, and regions on the rows above them may have
+ * lost or gained their ends. */
+void reset_multis_after(ssize_t lineno)
 {
-    reset_multis_before(fileptr, num);
-    reset_multis_after(fileptr, num);
-    fileptr->multidata[num] = -1;
+    if (openfile->multi_valid > lineno)
+	openfile->multi_valid = lineno;
+    openfile->idle_top = NULL;
+
+    forget_endsearches();
+
+    if (openfile->syntax != NULL && openfile->syntax->nmultis > 0)
+	forget_rows();
 }
 
-/* Reset multi line strings around a filestruct ptr, trying to be smart about stopping
-   force = reset everything regardless, useful when we don't know how much screen state
-           has changed  */
-void reset_multis(filestruct *fileptr, bool force)
+/* The text of fileptr has changed.  Forget its spans, and work out the
+ * multi-line regex states of the lines after it again, but only until
+ * they come out the same as before, since from there on nothing
+ * changes.  If that takes more than a screenful of lines, leave the
+ * rest for calc_multis() to do when they're needed. */
+void reset_multis(filestruct *fileptr)
 {
-    int nobegin, noend;
-    regmatch_t startmatch, endmatch;
     const colortype *tmpcolor = openfile->colorstrings;
+    bool changed = FALSE;
 
-    if (!openfile->syntax)
+    if (fileptr->spans != NULL) {
+	free(fileptr->spans);
+	fileptr->spans = NULL;
+    }
+    openfile->idle_top = NULL;
+
+    if (openfile->syntax == NULL || openfile->syntax->nmultis == 0)
 	return;
 
+    forget_endsearches();
+
+    /* A line we know nothing about can't be trusted to have the right
+     * state at its start either. */
+    if (fileptr->multidata == NULL) {
+	reset_multis_after(fileptr->lineno - 1);
+	alloc_multidata_if_needed(fileptr);
+    }
+
     for (; tmpcolor != NULL; tmpcolor = tmpcolor->next) {
+	short *md = &fileptr->multidata[tmpcolor->id];
 
-	/* If it's not a multi-line regex, amscray */
 	if (tmpcolor->end == NULL)
 	    continue;
 
-	alloc_multidata_if_needed(fileptr);
-	if (force == TRUE) {
-	    reset_multis_for_id(fileptr, tmpcolor->id);
-	    continue;
+	/* If the line gained or lost an end match, regions on the lines
+	 * above it may now be painted differently. */
+	if ((*md & CENDCHECKED) && ((*md & CHASEND) != 0) !=
+		(regexec(tmpcolor->end, fileptr->data, 0, NULL, 0) ==
+		0)) {
+	    forget_rows();
+	    changed = TRUE;
 	}
 
-	/* Figure out where the first begin and end are to determine if
-	   things changed drastically for the precalculated multi values */
-        nobegin = regexec(tmpcolor->start, fileptr->data, 1, &startmatch, 0);
-        noend = regexec(tmpcolor->end, fileptr->data, 1, &endmatch, 0);
-	if (fileptr->multidata[tmpcolor->id] ==  CWHOLELINE) {
-	    if (nobegin && noend)
-		continue;
-	} else if (fileptr->multidata[tmpcolor->id] == CNONE) {
-	    if (nobegin && noend)
-		continue;
-	}  else if (fileptr->multidata[tmpcolor->id] & CBEGINBEFORE && !noend
-	  && (nobegin || endmatch.rm_eo > startmatch.rm_eo)) {
-	    reset_multis_after(fileptr, tmpcolor->id);
-	    continue;
+	*md &= ~(CENDCHECKED | CHASEND);
+    }
+
+    if (filepart != NULL)
+	reset_multis_after(fileptr->lineno);
+    else if (fileptr->lineno < openfile->multi_valid) {
+	filestruct *f = fileptr;
+	int count = 0;
+
+	calc_multis(fileptr);
+
+	for (; f->next != NULL && f->next->lineno <=
+		openfile->multi_valid && carry_multis(f); f = f->next) {
+	    changed = TRUE;
+
+	    if (++count > editwinrows) {
+		openfile->multi_valid = f->next->lineno;
+		break;
+	    }
 	}
+    }
+
+    if (changed)
+	edit_refresh_needed = TRUE;
+}
+
+/* While we're waiting for a key on win, work out the spans and the
+ * multi-line regex states of the lines in the screenful below the edit
+ * window and the one above it, and after that of all lines in the file,
+ * so that scrolling and paging paint from them.  Stop as soon as a key
+ * comes in, and don't start if neither the lines nor the edit window
+ * have changed since we last got through them all. */
+void idle_highlight(WINDOW *win)
+{
+    filestruct *fileptr;
+    int pass, count = 0;
 
-	/* If we got here assume the worst */
-	reset_multis_for_id(fileptr, tmpcolor->id);
+    if (!ISSET(IDLE_HIGHLIGHT) || openfile == NULL ||
+	openfile->colorstrings == NULL || ISSET(NO_COLOR_SYNTAX) ||
+	filepart != NULL || openfile->idle_top == openfile->edittop)
+	return;
+
+    nodelay(win, TRUE);
+
+    for (pass = 0; pass < 3; pass++) {
+	int rows = (pass == 2) ? -1 : (pass == 0) ? 2 * editwinrows :
+		editwinrows;
+
+	fileptr = (pass == 2) ? openfile->fileage : openfile->edittop;
+
+	while (fileptr != NULL && rows-- != 0) {
+	    if (pass < 2 || fileptr->spans == NULL ||
+		(openfile->syntax->nmultis > 0 && (fileptr->lineno >
+		openfile->multi_valid || fileptr->multidata == NULL))) {
+		if (++count % 32 == 0 && idle_interrupted(win)) {
+		    nodelay(win, FALSE);
+		    return;
+		}
+
+		calc_spans(fileptr);
+		if (openfile->syntax->nmultis > 0)
+		    calc_multis(fileptr);
+	    }
+
+	    fileptr = (pass == 1) ? fileptr->prev : fileptr->next;
+	}
     }
+
+    openfile->idle_top = openfile->edittop;
+
+    nodelay(win, FALSE);
 }
+
 #endif /* ENABLE_COLOR */
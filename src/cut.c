@@ -215,7 +215,7 @@ void do_cut_text(
     edit_refresh_needed = TRUE;
 
 #ifdef ENABLE_COLOR
-    reset_multis(openfile->current, FALSE);
+    reset_multis(openfile->current);
 #endif
 
 #ifdef DEBUG
@@ -282,7 +282,7 @@ void do_uncut_text(void)
     edit_refresh_needed = TRUE;
 
 #ifdef ENABLE_COLOR
-    reset_multis(openfile->current, FALSE);
+    reset_multis(openfile->current);
 #endif
 
 #ifdef DEBUG
@@ -31,6 +31,23 @@
 #include <errno.h>
 #include <ctype.h>
 #include <pwd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#ifndef NANO_TINY
+static bool reading_original = FALSE;
+	/* Whether the lines being read in are those of a file that's
+	 * being opened, as it is on disk. */
+
+static unsigned int journal_sum(const char *data, size_t len);
+static bool recover_journal(const char *name);
+#endif
 
 /* Add an entry to the openfile openfilestruct.  This should only be
  * called from open_buffer(). */
@@ -77,6 +94,23 @@ void initialize_buffer(void)
     openfile->current_stat = NULL;
     openfile->undotop = NULL;
     openfile->current_undo = NULL;
+    openfile->undobot = NULL;
+    openfile->undo_size = 0;
+    openfile->undo_map = NULL;
+    openfile->undo_map_len = 0;
+
+    openfile->journal = NULL;
+    openfile->journal_end = 0;
+    openfile->journal_lines = 0;
+    openfile->journal_due = 0;
+    openfile->journal_ours = FALSE;
+
+    openfile->unloaded = FALSE;
+    openfile->last_shown = time(NULL);
+    openfile->unloaded_lineno = 0;
+    openfile->unloaded_top = 0;
+
+    openfile->paged = NULL;
 #endif
 #ifdef ENABLE_COLOR
     openfile->colorstrings = NULL;
@@ -95,9 +129,15 @@ void initialize_buffer_text(void)
     openfile->filebot = openfile->fileage;
     openfile->edittop = openfile->fileage;
     openfile->current = openfile->fileage;
+    openfile->renumber_pending = NULL;
+#ifndef NANO_TINY
+    openfile->lineindex_len = 0;
+#endif
 
 #ifdef ENABLE_COLOR
     openfile->fileage->multidata = NULL;
+    openfile->fileage->spans = NULL;
+    reset_multis_after(0);
 #endif
 
     openfile->totsize = 0;
@@ -143,16 +183,32 @@ void open_buffer(const char *filename, bool undoable)
     if (rc != -1 && new_buffer)
 	openfile->filename = mallocstrcpy(openfile->filename, filename);
 
-    /* If we have a non-new file, read it in.  Then, if the buffer has
-     * no stat, update the stat, if applicable. */
+    fill_buffer(f, rc, filename, undoable, new_buffer);
+}
+
+/* Read the file filename, for which open_file() returned rc and f, into
+ * the current buffer, which is a new one if new_buffer is TRUE. */
+void fill_buffer(FILE *f, int rc, const char *filename, bool undoable,
+	bool new_buffer)
+{
+    /* If we have a non-new file, read it in, or page through it when
+     * it's big and only going to be viewed.  Then, if the buffer has no
+     * stat, update the stat, if applicable. */
     if (rc > 0) {
-	read_file(f, rc, filename, undoable, new_buffer);
 #ifndef NANO_TINY
+	if (!new_buffer || !page_file(f)) {
+	    reading_original = (new_buffer && autosave > 0);
+	    read_file(f, rc, filename, undoable, new_buffer);
+	    reading_original = FALSE;
+	}
+
 	if (openfile->current_stat == NULL) {
 	    openfile->current_stat =
 		(struct stat *)nmalloc(sizeof(struct stat));
 	    stat(filename, openfile->current_stat);
 	}
+#else
+	read_file(f, rc, filename, undoable, new_buffer);
 #endif
     }
 
@@ -164,6 +220,23 @@ void open_buffer(const char *filename, bool undoable)
 	openfile->placewewant = 0;
     }
 
+#ifndef NANO_TINY
+    /* If a new buffer has unsaved changes left in an autosave journal,
+     * get them back.  Otherwise, get the undo history of the file. */
+    if (rc != -1 && new_buffer && filename[0] != '\0' &&
+	openfile->paged == NULL) {
+	filestruct *fileptr = openfile->filebot;
+
+	while (fileptr != NULL && fileptr->journalno <= 0)
+	    fileptr = fileptr->prev;
+	openfile->journal_lines = (fileptr == NULL) ? 0 :
+		fileptr->journalno;
+
+	if (!recover_journal(filename) && rc > 0)
+	    map_undo_history(filename);
+    }
+#endif
+
 #ifdef ENABLE_COLOR
     /* If we're loading into a new buffer, update the colors to account
      * for it, if applicable. */
@@ -172,6 +245,462 @@ void open_buffer(const char *filename, bool undoable)
 #endif
 }
 
+#if !defined(NANO_TINY) && defined(ENABLE_MULTIBUFFER)
+/* Add a new buffer for the file filename, but only take note of its
+ * name and stat, leaving the reading of its text until the buffer is
+ * switched to.  Open files that aren't plain readable ones right away,
+ * so that the trouble with them shows up as it always has. */
+void open_buffer_lazily(const char *filename)
+{
+    struct stat fileinfo;
+
+    if (filename[0] == '\0' ||
+#ifndef DISABLE_OPERATINGDIR
+	check_operating_dir(filename, FALSE) ||
+#endif
+	stat(filename, &fileinfo) == -1 || !S_ISREG(fileinfo.st_mode) ||
+	access(filename, R_OK) == -1) {
+	open_buffer(filename, FALSE);
+	return;
+    }
+
+    make_new_buffer();
+
+    openfile->filename = mallocstrcpy(openfile->filename, filename);
+    openfile->current_stat = (struct stat *)nmalloc(sizeof(struct stat));
+    *openfile->current_stat = fileinfo;
+    openfile->unloaded = TRUE;
+}
+
+/* If the text of the current buffer hasn't been read in yet, or has
+ * been let go of by unload_buffers(), read it in now, and put the
+ * cursor back where it was. */
+void load_buffer(void)
+{
+    size_t pww_save = openfile->placewewant;
+    FILE *f;
+    int rc;
+
+    if (!openfile->unloaded)
+	return;
+
+    openfile->unloaded = FALSE;
+
+    /* The file may have changed since it was last looked at, so get
+     * its stat anew along with its text. */
+    free(openfile->current_stat);
+    openfile->current_stat = NULL;
+
+    rc = open_file(openfile->filename, TRUE, &f);
+    fill_buffer(f, rc, openfile->filename, FALSE, TRUE);
+
+    /* The lines are new, so nothing that was worked out about the old
+     * ones holds anymore. */
+    edit_count++;
+
+    /* Unless changes were recovered from an autosave journal, which
+     * put the cursor where it was then, put it back where it was when
+     * the text was let go of. */
+    if (openfile->unloaded_lineno > 0 && !openfile->modified) {
+	filestruct *top = fsfromline(openfile->unloaded_top);
+
+	openfile->current = fsfromline(openfile->unloaded_lineno);
+	if (openfile->current == NULL)
+	    openfile->current = openfile->filebot;
+	openfile->current_x = actual_x(openfile->current->data,
+		pww_save);
+	openfile->placewewant = pww_save;
+
+	if (top != NULL && top->lineno <= openfile->current->lineno) {
+	    openfile->edittop = top;
+	    openfile->current_y = openfile->current->lineno -
+		top->lineno;
+	}
+
+    }
+
+    openfile->unloaded_lineno = 0;
+}
+
+/* Let go of the text of each buffer other than the current one that
+ * hasn't been switched to for unload_after seconds, as long as it can
+ * be read back in from its file as it is: it has to be unmodified, and
+ * it mustn't have undo items in memory.  An undo history that is only
+ * mapped in from its file is mapped in again when the file is read. */
+void unload_buffers(void)
+{
+    openfilestruct *was_openfile = openfile;
+    time_t now = time(NULL);
+
+    if (unload_after == 0)
+	return;
+
+    for (openfile = was_openfile->next; openfile != was_openfile;
+	openfile = openfile->next) {
+	if (openfile->unloaded || openfile->modified ||
+		openfile->paged != NULL ||
+		openfile->filename[0] == '\0' ||
+		openfile->journal != NULL ||
+		openfile->undotop != NULL ||
+		now - openfile->last_shown < unload_after)
+	    continue;
+
+	renumber_flush();
+	openfile->unloaded_lineno = openfile->current->lineno;
+	openfile->unloaded_top = openfile->edittop->lineno;
+	openfile->mark_set = FALSE;
+
+	free_filestruct(openfile->fileage);
+	if (openfile->lineblock != NULL) {
+	    lineblock_release(openfile->lineblock);
+	    openfile->lineblock = NULL;
+	}
+	initialize_buffer_text();
+	forget_undo_history(openfile);
+	openfile->unloaded = TRUE;
+
+	/* Nothing that was worked out about the lines, such as where
+	 * the matches of the last search are, holds anymore. */
+	edit_count++;
+    }
+
+    openfile = was_openfile;
+}
+#endif
+
+#ifndef NANO_TINY
+/* If f is open on a file that's big enough, and it's only going to be
+ * viewed, map the file in, and put only a window of its lines into the
+ * current buffer, instead of reading all of them in.  The rest are read
+ * from the mapping when they're needed.  A DOS or Mac file, which
+ * read_file() would convert, is read in after all.  Return TRUE if we
+ * page through the file. */
+bool page_file(FILE *f)
+{
+    struct stat fileinfo;
+    pagedtype *p;
+    void *map;
+    const char *nl;
+    int fd;
+
+    if (!ISSET(VIEW_MODE) || fstat(fileno(f), &fileinfo) == -1 ||
+	!S_ISREG(fileinfo.st_mode) || fileinfo.st_size < PAGED_MIN_SIZE)
+	return FALSE;
+
+    map = mmap(NULL, fileinfo.st_size, PROT_READ, MAP_PRIVATE,
+	fileno(f), 0);
+    if (map == MAP_FAILED)
+	return FALSE;
+
+    /* read_file() decides on the format of a file by its first line,
+     * so a file whose first line has no '\r' in it is a *nix file. */
+    nl = (const char *)memchr(map, '\n', fileinfo.st_size);
+    if ((!ISSET(NO_CONVERT) && memchr(map, '\r', (nl != NULL) ?
+	nl - (const char *)map : fileinfo.st_size) != NULL) ||
+	(fd = dup(fileno(f))) == -1) {
+	munmap(map, fileinfo.st_size);
+	return FALSE;
+    }
+
+    fclose(f);
+
+    p = (pagedtype *)nmalloc(sizeof(pagedtype));
+    p->map = (char *)map;
+    p->map_size = fileinfo.st_size;
+    p->fd = fd;
+    p->size = fileinfo.st_size;
+    p->starts_size = 64;
+    p->starts = (size_t *)nmalloc(p->starts_size * sizeof(size_t));
+    p->starts[0] = 0;
+    p->starts_len = 1;
+    p->scanned = 0;
+    p->newlines = 0;
+
+    openfile->paged = p;
+    openfile->totsize = p->size;
+    paged_window(1);
+
+    statusbar(_("Paging through %lu bytes"), (unsigned long)p->size);
+
+    return TRUE;
+}
+
+/* Unmap the paged file p, and free what we know about it. */
+void free_paged(pagedtype *p)
+{
+    munmap(p->map, p->map_size);
+    close(p->fd);
+    free(p->starts);
+    free(p);
+}
+
+/* If the paged file p has been truncated since we last looked, don't
+ * read the mapping past its new end anymore, since that gets us a
+ * SIGBUS, and forget where the lines that are gone start.  Return TRUE
+ * if it has. */
+static bool paged_clamp(pagedtype *p)
+{
+    struct stat fileinfo;
+
+    if (fstat(p->fd, &fileinfo) == -1 || (size_t)fileinfo.st_size >=
+	p->size)
+	return FALSE;
+
+    p->size = fileinfo.st_size;
+    openfile->totsize = p->size;
+
+    while (p->starts_len > 1 && p->starts[p->starts_len - 1] > p->size)
+	p->starts_len--;
+
+    if (p->scanned > p->size) {
+	p->scanned = p->starts[p->starts_len - 1];
+	p->newlines = (p->starts_len - 1) * PAGED_STRIDE;
+    }
+
+    return TRUE;
+}
+
+/* If the paged file of the current buffer has been truncated since we
+ * last looked, put the lines around the cursor that are still there
+ * into memory, as paged_window() does.  This has to be done before the
+ * mapping is read anywhere else.  Return TRUE if it has. */
+bool paged_truncated(void)
+{
+    if (!paged_clamp(openfile->paged))
+	return FALSE;
+
+    paged_window(openfile->current->lineno);
+
+    return TRUE;
+}
+
+/* Look for newlines in the paged file p until we know where line
+ * lineno starts, or until we get to the end of the file.  Remember
+ * where every PAGED_STRIDE'th line starts on the way. */
+static void paged_scan(pagedtype *p, ssize_t lineno)
+{
+    while (p->newlines + 1 < lineno && p->scanned < p->size) {
+	const char *nl = (const char *)memchr(p->map + p->scanned, '\n',
+		p->size - p->scanned);
+
+	if (nl == NULL) {
+	    p->scanned = p->size;
+	    break;
+	}
+
+	p->scanned = nl + 1 - p->map;
+	p->newlines++;
+
+	if (p->newlines % PAGED_STRIDE == 0) {
+	    if (p->starts_len == p->starts_size) {
+		p->starts_size *= 2;
+		p->starts = (size_t *)nrealloc(p->starts, p->starts_size *
+			sizeof(size_t));
+	    }
+	    p->starts[p->starts_len++] = p->scanned;
+	}
+    }
+}
+
+/* Return how many lines the paged file of the current buffer has.  The
+ * last one is empty when the file ends with a newline. */
+ssize_t paged_lines(void)
+{
+    pagedtype *p = openfile->paged;
+
+    paged_scan(p, (ssize_t)p->size + 1);
+
+    return p->newlines + 1;
+}
+
+/* Return where line lineno of the paged file of the current buffer
+ * starts.  The file has to have that line. */
+size_t paged_line_start(ssize_t lineno)
+{
+    pagedtype *p = openfile->paged;
+    ssize_t i = (lineno - 1) / PAGED_STRIDE, n;
+    size_t offset;
+
+    paged_scan(p, lineno);
+
+    assert(lineno >= 1 && lineno <= p->newlines + 1);
+
+    offset = p->starts[i];
+    for (n = i * PAGED_STRIDE + 1; n < lineno; n++)
+	offset = (const char *)memchr(p->map + offset, '\n', p->size -
+		offset) + 1 - p->map;
+
+    return offset;
+}
+
+/* Return where the line before the one that starts at offset in the
+ * paged file of the current buffer starts.  offset can't be that of the
+ * first line. */
+size_t paged_prev_line(size_t offset)
+{
+    const char *map = openfile->paged->map;
+
+    assert(offset > 0);
+
+    /* Skip the newline that ends the line before, and look for the one
+     * before that. */
+    offset--;
+    while (offset > 0 && map[offset - 1] != '\n')
+	offset--;
+
+    return offset;
+}
+
+/* Copy the line that starts at offset in the paged file of the current
+ * buffer into *buf, which is *buf_size bytes and is grown if needed,
+ * converting its nulls to newlines the way read_line() does.  Return
+ * where the next line starts, or a place past the end of the file if
+ * there isn't one. */
+size_t paged_copy_line(size_t offset, char **buf, size_t *buf_size)
+{
+    const pagedtype *p = openfile->paged;
+    const char *start = p->map + offset;
+    const char *end = (const char *)memchr(start, '\n', p->size -
+	offset);
+    size_t len = ((end != NULL) ? end : p->map + p->size) - start;
+
+    if (len + 1 > *buf_size) {
+	*buf_size = len + 1;
+	*buf = charealloc(*buf, *buf_size);
+    }
+
+    memcpy(*buf, start, len);
+    (*buf)[len] = '\0';
+
+    unsunder(*buf, len);
+
+    return (end != NULL) ? (size_t)(end + 1 - p->map) : p->size + 1;
+}
+
+/* Put the PAGED_WINDOW lines around line lineno of the paged file of
+ * the current buffer into memory, in place of the ones that are there
+ * now.  Keep the cursor, the top of the edit window, and the mark on
+ * the lines with the same numbers if they're in the new window.
+ * Otherwise, put the cursor on line lineno, or on the last line if
+ * there's no such line. */
+void paged_window(ssize_t lineno)
+{
+    pagedtype *p = openfile->paged;
+    ssize_t current_lineno = openfile->current->lineno;
+    ssize_t top_lineno = openfile->edittop->lineno;
+    ssize_t mark_lineno = 0, first, last, n;
+    filestruct *fileptr = NULL;
+    size_t offset;
+
+    if (openfile->mark_set)
+	mark_lineno = openfile->mark_begin->lineno;
+
+    paged_clamp(p);
+
+    first = lineno - PAGED_WINDOW / 2;
+    if (first < 1)
+	first = 1;
+    last = first + PAGED_WINDOW - 1;
+
+    /* If the file ends before the window does, end the window there,
+     * and fill it from earlier lines instead. */
+    paged_scan(p, last);
+    if (p->newlines + 1 < last) {
+	last = p->newlines + 1;
+	first = last - PAGED_WINDOW + 1;
+	if (first < 1)
+	    first = 1;
+    }
+
+    free_filestruct(openfile->fileage);
+
+    offset = paged_line_start(first);
+    for (n = first; n <= last; n++) {
+	filestruct *newnode = make_new_node(fileptr);
+	size_t data_size = 0;
+
+	offset = paged_copy_line(offset, &newnode->data, &data_size);
+	newnode->lineno = n;
+
+	if (fileptr == NULL)
+	    openfile->fileage = newnode;
+	else
+	    fileptr->next = newnode;
+	fileptr = newnode;
+    }
+
+    openfile->filebot = fileptr;
+    openfile->renumber_pending = NULL;
+
+    /* fsfromline() walks from the current line too, so start it off on
+     * one that's there. */
+    openfile->current = openfile->fileage;
+    openfile->current = fsfromline(current_lineno);
+
+    /* When the cursor has gone, leave the top of the edit window at the
+     * start of the window, so that the edit window is scrolled to the
+     * cursor the way it is when the cursor moves far. */
+    if (openfile->current == NULL) {
+	if (lineno > last)
+	    lineno = last;
+	openfile->current = openfile->fileage;
+	openfile->current = fsfromline(lineno);
+	openfile->current_x = 0;
+	openfile->placewewant = 0;
+	openfile->edittop = openfile->fileage;
+    } else {
+	/* The line may have been cut short by truncating the file. */
+	if (openfile->current_x > strlen(openfile->current->data)) {
+	    openfile->current_x = strlen(openfile->current->data);
+	    openfile->placewewant = xplustabs();
+	}
+
+	openfile->edittop = fsfromline(top_lineno);
+	if (openfile->edittop == NULL)
+	    openfile->edittop = openfile->current;
+    }
+
+    openfile->current_y = openfile->current->lineno -
+	openfile->edittop->lineno;
+
+    if (openfile->mark_set) {
+	openfile->mark_begin = fsfromline(mark_lineno);
+	if (openfile->mark_begin == NULL)
+	    openfile->mark_set = FALSE;
+	else if (openfile->mark_begin_x >
+		strlen(openfile->mark_begin->data))
+	    openfile->mark_begin_x = strlen(openfile->mark_begin->data);
+    }
+
+    /* The lines are new, so nothing that was worked out about the old
+     * ones holds anymore. */
+    edit_count++;
+    forget_rows();
+#ifdef ENABLE_COLOR
+    reset_multis_after(0);
+#endif
+}
+
+/* If the cursor in a paged buffer has come within a quarter of a window
+ * of either end of the lines that are in memory, and the file goes on
+ * past that end, move the window so that the cursor is in the middle of
+ * it again. */
+void paged_follow(void)
+{
+    const pagedtype *p = openfile->paged;
+
+    if (p == NULL)
+	return;
+
+    if ((openfile->fileage->lineno > 1 && openfile->current->lineno -
+	openfile->fileage->lineno < PAGED_WINDOW / 4) ||
+	((p->scanned < p->size || openfile->filebot->lineno <
+	p->newlines + 1) && openfile->filebot->lineno -
+	openfile->current->lineno < PAGED_WINDOW / 4))
+	paged_window(openfile->current->lineno);
+}
+#endif /* !NANO_TINY */
+
 #ifndef DISABLE_SPELLER
 /* If it's not "", filename is a file to open.  We blow away the text of
  * the current buffer, and then open and read the file, if
@@ -193,6 +722,9 @@ void replace_buffer(const char *filename)
     /* Reinitialize the text of the current buffer. */
     free_filestruct(openfile->fileage);
     initialize_buffer_text();
+#ifndef NANO_TINY
+    forget_undo_history(openfile);
+#endif
 
     /* If we have a non-new file, read it in. */
     if (rc > 0)
@@ -217,7 +749,9 @@ void display_buffer(void)
     color_init();
 #endif
 
-    /* Update the edit window. */
+    /* Update the edit window, all of it, since what it showed was from
+     * another buffer or from no buffer at all. */
+    forget_rows();
     edit_refresh();
 }
 
@@ -235,10 +769,22 @@ void switch_to_prevnext_buffer(bool next_buf)
 	return;
     }
 
+#ifndef NANO_TINY
+    openfile->last_shown = time(NULL);
+#endif
+
     /* Switch to the next or previous file buffer, depending on the
      * value of next_buf. */
     openfile = next_buf ? openfile->next : openfile->prev;
 
+#ifndef NANO_TINY
+    /* Read in the text of the buffer if that hasn't been done yet, and
+     * let go of the text of the ones that haven't been seen in a
+     * while. */
+    load_buffer();
+    unload_buffers();
+#endif
+
 #ifdef DEBUG
     fprintf(stderr, "filename is %s\n", openfile->filename);
 #endif
@@ -339,7 +885,7 @@ int is_file_writable(const char *filename)
 filestruct *read_line(char *buf, filestruct *prevnode, bool
 	*first_line_ins, size_t buf_len)
 {
-    filestruct *fileptr = (filestruct *)nmalloc(sizeof(filestruct));
+    filestruct *fileptr;
 
     /* Convert nulls to newlines.  buf_len is the string's real
      * length. */
@@ -347,7 +893,17 @@ filestruct *read_line(char *buf, filestruct *prevnode, bool
 
     assert(openfile->fileage != NULL && strlen(buf) == buf_len);
 
-    fileptr->data = mallocstrcpy(NULL, buf);
+    /* Carve the node and its text out of the current buffer's line
+     * block, so that we don't need two malloc()s per line.  Overly long
+     * lines get memory of their own.  When a line is resized later on,
+     * nrealloc() moves its text into memory of its own. */
+    fileptr = (filestruct *)lineblock_alloc(&openfile->lineblock,
+	sizeof(filestruct));
+    fileptr->data = (char *)lineblock_alloc(&openfile->lineblock,
+	buf_len + 1);
+    if (fileptr->data == NULL)
+	fileptr->data = charalloc(buf_len + 1);
+    memcpy(fileptr->data, buf, buf_len + 1);
 
 #ifndef NANO_TINY
     /* If it's a DOS file ("\r\n"), and file conversion isn't disabled,
@@ -358,6 +914,7 @@ filestruct *read_line(char *buf, filestruct *prevnode, bool
 
 #ifdef ENABLE_COLOR
 	fileptr->multidata = NULL;
+	fileptr->spans = NULL;
 #endif
 
     if (*first_line_ins) {
@@ -384,9 +941,41 @@ filestruct *read_line(char *buf, filestruct *prevnode, bool
 	prevnode->next = fileptr;
     }
 
+#ifndef NANO_TINY
+    /* Number the lines of a file that's being opened, so that the
+     * autosave journal can refer to them for as long as they're
+     * unchanged. */
+    if (reading_original) {
+	fileptr->journalno = fileptr->lineno;
+	fileptr->journalsum = journal_sum(fileptr->data,
+		strlen(fileptr->data));
+    } else
+	fileptr->journalno = 0;
+#endif
+
     return fileptr;
 }
 
+/* Append the len bytes at text to the line being read in, which is
+ * *buf_len bytes long in a buffer of *buf_size bytes, growing the
+ * buffer if needed.  The result is always null-terminated. */
+void read_append(char **buf, size_t *buf_size, size_t *buf_len, const
+	char *text, size_t len)
+{
+    if (*buf_len + len >= *buf_size) {
+	/* Double the buffer at a time, so that very long lines don't
+	 * cause a realloc() for every chunk.  We never shrink it; we
+	 * free it at the end of read_file(). */
+	while (*buf_len + len >= *buf_size)
+	    *buf_size *= 2;
+	*buf = charealloc(*buf, *buf_size);
+    }
+
+    memcpy(*buf + *buf_len, text, len);
+    *buf_len += len;
+    (*buf)[*buf_len] = '\0';
+}
+
 /* Read an open file into the current buffer.  f should be set to the
  * open file, and filename should be set to the name of the file.
  * undoable  means do we want to create undo records to try and undo this.
@@ -398,32 +987,35 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	/* The number of lines in the file. */
     size_t len = 0;
 	/* The length of the current line of the file. */
-    size_t i = 0;
-	/* The position in the current line of the file. */
     size_t bufx = MAX_BUF_SIZE;
-	/* The size of each chunk of the file that we read. */
-    char input = '\0';
-	/* The current input character. */
+	/* The allocated size of the line buffer. */
     char *buf;
+	/* The buffer where we assemble the current line. */
+    char *block;
 	/* The buffer where we store chunks of the file. */
+    size_t block_len;
+	/* The number of bytes in the chunk we just read. */
     filestruct *fileptr = openfile->current;
 	/* The current line of the file. */
     bool first_line_ins = FALSE;
 	/* Whether we're inserting with the cursor on the first line. */
-    int input_int;
-	/* The current value we read from the file, whether an input
-	 * character or EOF. */
     bool writable = TRUE;
 	/* Is the file writable (if we care) */
 #ifndef NANO_TINY
     int format = 0;
 	/* 0 = *nix, 1 = DOS, 2 = Mac, 3 = both DOS and Mac. */
 #endif
+#ifdef DEBUG
+    size_t total_bytes = 0;
+	/* The number of bytes read, for the throughput report. */
+    clock_t start_clock = clock();
+#endif
 
     assert(openfile->fileage != NULL && openfile->current != NULL);
 
     buf = charalloc(bufx);
     buf[0] = '\0';
+    block = charalloc(READ_BLOCK_SIZE);
 
 #ifndef NANO_TINY
     if (undoable)
@@ -435,78 +1027,92 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
     else
 	fileptr = openfile->current->prev;
 
-    /* Read the entire file into the filestruct. */
-    while ((input_int = getc(f)) != EOF) {
-	input = (char)input_int;
+    /* Read the entire file into the filestruct, a large chunk at a
+     * time.  Within each chunk, we look for the end of each line with
+     * memchr() instead of examining every character ourselves. */
+    while ((block_len = fread(block, 1, READ_BLOCK_SIZE, f)) > 0) {
+	const char *ptr = block, *block_end = block + block_len;
+	const char *eol = memchr(block, '\n', block_len);
+		/* The end of the current line, if it's in this chunk.
+		 * Since a Mac line can end before it, it's only looked
+		 * for again once we're past it. */
+
+#ifdef DEBUG
+	total_bytes += block_len;
+#endif
+
+	while (ptr < block_end) {
+	    const char *seg_end;
+		/* The end of the part of the line in this chunk. */
+
+	    if (eol != NULL && eol < ptr)
+		eol = memchr(ptr, '\n', block_end - ptr);
+	    seg_end = (eol != NULL) ? eol : block_end;
+#ifndef NANO_TINY
+	    /* Look for '\r' only on the first line if we think it's a
+	     * *nix file, or on any line otherwise, and only if file
+	     * conversion isn't disabled. */
+	    if (!ISSET(NO_CONVERT) && (num_lines == 0 || format != 0)) {
+		bool mac_line = FALSE;
+
+		/* If the previous chunk ended with '\r' and this one
+		 * doesn't start with '\n', or if this part of the line
+		 * has a '\r' that isn't followed by '\n', it's a Mac
+		 * line. */
+		if (len > 0 && buf[len - 1] == '\r' && *ptr != '\n')
+		    mac_line = TRUE;
+		else {
+		    const char *cr = memchr(ptr, '\r', seg_end - ptr);
+
+		    if (cr != NULL && cr + 1 < seg_end) {
+			read_append(&buf, &bufx, &len, ptr, cr + 1 - ptr);
+			ptr = cr + 1;
+			mac_line = TRUE;
+		    }
+		}
+
+		if (mac_line) {
+		    /* Set format to Mac if we currently think the file
+		     * is a *nix file, or to both DOS and Mac if we
+		     * currently think the file is a DOS file. */
+		    if (format == 0 || format == 1)
+			format += 2;
+
+		    /* Read in the line properly, and reset the line
+		     * length in preparation for the next line. */
+		    fileptr = read_line(buf, fileptr, &first_line_ins,
+			len);
+		    len = 0;
+		    num_lines++;
+		    continue;
+		}
+	    }
+#endif
+	    read_append(&buf, &bufx, &len, ptr, seg_end - ptr);
+
+	    /* If the line continues into the next chunk, go get it. */
+	    if (eol == NULL)
+		break;
 
-	/* If it's a *nix file ("\n") or a DOS file ("\r\n"), and file
-	 * conversion isn't disabled, handle it! */
-	if (input == '\n') {
 #ifndef NANO_TINY
 	    /* If it's a DOS file or a DOS/Mac file ('\r' before '\n' on
 	     * the first line if we think it's a *nix file, or on any
 	     * line otherwise), and file conversion isn't disabled,
 	     * handle it! */
 	    if (!ISSET(NO_CONVERT) && (num_lines == 0 || format != 0) &&
-		i > 0 && buf[i - 1] == '\r') {
+		len > 0 && buf[len - 1] == '\r') {
 		if (format == 0 || format == 2)
 		    format++;
 	    }
 #endif
 
-	    /* Read in the line properly. */
+	    /* Read in the line properly, and reset the line length in
+	     * preparation for the next line. */
 	    fileptr = read_line(buf, fileptr, &first_line_ins, len);
-
-	    /* Reset the line length in preparation for the next
-	     * line. */
 	    len = 0;
-
-	    num_lines++;
-	    buf[0] = '\0';
-	    i = 0;
-#ifndef NANO_TINY
-	/* If it's a Mac file ('\r' without '\n' on the first line if we
-	 * think it's a *nix file, or on any line otherwise), and file
-	 * conversion isn't disabled, handle it! */
-	} else if (!ISSET(NO_CONVERT) && (num_lines == 0 ||
-		format != 0) && i > 0 && buf[i - 1] == '\r') {
-	    /* If we currently think the file is a *nix file, set format
-	     * to Mac.  If we currently think the file is a DOS file,
-	     * set format to both DOS and Mac. */
-	    if (format == 0 || format == 1)
-		format += 2;
-
-	    /* Read in the line properly. */
-	    fileptr = read_line(buf, fileptr, &first_line_ins, len);
-
-	    /* Reset the line length in preparation for the next line.
-	     * Since we've already read in the next character, reset it
-	     * to 1 instead of 0. */
-	    len = 1;
-
 	    num_lines++;
-	    buf[0] = input;
-	    buf[1] = '\0';
-	    i = 1;
-#endif
-	} else {
-	    /* Calculate the total length of the line.  It might have
-	     * nulls in it, so we can't just use strlen() here. */
-	    len++;
-
-	    /* Now we allocate a bigger buffer MAX_BUF_SIZE characters
-	     * at a time.  If we allocate a lot of space for one line,
-	     * we may indeed have to use a buffer this big later on, so
-	     * we don't decrease it at all.  We do free it at the end,
-	     * though. */
-	    if (i >= bufx - 1) {
-		bufx += MAX_BUF_SIZE;
-		buf = charealloc(buf, bufx);
-	    }
 
-	    buf[i] = input;
-	    buf[i + 1] = '\0';
-	    i++;
+	    ptr = eol + 1;
 	}
     }
 
@@ -519,14 +1125,15 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	writable = is_file_writable(filename);
     }
 
-#ifndef NANO_TINY
-    /* If file conversion isn't disabled and the last character in this
-     * file is '\r', read it in properly as a Mac format line. */
-    if (len == 0 && !ISSET(NO_CONVERT) && input == '\r') {
-	len = 1;
+    free(block);
 
-	buf[0] = input;
-	buf[1] = '\0';
+#ifdef DEBUG
+    {
+	double secs = (double)(clock() - start_clock) / CLOCKS_PER_SEC;
+
+	fprintf(stderr, "read_file(): read %lu bytes in %lu lines (%.1f MB/s)\n",
+		(unsigned long)total_bytes, (unsigned long)num_lines,
+		(secs > 0) ? total_bytes / secs / (1024 * 1024) : 0.0);
     }
 #endif
 
@@ -591,7 +1198,7 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	    fileptr = fileptr->prev;
 	    if (fileptr != NULL) {
 		if (fileptr->next != NULL)
-		    free(fileptr->next);
+		    delete_node(fileptr->next);
 	    }
 	}
 
@@ -1387,63 +1994,984 @@ void init_backup_dir(void)
 	backup_dir = full_backup_dir;
     }
 }
-#endif
 
-/* Read from inn, write to out.  We assume inn is opened for reading,
- * and out for writing.  We return 0 on success, -1 on read error, or -2
- * on write error. */
-int copy_file(FILE *inn, FILE *out)
+/* Return the canonicalized absolute pathname of name with every '/'
+ * replaced with a '!', for naming files in backup_dir after it, or NULL
+ * if get_full_path() fails. */
+char *flattened_path(const char *name)
 {
-    int retval = 0;
-    char buf[BUFSIZ];
-    size_t charsread;
+    char *path = get_full_path(name);
+    size_t i;
 
-    assert(inn != NULL && out != NULL && inn != out);
-
-    do {
-	charsread = fread(buf, sizeof(char), BUFSIZ, inn);
-	if (charsread == 0 && ferror(inn)) {
-	    retval = -1;
-	    break;
-	}
-	if (fwrite(buf, sizeof(char), charsread, out) < charsread) {
-	    retval = -2;
-	    break;
-	}
-    } while (charsread > 0);
+    if (path == NULL)
+	return NULL;
 
-    if (fclose(inn) == EOF)
-	retval = -1;
-    if (fclose(out) == EOF)
-	retval = -2;
+    for (i = 0; path[i] != '\0'; i++) {
+	if (path[i] == '/')
+	    path[i] = '!';
+    }
 
-    return retval;
+    return path;
 }
 
-/* Write a file out to disk.  If f_open isn't NULL, we assume that it is
- * a stream associated with the file, and we don't try to open it
- * ourselves.  If tmp is TRUE, we set the umask to disallow anyone else
- * from accessing the file, we don't set the filename to its name, and
- * we don't print out how many lines we wrote on the statusbar.
- *
- * tmp means we are writing a temporary file in a secure fashion.  We
- * use it when spell checking or dumping the file on an error.  If
- * append is APPEND, it means we are appending instead of overwriting.
- * If append is PREPEND, it means we are prepending instead of
- * overwriting.  If nonamechange is TRUE, we don't change the current
- * filename.  nonamechange is ignored if tmp is FALSE, we're appending,
- * or we're prepending.
- *
- * Return TRUE on success or FALSE on error. */
-bool write_file(const char *name, FILE *f_open, bool tmp, append_type
-	append, bool nonamechange)
+/* Return the name of the file that holds the undo history of the file
+ * name, which is backup_dir/!home!foo!file.undo for /home/foo/file, or
+ * NULL if undo histories aren't kept. */
+char *undo_history_name(const char *name)
 {
-    bool retval = FALSE;
-	/* Instead of returning in this function, you should always
-	 * set retval and then goto cleanup_and_exit. */
-    size_t lineswritten = 0;
-    const filestruct *fileptr = openfile->fileage;
-    int fd;
+    char *path, *histname;
+
+    if (backup_dir == NULL || !ISSET(UNDOABLE))
+	return NULL;
+
+    path = flattened_path(name);
+    if (path == NULL)
+	return NULL;
+
+    histname = charalloc(strlen(backup_dir) + strlen(path) + 6);
+    sprintf(histname, "%s%s.undo", backup_dir, path);
+    free(path);
+
+    return histname;
+}
+
+/* Save the undo history of the current buffer, which has just been
+ * written to the file name, if undo histories are kept.  If it can't be
+ * saved, don't leave half of it behind. */
+void save_undo_history(const char *name)
+{
+    char *histname = undo_history_name(name);
+    int fd;
+    FILE *f;
+    bool failed;
+
+    if (histname == NULL || openfile->current_stat == NULL) {
+	free(histname);
+	return;
+    }
+
+    /* The history saved before may be mapped in from the file we're
+     * about to overwrite, and it still belongs after ours. */
+    load_undo_history();
+
+    fd = open(histname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR |
+	S_IWUSR);
+    f = (fd == -1) ? NULL : fdopen(fd, "wb");
+
+    if (f == NULL) {
+	if (fd != -1)
+	    close(fd);
+	free(histname);
+	return;
+    }
+
+    write_undo_history(f);
+
+    failed = (ferror(f) != 0);
+    if (fclose(f) == EOF || failed)
+	unlink(histname);
+
+    free(histname);
+}
+
+/* If there's an undo history saved for the file name, which has just
+ * been read into the current buffer, and it was saved for the file as
+ * it is now, map it in, so that it can be read in when it's needed.
+ * Reading it in right away would slow down opening the file. */
+void map_undo_history(const char *name)
+{
+    char *histname = undo_history_name(name);
+    struct stat st;
+    int fd;
+    void *map;
+
+    if (histname == NULL)
+	return;
+
+    fd = open(histname, O_RDONLY);
+    free(histname);
+
+    if (fd == -1)
+	return;
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+	close(fd);
+	return;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+	return;
+
+    openfile->undo_map = (char *)map;
+    openfile->undo_map_len = st.st_size;
+
+    if (!check_undo_history())
+	forget_undo_history(openfile);
+}
+
+/* The autosave journal of a buffer starts with journal_magic, and then
+ * holds the version of its format, the size, modification time, and
+ * inode number of the file on disk that it was made for, and how many
+ * lines were read from that file.  After that come checkpoints.  Each
+ * checkpoint holds the text of the lines that have changed since the
+ * checkpoint before it, then the runs of lines that make up the whole
+ * buffer, each either some lines of the file or some lines whose text
+ * is already in the journal, then the cursor position, and last where
+ * the checkpoint starts, to show that it's complete.  Numbers and text
+ * are written with put_packed_number() and put_packed_string(). */
+static const char journal_magic[] = "GNU nano journal\n";
+
+#define JOURNAL_VERSION 1
+
+/* The kinds of runs of lines in a checkpoint. */
+#define FILE_RUN 0
+#define JOURNAL_RUN 1
+
+/* Return the name of the autosave journal of the file name: in the
+ * backup directory, if there is one, and next to the file otherwise. */
+static char *journal_name(const char *name)
+{
+    char *path = (backup_dir == NULL) ? NULL : flattened_path(name);
+    char *journalname;
+
+    if (path != NULL) {
+	journalname = charalloc(strlen(backup_dir) + strlen(path) + 9);
+	sprintf(journalname, "%s%s.journal", backup_dir, path);
+	free(path);
+    } else {
+	journalname = charalloc(strlen(name) + 9);
+	sprintf(journalname, "%s.journal", name);
+    }
+
+    return journalname;
+}
+
+/* Return a hash of the len bytes of text at data, to tell whether a
+ * line has changed since it went into the journal, as line_hash()
+ * does. */
+static unsigned int journal_sum(const char *data, size_t len)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; len > 0; data++, len--)
+	hash = (hash ^ (unsigned char)*data) * 16777619U;
+
+    return hash;
+}
+
+/* Return how many bytes put_packed_number() writes for n. */
+static size_t journal_number_size(size_t n)
+{
+    size_t size = 1;
+
+    while (n >= 0x80) {
+	n >>= 7;
+	size++;
+    }
+
+    return size;
+}
+
+/* The text of the current line has changed, or the line is new.  Make
+ * sure that it goes into the autosave journal in time. */
+void mark_for_journal(void)
+{
+    openfile->current->journalno = 0;
+
+    if (autosave > 0 && openfile->journal_due == 0)
+	openfile->journal_due = time(NULL) + autosave;
+}
+
+/* Forget where the text of the lines of the current buffer is in its
+ * autosave journal, since the journal is gone. */
+static void forget_journaled_lines(void)
+{
+    filestruct *f;
+
+    for (f = openfile->fileage; f != NULL; f = f->next)
+	if (f->journalno < 0)
+	    f->journalno = 0;
+}
+
+/* Number all lines of the current buffer as lines of the file on disk,
+ * which it has just been written to, except the last one: it's either
+ * blank, or has no newline after it, and then isn't read in as a line
+ * of its own. */
+static void number_original_lines(void)
+{
+    filestruct *f;
+    ssize_t lineno = 0;
+
+    for (f = openfile->fileage; f != openfile->filebot; f = f->next) {
+	f->journalno = ++lineno;
+	f->journalsum = journal_sum(f->data, strlen(f->data));
+    }
+
+    f->journalno = 0;
+    openfile->journal_lines = lineno;
+}
+
+/* Close the autosave journal of the current buffer, if it's open, and
+ * delete it if it's ours, since its changes have been saved or thrown
+ * away.  The lines that refer to it are either renumbered or thrown
+ * away next. */
+void discard_journal(void)
+{
+    char *journalname;
+
+    if (openfile->journal != NULL) {
+	fclose(openfile->journal);
+	openfile->journal = NULL;
+    }
+
+    openfile->journal_due = 0;
+
+    /* Leave alone a journal that another session may have made. */
+    if (!openfile->journal_ours || openfile->filename[0] == '\0')
+	return;
+
+    journalname = journal_name(openfile->filename);
+    unlink(journalname);
+    free(journalname);
+
+    openfile->journal_ours = FALSE;
+}
+
+/* Start the autosave journal of the current buffer, by writing its
+ * header.  Return FALSE if it can't be created.  A file that's already
+ * there under its name is never overwritten, unless it's a journal of
+ * ours that we had to stop writing to. */
+static bool start_journal(void)
+{
+    char *journalname = journal_name(openfile->filename);
+    const struct stat *st = openfile->current_stat;
+    int fd;
+    FILE *f;
+
+    if (openfile->journal_ours)
+	unlink(journalname);
+
+    fd = open(journalname, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+	S_IRUSR | S_IWUSR);
+    if (fd != -1)
+	openfile->journal_ours = TRUE;
+    f = (fd == -1) ? NULL : fdopen(fd, "wb");
+
+    if (f == NULL) {
+	if (errno == EEXIST)
+	    statusbar(_("%s already exists, not autosaving"),
+		journalname);
+	else
+	    statusbar(_("Error writing %s: %s"), journalname,
+		strerror(errno));
+	if (fd != -1)
+	    close(fd);
+	free(journalname);
+	return FALSE;
+    }
+
+    free(journalname);
+
+    fputs(journal_magic, f);
+    put_packed_number(f, JOURNAL_VERSION);
+    put_packed_number(f, (st == NULL) ? 0 : (size_t)st->st_size);
+    put_packed_number(f, (st == NULL) ? 0 : (size_t)st->st_mtime);
+    put_packed_number(f, (st == NULL) ? 0 : (size_t)st->st_ino);
+    put_packed_number(f, (size_t)openfile->journal_lines);
+
+    openfile->journal = f;
+    openfile->journal_end = ftell(f);
+
+    return TRUE;
+}
+
+/* Add a checkpoint to the autosave journal of the current buffer,
+ * starting the journal if need be.  Only the lines that have changed
+ * since the last checkpoint are written out in full. */
+static void write_journal(void)
+{
+    FILE *f;
+    filestruct *fileptr;
+    size_t start, next_offset = 0, current_lineno = 1, lineno = 0;
+    ssize_t file_lineno = 0;
+	/* The number of the last line of the file seen so far. */
+    size_t *runs = NULL, runs_len = 0, runs_size = 0, i;
+	/* The kind, start, and length of each run of lines. */
+
+    openfile->journal_due = 0;
+
+    if (openfile->filename[0] == '\0' || (openfile->journal == NULL &&
+	!start_journal()))
+	return;
+
+    f = openfile->journal;
+    start = openfile->journal_end;
+
+    for (fileptr = openfile->fileage; fileptr != NULL; fileptr =
+	fileptr->next) {
+	size_t len = strlen(fileptr->data);
+	unsigned int sum = journal_sum(fileptr->data, len);
+	size_t kind, from;
+
+	lineno++;
+	if (fileptr == openfile->current)
+	    current_lineno = lineno;
+
+	/* Write out the text of a line that has changed, or of a line
+	 * of the file that has somehow ended up out of order, and
+	 * remember where it is. */
+	if (fileptr->journalno == 0 || fileptr->journalsum != sum ||
+		(fileptr->journalno > 0 && fileptr->journalno <=
+		file_lineno)) {
+	    fileptr->journalno = -(ssize_t)openfile->journal_end - 1;
+	    fileptr->journalsum = sum;
+	    put_packed_string(f, fileptr->data);
+	    openfile->journal_end += journal_number_size(len + 1) + len;
+	}
+
+	if (fileptr->journalno > 0) {
+	    kind = FILE_RUN;
+	    from = fileptr->journalno;
+	    file_lineno = fileptr->journalno;
+	} else {
+	    kind = JOURNAL_RUN;
+	    from = -fileptr->journalno - 1;
+	}
+
+	/* Add the line to the last run, if it follows on from it. */
+	if (runs_len > 0 && runs[runs_len - 3] == kind && (kind ==
+		FILE_RUN ? runs[runs_len - 2] + runs[runs_len - 1] ==
+		from : next_offset == from))
+	    runs[runs_len - 1]++;
+	else {
+	    if (runs_len == runs_size) {
+		runs_size = (runs_size == 0) ? 48 : runs_size * 2;
+		runs = (size_t *)nrealloc(runs, runs_size *
+			sizeof(size_t));
+	    }
+	    runs[runs_len++] = kind;
+	    runs[runs_len++] = from;
+	    runs[runs_len++] = 1;
+	}
+
+	next_offset = from + journal_number_size(len + 1) + len;
+    }
+
+    put_packed_number(f, 0);
+    put_packed_number(f, runs_len / 3);
+    for (i = 0; i < runs_len; i++)
+	put_packed_number(f, runs[i]);
+    put_packed_number(f, current_lineno);
+    put_packed_number(f, openfile->current_x);
+    put_packed_number(f, start);
+
+    free(runs);
+
+    if (fflush(f) == EOF || ferror(f)) {
+	char *journalname = journal_name(openfile->filename);
+
+	statusbar(_("Error writing %s: %s"), journalname,
+		strerror(errno));
+	free(journalname);
+
+	fclose(f);
+	openfile->journal = NULL;
+	forget_journaled_lines();
+	return;
+    }
+
+    openfile->journal_end = ftell(f);
+}
+
+/* Return how many milliseconds are left until the changes to some
+ * buffer have to go into its autosave journal, 0 if that's now, or -1
+ * if there are no such changes. */
+long journal_wait(void)
+{
+    const openfilestruct *fileptr = openfile;
+    time_t due = 0, now;
+
+    if (openfile == NULL || autosave == 0)
+	return -1;
+
+    do {
+	if (fileptr->journal_due != 0 && (due == 0 ||
+		fileptr->journal_due < due))
+	    due = fileptr->journal_due;
+	fileptr = fileptr->next;
+    } while (fileptr != openfile);
+
+    if (due == 0)
+	return -1;
+
+    now = time(NULL);
+
+    return (due <= now) ? 0 : (long)(due - now) * 1000;
+}
+
+/* Add a checkpoint to the autosave journal of each buffer whose changes
+ * have to be in it by now.  While the current buffer is partitioned,
+ * leave it for later. */
+void autosave_journals(void)
+{
+    openfilestruct *was_openfile = openfile;
+    time_t now = time(NULL);
+
+    do {
+	if (openfile->journal_due != 0 && openfile->journal_due <= now) {
+	    if (filepart != NULL && openfile == was_openfile)
+		openfile->journal_due = now + autosave;
+	    else
+		write_journal();
+	}
+	openfile = openfile->next;
+    } while (openfile != was_openfile);
+}
+
+/* Read a checkpoint of an autosave journal that starts at *p, which is
+ * map plus start, without going past end, with the lines of the file
+ * being at most lines.  Return FALSE if it's cut off or makes no
+ * sense.  Only when check_text is TRUE, make sure that the text of the
+ * lines it refers to in the journal is there too, since that takes
+ * longer. */
+static bool get_checkpoint(const char **p, const char *end, const char
+	*map, size_t start, size_t lines, bool check_text)
+{
+    size_t len, runs, kind, from, count, next_line = 1, total = 0, n;
+    const char *text_end;
+
+    /* Skip the text of the lines that changed. */
+    while (TRUE) {
+	if (!get_packed_number(p, end, &len))
+	    return FALSE;
+	if (len-- == 0)
+	    break;
+	if ((size_t)(end - *p) < len)
+	    return FALSE;
+	*p += len;
+    }
+
+    text_end = *p;
+
+    if (!get_packed_number(p, end, &runs))
+	return FALSE;
+
+    for (; runs > 0; runs--) {
+	if (!get_packed_number(p, end, &kind) || !get_packed_number(p, end,
+		&from) || !get_packed_number(p, end, &count) || count == 0)
+	    return FALSE;
+
+	/* Lines of the file have to come in order, since they can't be
+	 * moved around, only cut and pasted as new lines. */
+	if (kind == FILE_RUN) {
+	    if (from < next_line || from - 1 + count > lines)
+		return FALSE;
+	    next_line = from + count;
+	} else if (kind == JOURNAL_RUN) {
+	    const char *text = map + from;
+
+	    if (from >= (size_t)(text_end - map))
+		return FALSE;
+
+	    for (n = count; check_text && n > 0; n--) {
+		if (!get_packed_number(&text, text_end, &len) || len-- ==
+			0 || (size_t)(text_end - text) < len)
+		    return FALSE;
+		text += len;
+	    }
+	} else
+	    return FALSE;
+
+	total += count;
+    }
+
+    return (total > 0 && get_packed_number(p, end, &n) &&
+	get_packed_number(p, end, &n) && get_packed_number(p, end, &n) &&
+	n == start);
+}
+
+/* If the autosave journal of the file name, which has just been read
+ * into a new buffer, was made for the file as it is now, rebuild the
+ * buffer from the last complete checkpoint in it, and go on adding to
+ * it.  Only the lines that changed are read from the journal; the rest
+ * are the ones just read from the file.  Return TRUE if the buffer was
+ * rebuilt. */
+static bool recover_journal(const char *name)
+{
+    char *journalname;
+    const struct stat *st = openfile->current_stat;
+    struct stat jst;
+    const char *map, *p, *end, *last = NULL, *last_end = NULL;
+    size_t version, size, mtime, ino, lines, runs, kind, from, count;
+    size_t current_lineno, current_x;
+    filestruct *fileptr, *top = NULL, *bot = NULL, *next;
+    FILE *f;
+    int fd;
+
+    if (autosave == 0)
+	return FALSE;
+
+    journalname = journal_name(name);
+    fd = open(journalname, O_RDWR | O_NOFOLLOW);
+
+    if (fd == -1) {
+	free(journalname);
+	return FALSE;
+    }
+
+    if (fstat(fd, &jst) == -1 || jst.st_size == 0 || (map =
+	(const char *)mmap(NULL, jst.st_size, PROT_READ, MAP_PRIVATE, fd,
+	0)) == (const char *)MAP_FAILED) {
+	close(fd);
+	free(journalname);
+	return FALSE;
+    }
+
+    p = map;
+    end = map + jst.st_size;
+
+    if ((size_t)(end - p) < sizeof(journal_magic) - 1 || memcmp(p,
+	journal_magic, sizeof(journal_magic) - 1) != 0)
+	goto not_recovered;
+    p += sizeof(journal_magic) - 1;
+
+    if (!get_packed_number(&p, end, &version) || version !=
+	JOURNAL_VERSION || !get_packed_number(&p, end, &size) ||
+	!get_packed_number(&p, end, &mtime) || !get_packed_number(&p, end,
+	&ino) || !get_packed_number(&p, end, &lines))
+	goto not_recovered;
+
+    /* The lines of the file that the journal refers to have to be the
+     * ones we just read. */
+    if (size != ((st == NULL) ? 0 : (size_t)st->st_size) || mtime !=
+	((st == NULL) ? 0 : (size_t)st->st_mtime) || ino != ((st ==
+	NULL) ? 0 : (size_t)st->st_ino) || lines !=
+	(size_t)openfile->journal_lines) {
+	statusbar(_("%s was made for another version of the file"),
+		journalname);
+	goto not_recovered;
+    }
+
+    /* Find the last checkpoint that was written out completely, and
+     * then make sure that all of it is there. */
+    while (p < end) {
+	const char *checkpoint = p;
+
+	if (!get_checkpoint(&p, end, map, checkpoint - map, lines,
+		FALSE))
+	    break;
+	last = checkpoint;
+	last_end = p;
+    }
+
+    if (last == NULL)
+	goto not_recovered;
+
+    p = last;
+    if (!get_checkpoint(&p, end, map, last - map, lines, TRUE))
+	goto not_recovered;
+
+    /* Skip the text that the checkpoint starts with. */
+    p = last;
+    while (get_packed_number(&p, end, &size) && size > 0)
+	p += size - 1;
+
+    get_packed_number(&p, end, &runs);
+
+    /* Put the buffer together again from the runs: lines of the file
+     * are taken from the ones just read, in order, and the ones in
+     * between are thrown away; lines in the journal are made anew. */
+    fileptr = openfile->fileage;
+
+    for (; runs > 0; runs--) {
+	get_packed_number(&p, end, &kind);
+	get_packed_number(&p, end, &from);
+	get_packed_number(&p, end, &count);
+
+	if (kind == FILE_RUN) {
+	    while (fileptr->journalno != (ssize_t)from) {
+		next = fileptr->next;
+		delete_node(fileptr);
+		fileptr = next;
+	    }
+
+	    for (; count > 0; count--) {
+		next = fileptr->next;
+		fileptr->prev = bot;
+		if (bot != NULL)
+		    bot->next = fileptr;
+		else
+		    top = fileptr;
+		bot = fileptr;
+		fileptr = next;
+	    }
+	} else {
+	    const char *text = map + from;
+
+	    for (; count > 0; count--) {
+		filestruct *newnode = make_new_node(bot);
+		size_t offset = text - map;
+
+		get_packed_string(&text, end, &newnode->data);
+		newnode->journalno = -(ssize_t)offset - 1;
+		newnode->journalsum = journal_sum(newnode->data,
+			strlen(newnode->data));
+
+		if (bot != NULL)
+		    bot->next = newnode;
+		else
+		    top = newnode;
+		bot = newnode;
+	    }
+	}
+    }
+
+    get_packed_number(&p, end, &current_lineno);
+    get_packed_number(&p, end, &current_x);
+
+    /* Throw away the lines of the file that are left over. */
+    while (fileptr != NULL) {
+	next = fileptr->next;
+	delete_node(fileptr);
+	fileptr = next;
+    }
+
+    bot->next = NULL;
+    openfile->fileage = top;
+    openfile->filebot = bot;
+    openfile->edittop = top;
+    openfile->renumber_pending = NULL;
+    renumber(top);
+    openfile->totsize = get_totsize(top, bot);
+
+    for (fileptr = top; fileptr->next != NULL && fileptr->lineno <
+	(ssize_t)current_lineno; fileptr = fileptr->next)
+	;
+    openfile->current = fileptr;
+    openfile->current_x = (current_x > strlen(fileptr->data)) ?
+	strlen(fileptr->data) : current_x;
+    openfile->placewewant = xplustabs();
+    openfile->modified = TRUE;
+    openfile->journal_ours = TRUE;
+
+    /* Go on adding to the journal after the checkpoint, dropping
+     * whatever was cut off after it. */
+    size = last_end - map;
+    munmap((void *)map, jst.st_size);
+
+    if (ftruncate(fd, size) == -1 || lseek(fd, 0, SEEK_END) == -1 ||
+	(f = fdopen(fd, "ab")) == NULL) {
+	close(fd);
+	forget_journaled_lines();
+    } else {
+	openfile->journal = f;
+	openfile->journal_end = size;
+    }
+
+    statusbar(_("Recovered the unsaved changes from %s"), journalname);
+    free(journalname);
+
+    return TRUE;
+
+  not_recovered:
+    munmap((void *)map, jst.st_size);
+    close(fd);
+    free(journalname);
+
+    return FALSE;
+}
+#endif
+
+/* Write all of the len bytes at buf to the file descriptor fd.  Return
+ * FALSE if writing failed. */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+	ssize_t written = write(fd, buf, len);
+
+	if (written == -1) {
+	    if (errno != EINTR)
+		return FALSE;
+	} else {
+	    buf += written;
+	    len -= written;
+	}
+    }
+
+    return TRUE;
+}
+
+/* Copy the rest of the file inn to the end of the file out, and close
+ * both.  Where the filesystem can share the data between the two files,
+ * or the kernel can copy from one to the other by itself, let it, so
+ * that the data never passes through nano; otherwise, copy it in large
+ * chunks.  If sync is TRUE, make sure the
+ * copy is on the disk before closing out.  Return 0 on success, -1 on
+ * a read error, or -2 on a write error. */
+int copy_file(FILE *inn, FILE *out, bool sync)
+{
+    int retval = 0;
+    int fd_in = fileno(inn), fd_out = fileno(out);
+    char *buf = NULL;
+    ssize_t charsread;
+
+    assert(inn != NULL && out != NULL && inn != out);
+
+    /* Whatever was written to out so far has to come first. */
+    if (fflush(out) == EOF)
+	retval = -2;
+
+#ifdef FICLONE
+    /* If all of inn goes into a still empty out, the two files can
+     * share their data until either of them is changed. */
+    if (retval == 0 && lseek(fd_in, 0, SEEK_CUR) == 0 &&
+	lseek(fd_out, 0, SEEK_END) == 0 &&
+	ioctl(fd_out, FICLONE, fd_in) != -1)
+	goto done;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while (retval == 0) {
+	ssize_t copied = copy_file_range(fd_in, NULL, fd_out, NULL,
+		COPY_CHUNK, 0);
+
+	if (copied == 0)
+	    goto done;
+	if (copied == -1) {
+	    /* If the kernel can't copy between these two files, do it
+	     * ourselves. */
+	    if (errno == EXDEV || errno == EINVAL || errno == EBADF ||
+		errno == ENOSYS || errno == EOPNOTSUPP)
+		break;
+	    retval = -2;
+	}
+    }
+#endif
+
+    if (retval == 0)
+	buf = charalloc(COPY_CHUNK);
+
+    while (retval == 0) {
+	charsread = read(fd_in, buf, COPY_CHUNK);
+
+	if (charsread == 0)
+	    break;
+	if (charsread == -1) {
+	    if (errno != EINTR)
+		retval = -1;
+	} else if (!write_all(fd_out, buf, charsread))
+	    retval = -2;
+    }
+
+    free(buf);
+
+#if defined(FICLONE) || defined(HAVE_COPY_FILE_RANGE)
+  done:
+#endif
+    if (retval == 0 && sync && fsync(fd_out) == -1 && errno != EINVAL)
+	retval = -2;
+
+    if (fclose(inn) == EOF)
+	retval = -1;
+    if (fclose(out) == EOF)
+	retval = -2;
+
+    return retval;
+}
+
+/* Write the count pieces of text in iov to the file descriptor fd,
+ * going on after a partial write.  iov is used up along the way.
+ * Return FALSE if writing failed. */
+static bool write_pieces(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+	ssize_t written = writev(fd, iov, count);
+
+	if (written == -1) {
+	    if (errno != EINTR)
+		return FALSE;
+	    continue;
+	}
+
+	for (; count > 0 && (size_t)written >= iov->iov_len; iov++,
+		count--)
+	    written -= iov->iov_len;
+
+	if (count > 0) {
+	    iov->iov_base = (char *)iov->iov_base + written;
+	    iov->iov_len -= written;
+	}
+    }
+
+    return TRUE;
+}
+
+/* Write the lines of the current buffer to the file descriptor fd,
+ * handing many of them at once to writev() instead of writing them one
+ * by one.  Set *lines to the number of lines written, not counting a
+ * blank last line, and *bytes to the number of bytes.  Return FALSE if
+ * writing failed. */
+static bool write_lines(int fd, size_t *lines, size_t *bytes)
+{
+    struct iovec iov[WRITE_PIECES];
+	/* The pieces of text to be written next. */
+    int pieces = 0;
+	/* How many of them there are. */
+    char *sundered[WRITE_PIECES];
+    size_t sundered_len[WRITE_PIECES];
+	/* The lines among them that have nulls, and their lengths. */
+    int nulls = 0;
+	/* How many of those there are. */
+    const char *eol = "\n";
+    size_t eol_len = 1;
+    const filestruct *fileptr;
+    bool ok = TRUE;
+
+#ifndef NANO_TINY
+    if (openfile->fmt == DOS_FILE) {
+	eol = "\r\n";
+	eol_len = 2;
+    } else if (openfile->fmt == MAC_FILE)
+	eol = "\r";
+#endif
+
+    *lines = 0;
+    *bytes = 0;
+
+    for (fileptr = openfile->fileage; fileptr != NULL && ok;
+	fileptr = fileptr->next) {
+	size_t data_len = strlen(fileptr->data);
+
+	if (data_len > 0) {
+	    /* Convert newlines to nulls, just before we write to disk,
+	     * for the lines that have any. */
+	    if (memchr(fileptr->data, '\n', data_len) != NULL) {
+		sundered[nulls] = fileptr->data;
+		sundered_len[nulls++] = data_len;
+		sunder(fileptr->data);
+	    }
+
+	    iov[pieces].iov_base = fileptr->data;
+	    iov[pieces++].iov_len = data_len;
+	    *bytes += data_len;
+	}
+
+	/* If we're on the last line of the file, don't write a newline
+	 * character after it.  If the last line of the file is blank,
+	 * this means that zero bytes are written, in which case we
+	 * don't count the last line in the total lines written. */
+	if (fileptr != openfile->filebot) {
+	    iov[pieces].iov_base = (char *)eol;
+	    iov[pieces++].iov_len = eol_len;
+	    *bytes += eol_len;
+	    (*lines)++;
+	} else if (data_len > 0)
+	    (*lines)++;
+
+	/* Write the pieces once there's no room for another line and
+	 * its end, or there are no more lines. */
+	if (pieces > WRITE_PIECES - 2 || fileptr->next == NULL) {
+	    ok = write_pieces(fd, iov, pieces);
+	    pieces = 0;
+
+	    /* Convert nulls back to newlines. */
+	    while (nulls > 0) {
+		nulls--;
+		unsunder(sundered[nulls], sundered_len[nulls]);
+	    }
+	}
+    }
+
+    return ok;
+}
+
+#ifndef NANO_TINY
+/* Create a new, empty file in the same directory as realname, to write
+ * the buffer to and then rename over realname, and give it the owner,
+ * group, and permissions in st.  Return its name, and set *fd to its
+ * file descriptor, or return NULL if it can't be created or can't be
+ * made the same as realname. */
+static char *atomic_tempfile(const char *realname, const struct stat
+	*st, int *fd)
+{
+    char *tempname = charalloc(strlen(realname) + 8);
+
+    sprintf(tempname, "%s.XXXXXX", realname);
+
+    *fd = mkstemp(tempname);
+
+    if (*fd == -1) {
+	free(tempname);
+	return NULL;
+    }
+
+    if (fchown(*fd, st->st_uid, st->st_gid) == -1 || fchmod(*fd,
+	st->st_mode) == -1) {
+	close(*fd);
+	unlink(tempname);
+	free(tempname);
+	return NULL;
+    }
+
+    return tempname;
+}
+
+/* Make sure that the last change to the directory holding the file
+ * name, such as a rename, is on the disk. */
+static void sync_directory(const char *name)
+{
+    char *dir = mallocstrcpy(NULL, name);
+    char *slash = strrchr(dir, '/');
+    int fd;
+
+    if (slash == NULL)
+	strcpy(dir, ".");
+    else if (slash == dir)
+	slash[1] = '\0';
+    else
+	*slash = '\0';
+
+    fd = open(dir, O_RDONLY);
+
+    if (fd != -1) {
+	fsync(fd);
+	close(fd);
+    }
+
+    free(dir);
+}
+#endif
+
+/* Write a file out to disk.  If f_open isn't NULL, we assume that it is
+ * a stream associated with the file, and we don't try to open it
+ * ourselves.  If tmp is TRUE, we set the umask to disallow anyone else
+ * from accessing the file, we don't set the filename to its name, and
+ * we don't print out how many lines we wrote on the statusbar.
+ *
+ * tmp means we are writing a temporary file in a secure fashion.  We
+ * use it when spell checking or dumping the file on an error.  If
+ * append is APPEND, it means we are appending instead of overwriting.
+ * If append is PREPEND, it means we are prepending instead of
+ * overwriting.  If nonamechange is TRUE, we don't change the current
+ * filename.  nonamechange is ignored if tmp is FALSE, we're appending,
+ * or we're prepending.
+ *
+ * Return TRUE on success or FALSE on error. */
+bool write_file(const char *name, FILE *f_open, bool tmp, append_type
+	append, bool nonamechange)
+{
+    bool retval = FALSE;
+	/* Instead of returning in this function, you should always
+	 * set retval and then goto cleanup_and_exit. */
+    size_t lineswritten, byteswritten;
+    struct timeval start, end;
+	/* When we started and finished writing the text. */
+    unsigned long elapsed;
+	/* How long that took, in milliseconds. */
+    int fd;
 	/* The file descriptor we use. */
     mode_t original_umask = 0;
 	/* Our umask, from when nano started. */
@@ -1464,6 +2992,11 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	/* The actual file, realname, we are writing to. */
     char *tempname = NULL;
 	/* The temp file name we write to on prepend. */
+    char *atomicname = NULL;
+	/* The name of the new file that replaces realname, when we're
+	 * saving atomically. */
+    int atomic_fd = -1;
+	/* Its file descriptor, until it's turned into a stream. */
     int backup_cflags;
 
     assert(name != NULL);
@@ -1514,6 +3047,17 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
     if (openfile->current_stat == NULL && !tmp && realexists)
 	stat(realname, openfile->current_stat);
 
+    /* If we're overwriting an existing plain file that has no other
+     * names with the whole buffer or a selection, and we're asked to
+     * save atomically, write to a new file next to it, and rename that
+     * over it when it's complete, so that the file is never seen half
+     * written.  If the new file can't be created or can't get the same
+     * owner and permissions, overwrite the file in place. */
+    if (ISSET(ATOMIC_SAVE) && !tmp && f_open == NULL && append ==
+	OVERWRITE && realexists && !S_ISLNK(lst.st_mode) &&
+	S_ISREG(st.st_mode) && st.st_nlink == 1)
+	atomicname = atomic_tempfile(realname, &st, &atomic_fd);
+
     /* We backup only if the backup toggle is set, the file isn't
      * temporary, and the file already exists.  Furthermore, if we
      * aren't appending, prepending, or writing a selection, we backup
@@ -1553,7 +3097,7 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	 * replaced with a '!'.  This means that /home/foo/file is
 	 * backed up in backup_dir/!home!foo!file~[.number]. */
 	if (backup_dir != NULL) {
-	    char *backuptemp = get_full_path(realname);
+	    char *backuptemp = flattened_path(realname);
 
 	    if (backuptemp == NULL)
 		/* If get_full_path() failed, we don't have a
@@ -1563,14 +3107,6 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 		 * backupdir/backupname~ instead of
 		 * backupdir/../backupname~. */
 		backuptemp = mallocstrcpy(NULL, tail(realname));
-	    else {
-		size_t i = 0;
-
-		for (; backuptemp[i] != '\0'; i++) {
-		    if (backuptemp[i] == '/')
-			backuptemp[i] = '!';
-		}
-	    }
 
 	    backupname = charalloc(strlen(backup_dir) +
 		strlen(backuptemp) + 1);
@@ -1606,10 +3142,20 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	    goto cleanup_and_exit;
 	}
 
+	/* If the file is going to be replaced instead of overwritten,
+	 * the original can simply get the backup's name as well. */
+	if (atomicname != NULL && link(realname, backupname) != -1) {
+	    fclose(f);
+	    free(backupname);
+	    goto skip_backup;
+	}
+
+	/* The backup is new when it's made securely, so it doesn't need
+	 * O_APPEND, which would keep the kernel from copying into it. */
 	if (ISSET(INSECURE_BACKUP))
 	    backup_cflags = O_WRONLY | O_CREAT | O_APPEND;
         else
-	    backup_cflags = O_WRONLY | O_CREAT | O_EXCL | O_APPEND;
+	    backup_cflags = O_WRONLY | O_CREAT | O_EXCL;
 
 	backup_fd = open(backupname, backup_cflags,
 		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
@@ -1652,8 +3198,9 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	fprintf(stderr, "Backing up %s to %s\n", realname, backupname);
 #endif
 
-	/* Copy the file. */
-	copy_status = copy_file(f, backup_file);
+	/* Copy the file, and make sure the copy is on the disk before
+	 * the original is overwritten. */
+	copy_status = copy_file(f, backup_file, TRUE);
 
 	if (copy_status != 0) {
 	    statusbar(_("Error reading %s: %s"), realname,
@@ -1688,7 +3235,7 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	goto cleanup_and_exit;
     }
 
-    if (f_open == NULL) {
+    if (f_open == NULL && atomicname == NULL) {
 	original_umask = umask(0);
 
 	/* If we create a temp file, we don't let anyone else access it.
@@ -1740,7 +3287,7 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	    }
 	}
 
-	if (copy_file(f_source, f) != 0) {
+	if (copy_file(f_source, f, FALSE) != 0) {
 	    statusbar(_("Error writing %s: %s"), tempname,
 		strerror(errno));
 	    unlink(tempname);
@@ -1748,7 +3295,17 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	}
     }
 
-    if (f_open == NULL) {
+    if (atomicname != NULL) {
+	f = fdopen(atomic_fd, "wb");
+
+	if (f == NULL) {
+	    statusbar(_("Error writing %s: %s"), atomicname,
+		strerror(errno));
+	    goto cleanup_and_exit;
+	}
+
+	atomic_fd = -1;
+    } else if (f_open == NULL) {
 	/* Now open the file in place.  Use O_EXCL if tmp is TRUE.  This
 	 * is copied from joe, because wiggy says so *shrug*. */
 	fd = open(realname, O_WRONLY | O_CREAT | ((append == APPEND) ?
@@ -1783,59 +3340,12 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
      * a selection. */
     assert(openfile->fileage != NULL && openfile->filebot != NULL);
 
-    while (fileptr != NULL) {
-	size_t data_len = strlen(fileptr->data), size;
-
-	/* Convert newlines to nulls, just before we write to disk. */
-	sunder(fileptr->data);
-
-	size = fwrite(fileptr->data, sizeof(char), data_len, f);
-
-	/* Convert nulls to newlines.  data_len is the string's real
-	 * length. */
-	unsunder(fileptr->data, data_len);
-
-	if (size < data_len) {
-	    statusbar(_("Error writing %s: %s"), realname,
-		strerror(errno));
-	    fclose(f);
-	    goto cleanup_and_exit;
-	}
-
-	/* If we're on the last line of the file, don't write a newline
-	 * character after it.  If the last line of the file is blank,
-	 * this means that zero bytes are written, in which case we
-	 * don't count the last line in the total lines written. */
-	if (fileptr == openfile->filebot) {
-	    if (fileptr->data[0] == '\0')
-		lineswritten--;
-	} else {
-#ifndef NANO_TINY
-	    if (openfile->fmt == DOS_FILE || openfile->fmt ==
-		MAC_FILE) {
-		if (putc('\r', f) == EOF) {
-		    statusbar(_("Error writing %s: %s"), realname,
-			strerror(errno));
-		    fclose(f);
-		    goto cleanup_and_exit;
-		}
-	    }
+    gettimeofday(&start, NULL);
 
-	    if (openfile->fmt != MAC_FILE) {
-#endif
-		if (putc('\n', f) == EOF) {
-		    statusbar(_("Error writing %s: %s"), realname,
-			strerror(errno));
-		    fclose(f);
-		    goto cleanup_and_exit;
-		}
-#ifndef NANO_TINY
-	    }
-#endif
-	}
-
-	fileptr = fileptr->next;
-	lineswritten++;
+    if (!write_lines(fileno(f), &lineswritten, &byteswritten)) {
+	statusbar(_("Error writing %s: %s"), realname, strerror(errno));
+	fclose(f);
+	goto cleanup_and_exit;
     }
 
     /* If we're prepending, open the temp file, and append it to f. */
@@ -1859,19 +3369,51 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	    goto cleanup_and_exit;
 	}
 
-	if (copy_file(f_source, f) == -1 || unlink(tempname) == -1) {
+	if (copy_file(f_source, f, !tmp) == -1 || unlink(tempname) == -1) {
 	    statusbar(_("Error writing %s: %s"), realname,
 		strerror(errno));
 	    goto cleanup_and_exit;
 	}
-    } else if (fclose(f) != 0) {
+    } else {
+	/* Make sure the text is on the disk before saying it's written.
+	 * Some files, like terminals, can't be synced. */
+	if (!tmp && fsync(fileno(f)) == -1 && errno != EINVAL) {
+	    statusbar(_("Error writing %s: %s"), realname,
+		strerror(errno));
+	    fclose(f);
+	    goto cleanup_and_exit;
+	}
+
+	if (fclose(f) != 0) {
 	    statusbar(_("Error writing %s: %s"), realname,
 		strerror(errno));
 	    goto cleanup_and_exit;
+	}
     }
 
+#ifndef NANO_TINY
+    /* Put the new file in the place of the old one. */
+    if (atomicname != NULL) {
+	if (rename(atomicname, realname) == -1) {
+	    statusbar(_("Error writing %s: %s"), realname,
+		strerror(errno));
+	    goto cleanup_and_exit;
+	}
+
+	free(atomicname);
+	atomicname = NULL;
+	sync_directory(realname);
+    }
+#endif
+
+    gettimeofday(&end, NULL);
+
     if (!tmp && append == OVERWRITE) {
 	if (!nonamechange) {
+#ifndef NANO_TINY
+	    /* The changes in the autosave journal are saved now. */
+	    discard_journal();
+#endif
 	    openfile->filename = mallocstrcpy(openfile->filename,
 		realname);
 #ifdef ENABLE_COLOR
@@ -1895,9 +3437,30 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	    openfile->current_stat =
 		(struct stat *)nmalloc(sizeof(struct stat));
 	stat(realname, openfile->current_stat);
+
+	/* Keep the undo history along with the file, and let a new
+	 * autosave journal refer to its lines, if it's all of the buffer
+	 * that was written. */
+	if (!nonamechange) {
+	    save_undo_history(realname);
+	    if (autosave > 0)
+		number_original_lines();
+	}
 #endif
 
-	statusbar(P_("Wrote %lu line", "Wrote %lu lines",
+	/* Say how fast the writing went, if it took long enough to
+	 * matter. */
+	elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec -
+		start.tv_usec) / 1000;
+
+	if (elapsed >= 1000)
+	    statusbar(P_("Wrote %lu line (%lu kB/s)",
+		"Wrote %lu lines (%lu kB/s)",
+		(unsigned long)lineswritten),
+		(unsigned long)lineswritten, (unsigned long)(byteswritten /
+		1024 * 1000 / elapsed));
+	else
+	    statusbar(P_("Wrote %lu line", "Wrote %lu lines",
 		(unsigned long)lineswritten),
 		(unsigned long)lineswritten);
 	openfile->modified = FALSE;
@@ -1910,6 +3473,13 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
     free(realname);
     if (tempname != NULL)
 	free(tempname);
+    /* If the new file didn't replace the old one, get rid of it. */
+    if (atomicname != NULL) {
+	if (atomic_fd != -1)
+	    close(atomic_fd);
+	unlink(atomicname);
+	free(atomicname);
+    }
 
     return retval;
 }
@@ -81,11 +81,24 @@ partition *filepart = NULL;
 	 * file. */
 openfilestruct *openfile = NULL;
 	/* The list of all open file buffers. */
+unsigned long edit_count = 0;
+	/* How many times a buffer has been made or had its text changed,
+	 * so that what's been worked out from the text can tell whether
+	 * it's still current. */
 
 #ifndef NANO_TINY
 char *matchbrackets = NULL;
 	/* The opening and closing brackets that can be found by bracket
 	 * searches. */
+ssize_t undomemory = 0;
+	/* How many kilobytes the undo list of each buffer may take up, or
+	 * 0 for no limit. */
+ssize_t autosave = 0;
+	/* How many seconds after a change it has to be in the autosave
+	 * journal of its buffer, or 0 for no journals. */
+ssize_t unload_after = 0;
+	/* How many seconds an unmodified buffer has to go unseen before
+	 * the text of its file is let go of, or 0 for never. */
 #endif
 
 #if !defined(NANO_TINY) && defined(ENABLE_NANORC)
@@ -188,6 +201,10 @@ regex_t search_regexp;
 regmatch_t regmatches[10];
 	/* The match positions for parenthetical subexpressions, 10
 	 * maximum, used in regular expression searches. */
+char *search_literal = NULL;
+	/* The regular expression in search_regexp, if it has no special
+	 * characters and is case sensitive, so that it can be searched
+	 * for as plain text. */
 #endif
 
 int reverse_attr = A_REVERSE;
@@ -1728,6 +1745,9 @@ void thanks_for_all_the_fish(void)
 	free(last_search);
     if (last_replace != NULL)
 	free(last_replace);
+#ifdef HAVE_REGEX_H
+    regexp_cleanup();
+#endif
 #ifndef DISABLE_SPELLER
     if (alt_speller != NULL)
 	free(alt_speller);
@@ -1741,9 +1761,14 @@ void thanks_for_all_the_fish(void)
 	free_filestruct(jusbuffer);
 #endif
 #ifdef DEBUG
-    /* Free the memory associated with each open file buffer. */
-    if (openfile != NULL)
-	free_openfilestruct(openfile);
+    /* Free the memory associated with each open file buffer.  Since
+     * delete_node() looks at openfile, forget it first. */
+    if (openfile != NULL) {
+	openfilestruct *bill = openfile;
+
+	openfile = NULL;
+	free_openfilestruct(bill);
+    }
 #endif
 #ifdef ENABLE_COLOR
     if (syntaxstr != NULL)
@@ -1757,10 +1782,6 @@ void thanks_for_all_the_fish(void)
 
 	    syntaxes->extensions = bob->next;
 	    free(bob->ext_regex);
-	    if (bob->ext != NULL) {
-		regfree(bob->ext);
-		free(bob->ext);
-	    }
 	    free(bob);
 	}
 	while (syntaxes->color != NULL) {
@@ -1768,21 +1789,31 @@ void thanks_for_all_the_fish(void)
 
 	    syntaxes->color = bob->next;
 	    free(bob->start_regex);
-	    if (bob->start != NULL) {
-		regfree(bob->start);
-		free(bob->start);
-	    }
+	    if (bob->firstbytes != NULL)
+		free(bob->firstbytes);
 	    if (bob->end_regex != NULL)
 		free(bob->end_regex);
-	    if (bob->end != NULL) {
-		regfree(bob->end);
-		free(bob->end);
-	    }
 	    free(bob);
 	}
+	if (syntaxes->keywords != NULL) {
+	    int i;
+
+	    for (i = 0; i < KEYWORD_BUCKETS; i++) {
+		while (syntaxes->keywords[i] != NULL) {
+		    keywordtype *bob = syntaxes->keywords[i];
+
+		    syntaxes->keywords[i] = bob->next;
+		    free(bob->word);
+		    free(bob);
+		}
+	    }
+	    free(syntaxes->keywords);
+	}
 	syntaxes = syntaxes->next;
 	free(bill);
     }
+    free_syntax_index();
+    free_regexes();
 #endif /* ENABLE_COLOR */
 #ifndef NANO_TINY
     /* Free the search and replace history lists. */
@@ -29,6 +29,11 @@
 /* Move to the first line of the file. */
 void do_first_line(void)
 {
+#ifndef NANO_TINY
+    if (openfile->paged != NULL)
+	paged_window(1);
+#endif
+
     openfile->current = openfile->edittop = openfile->fileage;
     openfile->current_x = 0;
     openfile->placewewant = 0;
@@ -39,6 +44,13 @@ void do_first_line(void)
 /* Move to the last line of the file. */
 void do_last_line(void)
 {
+#ifndef NANO_TINY
+    if (openfile->paged != NULL) {
+	paged_truncated();
+	paged_window(paged_lines());
+    }
+#endif
+
     openfile->current = openfile->filebot;
     openfile->current_x = strlen(openfile->filebot->data);
     openfile->placewewant = xplustabs();
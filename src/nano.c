@@ -70,6 +70,10 @@ filestruct *make_new_node(filestruct *prevnode)
 
 #ifdef ENABLE_COLOR
     newnode->multidata = NULL;
+    newnode->spans = NULL;
+#endif
+#ifndef NANO_TINY
+    newnode->journalno = 0;
 #endif
 
     return newnode;
@@ -90,6 +94,10 @@ filestruct *copy_node(const filestruct *src)
     dst->lineno = src->lineno;
 #ifdef ENABLE_COLOR
     dst->multidata = NULL;
+    dst->spans = NULL;
+#endif
+#ifndef NANO_TINY
+    dst->journalno = 0;
 #endif
 
     return dst;
@@ -124,15 +132,26 @@ void delete_node(filestruct *fileptr)
 {
     assert(fileptr != NULL && fileptr->data != NULL);
 
+    /* If the line numbers from this line on are stale, they're now
+     * stale from the next line on. */
+    if (openfile != NULL && fileptr == openfile->renumber_pending)
+	openfile->renumber_pending = fileptr->next;
+
+#ifndef NANO_TINY
+    unindex_line(fileptr);
+#endif
+
     if (fileptr->data != NULL)
-	free(fileptr->data);
+	nfree(fileptr->data);
 
 #ifdef ENABLE_COLOR
     if (fileptr->multidata)
 	free(fileptr->multidata);
+    if (fileptr->spans != NULL)
+	free(fileptr->spans);
 #endif
 
-    free(fileptr);
+    nfree(fileptr);
 }
 
 /* Duplicate a whole filestruct. */
@@ -177,15 +196,116 @@ void free_filestruct(filestruct *src)
 void renumber(filestruct *fileptr)
 {
     ssize_t line;
+#if defined(ENABLE_COLOR) || !defined(NANO_TINY)
+    ssize_t before;
+	/* The number of the line before fileptr. */
+    const filestruct *last = NULL;
+	/* The last line we renumber. */
+    bool in_buffer;
+	/* Are these lines of the current buffer? */
+#endif
 
     assert(fileptr != NULL);
 
     line = (fileptr->prev == NULL) ? 0 : fileptr->prev->lineno;
+#if defined(ENABLE_COLOR) || !defined(NANO_TINY)
+    before = line;
+#endif
+#ifndef NANO_TINY
+    /* Index the lines as we go, as if they were lines of the current
+     * buffer, since we can't tell yet. */
+    reset_line_index_after(line);
+#endif
 
     assert(fileptr != fileptr->next);
 
-    for (; fileptr != NULL; fileptr = fileptr->next)
+    for (; fileptr != NULL; fileptr = fileptr->next) {
+	/* If we get to the lines that renumber_lazily() left stale,
+	 * we're bringing them up to date too. */
+	if (openfile != NULL && fileptr == openfile->renumber_pending)
+	    openfile->renumber_pending = NULL;
+
+	fileptr->lineno = ++line;
+#ifndef NANO_TINY
+	if ((line - 1) % LINE_INDEX_STRIDE == 0)
+	    index_line(fileptr);
+#endif
+#if defined(ENABLE_COLOR) || !defined(NANO_TINY)
+	last = fileptr;
+#endif
+    }
+
+#if defined(ENABLE_COLOR) || !defined(NANO_TINY)
+    /* See whether these are lines of the current buffer, as opposed to
+     * e.g. the cutbuffer or a partition of the buffer. */
+    in_buffer = (openfile != NULL && filepart == NULL && last ==
+	openfile->filebot);
+#endif
+
+#ifdef ENABLE_COLOR
+    /* If they are, the line before them now has different lines after
+     * it. */
+    if (in_buffer)
+	reset_multis_after(before);
+#endif
+#ifndef NANO_TINY
+    /* If they aren't, take back the lines we indexed. */
+    if (!in_buffer)
+	reset_line_index_after(before);
+#endif
+}
+
+/* Renumber the entries in the current filestruct starting with fileptr,
+ * but only as far as the edit window can reach, and leave the rest to
+ * renumber_flush().  This keeps Enter, Backspace and Delete fast near
+ * the top of a huge file.  It must only be used when nothing looks at
+ * the numbers of lines below the edit window before renumber_flush() is
+ * called, which do_input() does before running any other function. */
+void renumber_lazily(filestruct *fileptr)
+{
+    ssize_t line;
+    int count = 0;
+    bool passed_pending = (openfile->renumber_pending == NULL);
+	/* Have we renumbered the first line left stale last time? */
+
+    assert(fileptr != NULL);
+
+    line = (fileptr->prev == NULL) ? 0 : fileptr->prev->lineno;
+
+#ifdef ENABLE_COLOR
+    reset_multis_after(line);
+#endif
+#ifndef NANO_TINY
+    reset_line_index_after(line);
+#endif
+
+    /* Renumber the lines that the edit window can show, and keep going
+     * until we've caught up with the lines left stale last time, so
+     * that everything before the first stale line stays up to date. */
+    for (; fileptr != NULL && (count <= editwinrows || !passed_pending);
+	fileptr = fileptr->next, count++) {
+	if (fileptr == openfile->renumber_pending)
+	    passed_pending = TRUE;
+
 	fileptr->lineno = ++line;
+#ifndef NANO_TINY
+	if ((line - 1) % LINE_INDEX_STRIDE == 0)
+	    index_line(fileptr);
+#endif
+    }
+
+    /* If we never got to the lines left stale last time, they're still
+     * the first stale ones. */
+    if (passed_pending)
+	openfile->renumber_pending = fileptr;
+}
+
+/* Renumber the lines of the current filestruct that renumber_lazily()
+ * left stale, if any. */
+void renumber_flush(void)
+{
+    if (openfile != NULL && openfile->renumber_pending != NULL)
+	renumber(openfile->renumber_pending);
 }
 
 /* Partition a filestruct so that it begins at (top, top_x) and ends at
@@ -371,6 +491,10 @@ void move_to_filestruct(filestruct **file_top, filestruct **file_bot,
 
 #ifdef ENABLE_COLOR
     openfile->fileage->multidata = NULL;
+    openfile->fileage->spans = NULL;
+#endif
+#ifndef NANO_TINY
+    openfile->fileage->journalno = 0;
 #endif
 
     /* Restore the current line and cursor position.  If the mark begins
@@ -520,6 +644,20 @@ openfilestruct *make_new_opennode(void)
 #ifndef NANO_TINY
     newnode->current_stat = NULL;
     newnode->last_action = OTHER;
+    newnode->lineindex = NULL;
+    newnode->lineindex_len = 0;
+    newnode->lineindex_size = 0;
+#endif
+    newnode->lineblock = NULL;
+    newnode->renumber_pending = NULL;
+
+    edit_count++;
+#ifdef ENABLE_COLOR
+    newnode->syntax = NULL;
+    newnode->multi_valid = 0;
+    newnode->endsearch_from = NULL;
+    newnode->endsearch_found = NULL;
+    newnode->idle_top = NULL;
 #endif
 
     return newnode;
@@ -560,6 +698,21 @@ void delete_opennode(openfilestruct *fileptr)
 #ifndef NANO_TINY
     if (fileptr->current_stat != NULL)
 	free(fileptr->current_stat);
+    forget_undo_history(fileptr);
+    if (fileptr->journal != NULL)
+	fclose(fileptr->journal);
+    if (fileptr->paged != NULL)
+	free_paged(fileptr->paged);
+    if (fileptr->lineindex != NULL)
+	free(fileptr->lineindex);
+#endif
+    if (fileptr->lineblock != NULL)
+	lineblock_release(fileptr->lineblock);
+#ifdef ENABLE_COLOR
+    if (fileptr->endsearch_from != NULL) {
+	free(fileptr->endsearch_from);
+	free(fileptr->endsearch_found);
+    }
 #endif
 
     free(fileptr);
@@ -744,6 +897,9 @@ void window_init(void)
     bottomwin = newwin(3 - no_help(), COLS, editwinrows + (2 -
 	no_more_space()), 0);
 
+    /* The new edit window shows nothing yet. */
+    forget_rows();
+
     /* Turn the keypad on for the windows, if necessary. */
     if (!ISSET(REBIND_KEYPAD)) {
 	keypad(topwin, TRUE);
@@ -1050,6 +1206,11 @@ void do_exit(void)
     /* If the user chose not to save, or if the user chose to save and
      * the save succeeded, we're ready to exit. */
     if (i == 0 || (i == 1 && do_writeout(TRUE))) {
+#ifndef NANO_TINY
+	/* The changes have been saved or thrown away, so the autosave
+	 * journal isn't needed anymore. */
+	discard_journal();
+#endif
 #ifdef ENABLE_MULTIBUFFER
 	/* Exit only if there are no more open file buffers. */
 	if (!close_buffer())
@@ -1283,6 +1444,9 @@ RETSIGTYPE handle_sigwinch(int signal)
     if (filepart != NULL)
 	unpartition_filestruct(&filepart);
 
+    /* The edit window may now show lines whose numbers are stale. */
+    renumber_flush();
+
 #ifdef USE_SLANG
     /* Slang curses emulation brain damage, part 1: If we just do what
      * curses does here, it'll only work properly if the resize made the
@@ -1357,15 +1521,18 @@ void do_toggle(int flag)
 #ifdef ENABLE_NANORC
 	case WHITESPACE_DISPLAY:
 	    titlebar(NULL);
+	    forget_rows();
 	    edit_refresh();
 	    break;
 #endif
 #ifdef ENABLE_COLOR
 	case NO_COLOR_SYNTAX:
+	    forget_rows();
 	    edit_refresh();
 	    break;
 #endif
 	case SOFTWRAP:
+	    forget_rows();
 	    total_refresh();
 	    break;
     }
@@ -1508,6 +1675,12 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 	/* The length of the input buffer. */
     bool cut_copy = FALSE;
 	/* Are we cutting or copying text? */
+#ifndef NANO_TINY
+    static bool pasting = FALSE;
+	/* Are we in the middle of a paste? */
+    bool paste_key;
+	/* Can the key we read in be part of a paste? */
+#endif
     const sc *s;
     bool have_shortcut;
 
@@ -1523,6 +1696,7 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 	/* If we got a mouse click and it was on a shortcut, read in the
 	 * shortcut character. */
 	if (*func_key && input == KEY_MOUSE) {
+	    renumber_flush();
 	    if (do_mouse() == 1)
 		input = get_kbinput(edit, meta_key, func_key);
 	    else {
@@ -1554,6 +1728,18 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
     }
 
     if (allow_funcs) {
+#ifndef NANO_TINY
+	/* Text, Tabs and Enters that come in faster than anyone can
+	 * type are a paste, which is undone all at once. */
+	paste_key = (input != ERR && !ISSET(VIEW_MODE) &&
+		(!have_shortcut || s->scfunc == DO_ENTER || s->scfunc ==
+		DO_TAB));
+	if (paste_key && !pasting && get_key_buffer_len() > 0) {
+	    begin_undo_group(TRUE);
+	    pasting = TRUE;
+	}
+#endif
+
 	/* If we got a character, and it isn't a shortcut or toggle,
 	 * it's a normal text character.  Display the warning if we're
 	 * in view mode, or add the character to the input buffer if
@@ -1604,6 +1790,15 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 		free(kbinput);
 		kbinput = NULL;
 	    }
+
+#ifndef NANO_TINY
+	    /* A paste is over when all of it is in, or when something
+	     * that can't be part of it comes along. */
+	    if (pasting && (!have_shortcut || !paste_key)) {
+		end_undo_group();
+		pasting = FALSE;
+	    }
+#endif
 	}
 
 	if (have_shortcut) {
@@ -1626,10 +1821,21 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 
 		    if (s->scfunc != 0) {
 			const subnfunc *f = sctofunc((sc *) s);
+			bool edits = (f != NULL && !f->viewok);
+			    /* Can the function change the text?  Note this
+			     * now, as running it may rebuild the function
+			     * list, as inserting a file does. */
 			*ran_func = TRUE;
 			if (ISSET(VIEW_MODE) && f && !f->viewok)
 			    print_view_warning();
 			else {
+			    /* Only Enter, Backspace and Delete can cope with
+			     * stale line numbers below the edit window, so
+			     * bring them up to date before anything else. */
+			    if (s->scfunc != DO_ENTER && s->scfunc !=
+				DO_BACKSPACE && s->scfunc != DO_DELETE)
+				renumber_flush();
+
 #ifndef NANO_TINY
 			    if (s->scfunc ==  DO_TOGGLE)
 				do_toggle(s->toggle);
@@ -1638,10 +1844,14 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 			    {
 #endif
 				iso_me_harder_funcmap(s->scfunc);
+				/* A function that isn't allowed in view
+				 * mode may have changed the text. */
+				if (edits)
+				    edit_count++;
 #ifdef ENABLE_COLOR
-				if (f && !f->viewok && openfile->syntax != NULL
+				if (edits && openfile->syntax != NULL
 					&& openfile->syntax->nmultis > 0) {
-				    reset_multis(openfile->current, FALSE);
+				    reset_multis(openfile->current);
 				}
 #endif
 				if (edit_refresh_needed) {
@@ -1658,6 +1868,13 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 		    *finished = TRUE;
 		    break;
 	    }
+
+#ifndef NANO_TINY
+	    if (pasting && get_key_buffer_len() == 0) {
+		end_undo_group();
+		pasting = FALSE;
+	    }
+#endif
 	}
     }
 
@@ -1764,141 +1981,50 @@ int do_mouse(void)
 #ifdef ENABLE_COLOR
 void alloc_multidata_if_needed(filestruct *fileptr)
 {
-    if (!fileptr->multidata)
+    if (!fileptr->multidata) {
+	int i;
+
 	fileptr->multidata = (short *) nmalloc(openfile->syntax->nmultis * sizeof(short));
+	for (i = 0; i < openfile->syntax->nmultis; i++)
+	    fileptr->multidata[i] = 0;
+    }
 }
 
-/* Precalculate the multi-line start and end regex info so we can speed up
-   rendering (with any hope at all...) */
+/* Precalculate the multi-line regex states of all lines, so we can
+ * speed up rendering (with any hope at all...).  Whatever we don't get
+ * to is worked out when it's needed. */
 void precalc_multicolorinfo(void)
 {
 #ifdef DEBUG
 	    fprintf(stderr, "entering precalc_multicolorinfo()\n");
 #endif
     if (openfile->colorstrings != NULL && !ISSET(NO_COLOR_SYNTAX)) {
-	const colortype *tmpcolor = openfile->colorstrings;
-	regmatch_t startmatch, endmatch;
-	filestruct *fileptr, *endptr;
+	filestruct *fileptr;
 	time_t last_check = time(NULL), cur_check = 0;
+	int input;
 
 	/* Let us get keypresses to see if the user is trying to
 	   start editing.  We may want to throw up a statusbar
 	   message before starting this later if it takes
 	   too long to do this routine.  For now silently
-	   abort if they hit a key */
- 	nodelay(edit, FALSE);
-
-	for (; tmpcolor != NULL; tmpcolor = tmpcolor->next) {
-
-	    /* If it's not a multi-line regex, amscray */
-	    if (tmpcolor->end == NULL)
-		continue;
-#ifdef DEBUG
-	    fprintf(stderr, "working on color id %d\n", tmpcolor->id);
-#endif
-
-
-	    for (fileptr = openfile->fileage; fileptr != NULL; fileptr = fileptr->next) {
-		int startx = 0;
-		int nostart = 0;
-
-
-#ifdef DEBUG
-	    fprintf(stderr, "working on lineno %lu\n", (unsigned long) fileptr->lineno);
-#endif
-
-		alloc_multidata_if_needed(fileptr);
-
-		if ((cur_check = time(NULL)) - last_check > 1) {
-		    last_check = cur_check;
-		    if (wgetch(edit) != ERR)
-	   		goto precalc_cleanup;
-		}
-
-		while ((nostart = regexec(tmpcolor->start, &fileptr->data[startx], 1, &startmatch, 0))  == 0) {
-		    /* Look for end and start marking how many lines are encompassed
-		       whcih should speed up rendering later */
-		    startx += startmatch.rm_eo;
-#ifdef DEBUG
-		    fprintf(stderr, "match found at pos %d...", startx);
-#endif
-
-		    /* Look on this line first for end */
-		    if (regexec(tmpcolor->end, &fileptr->data[startx], 1, &endmatch, 0)  == 0) {
-			startx += endmatch.rm_eo;
-			fileptr->multidata[tmpcolor->id] |= CSTARTENDHERE;
-#ifdef DEBUG
-	    fprintf(stderr, "end found on this line\n");
-#endif
-			continue;
-		    }
-
-		    /* Nice, we didn't find the end regex on this line.  Let's start looking for it */
-		    for (endptr = fileptr->next; endptr != NULL; endptr = endptr->next) {
-
-#ifdef DEBUG
-	    fprintf(stderr, "advancing to line %lu to find end...\n", (unsigned long) endptr->lineno);
-#endif
-			/* Check for keyboard input  again */
-			if ((cur_check = time(NULL)) - last_check > 1) {
-			    last_check = cur_check;
-			    if (wgetch(edit) != ERR)
-		   		goto precalc_cleanup;
-			}
-			if (regexec(tmpcolor->end, endptr->data, 1, &endmatch, 0) == 0)
-			   break;
-		    }
-
-		    if (endptr == NULL) {
-#ifdef DEBUG
-	    		fprintf(stderr, "no end found, breaking out\n");
-#endif
-			break;
-		    }
-
-
-#ifdef DEBUG
-		    fprintf(stderr, "end found\n");
-#endif
-
-		    /* We found it, we found it, la la la la la.  Mark all the
-			lines in between and the ends properly */
-		    fileptr->multidata[tmpcolor->id] |= CENDAFTER;
-#ifdef DEBUG
-		    fprintf(stderr, "marking line %lu as CENDAFTER\n", (unsigned long) fileptr->lineno);
-#endif
-		    for (fileptr = fileptr->next; fileptr != endptr; fileptr = fileptr->next) {
-			alloc_multidata_if_needed(fileptr);
-			fileptr->multidata[tmpcolor->id] = CWHOLELINE;
-#ifdef DEBUG
-			fprintf(stderr, "marking intermediary line %lu as CWHOLELINE\n", (unsigned long) fileptr->lineno);
-#endif
-		    }
-		    alloc_multidata_if_needed(endptr);
-#ifdef DEBUG
-		    fprintf(stderr, "marking line %lu as BEGINBEFORE\n", (unsigned long) fileptr->lineno);
-#endif
-		    endptr->multidata[tmpcolor->id] |= CBEGINBEFORE;
-		    /* We should be able to skip all the way to the line of the match.
-			This may introduce more bugs but it's the Right Thing to do */
-		    fileptr = endptr;
-		    startx = endmatch.rm_eo;
-#ifdef DEBUG
-		    fprintf(stderr, "jumping to line %lu pos %d to continue\n", (unsigned long) endptr->lineno, startx);
-#endif
-		}
-		if (nostart && startx == 0) {
-#ifdef DEBUG
-		    fprintf(stderr, "no start found on line %lu, continuing\n", (unsigned long) fileptr->lineno);
-#endif
-		    fileptr->multidata[tmpcolor->id] = CNONE;
-		    continue;
+	   stop if they hit a key, and leave the key for them */
+	nodelay(edit, TRUE);
+
+	for (fileptr = openfile->fileage; fileptr != NULL;
+		fileptr = fileptr->next) {
+	    if ((cur_check = time(NULL)) - last_check > 1) {
+		last_check = cur_check;
+		if ((input = wgetch(edit)) != ERR) {
+		    ungetch(input);
+		    break;
 		}
 	    }
+
+	    calc_multis(fileptr);
 	}
+
+	nodelay(edit, FALSE);
     }
-precalc_cleanup:
-    nodelay(edit, FALSE);
 }
 #endif /* ENABLE_COLOR */
 
@@ -1984,12 +2110,6 @@ void do_output(char *output, size_t output_len, bool allow_cntrls)
 		edit_refresh_needed = TRUE;
 #endif
 
-#ifdef ENABLE_COLOR
-	/* If color syntaxes are available and turned on, we need to
-	 * call edit_refresh(). */
-	if (openfile->colorstrings != NULL && !ISSET(NO_COLOR_SYNTAX))
-	    edit_refresh_needed = TRUE;
-#endif
     }
 
     /* Well we might also need a full refresh if we've changed the 
@@ -2002,9 +2122,10 @@ void do_output(char *output, size_t output_len, bool allow_cntrls)
 
     openfile->placewewant = xplustabs();
 
+    edit_count++;
 
 #ifdef ENABLE_COLOR
-    reset_multis(openfile->current, FALSE);
+    reset_multis(openfile->current);
 #endif
     if (edit_refresh_needed == TRUE) {
 	edit_refresh();
@@ -2593,7 +2714,14 @@ int main(int argc, char **argv)
 		icol == 1)
 		parse_line_column(&argv[i][1], &iline, &icol);
 	    else {
-		open_buffer(argv[i], FALSE);
+#ifndef NANO_TINY
+		/* Leave reading in the file until it's switched to,
+		 * unless the cursor has to go somewhere in it. */
+		if (iline == 1 && icol == 1)
+		    open_buffer_lazily(argv[i]);
+		else
+#endif
+		    open_buffer(argv[i], FALSE);
 
 		if (iline > 1 || icol > 1) {
 		    do_gotolinecolumn(iline, icol, FALSE, FALSE, FALSE,
@@ -2646,6 +2774,12 @@ int main(int argc, char **argv)
     while (TRUE) {
 	bool meta_key, func_key, s_or_t, ran_func, finished;
 
+#ifndef NANO_TINY
+	/* If the cursor has come near the end of the lines of a paged
+	 * file that are in memory, get the ones around it. */
+	paged_follow();
+
+#endif
 	/* Make sure the cursor is in the edit window. */
 	reset_cursor();
 	wnoutrefresh(edit);
@@ -186,7 +186,8 @@ typedef enum {
 }  function_type;
 
 typedef enum {
-    ADD, DEL, REPLACE, SPLIT, UNSPLIT, CUT, UNCUT, ENTER, INSERT, OTHER
+    ADD, DEL, REPLACE, REPLACE_ALL, SPLIT, UNSPLIT, CUT, UNCUT, ENTER,
+    INSERT, PASTE, INDENT, OTHER
 } undo_type;
 
 #ifdef ENABLE_COLOR
@@ -206,6 +207,12 @@ typedef struct colortype {
 	/* The start (or all) of the regex string. */
     regex_t *start;
 	/* The compiled start (or all) of the regex string. */
+    unsigned char *firstbytes;
+	/* A bitmap of the bytes that a match of a single-line regex
+	 * can begin with, or NULL if it can begin with anything. */
+    bool keywords;
+	/* Does the regex only match whole words from a list, which we
+	 * look up in its syntax's keyword table instead? */
     char *end_regex;
 	/* The end (if any) of the regex string. */
     regex_t *end;
@@ -225,6 +232,36 @@ typedef struct exttype {
 	/* Next set of extensions. */
 } exttype;
 
+typedef struct keywordtype {
+    char *word;
+	/* A word that a keyword color matches, in lowercase if the
+	 * color is case insensitive. */
+    const colortype *color;
+	/* That color. */
+    struct keywordtype *next;
+	/* Next keyword with the same hash. */
+} keywordtype;
+
+typedef struct colorspan {
+    size_t so;
+	/* Where a match of a single-line regex starts in a line. */
+    size_t eo;
+	/* Where it ends. */
+    const colortype *color;
+	/* The color of the regex, or NULL after the last match. */
+} colorspan;
+
+typedef struct regexcachetype {
+    char *regex;
+	/* A regex string of a syntax, as it was given. */
+    int cflags;
+	/* The flags besides REG_EXTENDED that it was compiled with. */
+    regex_t compiled;
+	/* Its compiled form. */
+    struct regexcachetype *next;
+	/* Next regex with the same hash. */
+} regexcachetype;
+
 typedef struct syntaxtype {
     char *desc;
 	/* The name of this syntax. */
@@ -236,22 +273,75 @@ typedef struct syntaxtype {
 	/* The colors used in this syntax. */
     int nmultis;
 	/* How many multi line strings this syntax has */
+    keywordtype **keywords;
+	/* The hash table of the words that the keyword colors in this
+	 * syntax match, if there are any. */
+    bool icase_keywords;
+	/* Are any of those colors case insensitive? */
     struct syntaxtype *next;
 	/* Next syntax. */
 } syntaxtype;
 
-#define CNONE 		(1<<1)
-	/* Yay, regex doesn't apply to this line at all! */
-#define CBEGINBEFORE 	(1<<2)
-	/* regex starts on an earlier line, ends on this one */
-#define CENDAFTER 	(1<<3)
-	/* regex sraers on this line and ends on a later one */
-#define CWHOLELINE 	(1<<4)
-	/* whole line engulfed by the regex  start < me, end > me */
-#define CSTARTENDHERE 	(1<<5)
-	/* regex starts and ends within this line */
-#define CWTF		(1<<6)
-	/* Something else */
+#ifndef NANO_TINY
+typedef struct rcfiletype {
+    char *name;
+	/* The name of an rcfile that was read, or looked for. */
+    bool exists;
+	/* Whether it was there. */
+    struct stat st;
+	/* Its size, modification time, and inode, if so. */
+    struct rcfiletype *next;
+	/* Next rcfile. */
+} rcfiletype;
+
+typedef struct rclinetype {
+    char *text;
+	/* A set, unset, bind, or unbind command from an rcfile. */
+    const rcfiletype *from;
+	/* That rcfile. */
+    size_t lineno;
+	/* The line it was on. */
+    struct rclinetype *next;
+	/* Next command. */
+} rclinetype;
+#endif
+
+typedef struct syntaxindextype {
+    char *key;
+	/* A file name ending, starting with a dot, that an extension
+	 * regex matches, or a file name. */
+    exttype *ext;
+	/* Or the extension regex itself, if it's not that simple. */
+    syntaxtype *syntax;
+	/* The syntax that it picks, or NULL if none. */
+    size_t order;
+	/* Where that syntax is in the list of syntaxes. */
+    struct syntaxindextype *next;
+	/* Next entry with the same hash, or next extension regex. */
+} syntaxindextype;
+
+/* The number of buckets in a syntax's keyword hash table, and the most
+ * words that one color may add to it. */
+#define KEYWORD_BUCKETS 256
+#define MAX_KEYWORDS 1024
+
+/* The number of buckets in the table of compiled regexes. */
+#define REGEX_BUCKETS 512
+
+/* The number of buckets in the tables of file name endings and of file
+ * names that pick syntaxes. */
+#define SYNTAX_BUCKETS 256
+
+/* The bits of each entry in filestruct->multidata[], one for each
+ * multi-line regex. */
+#define CSTARTSINSIDE	(1<<0)
+	/* The line begins inside a region of the regex, i.e. after a
+	 * start match on an earlier line that no end match has closed
+	 * yet.  Only right for lines up to openfile->multi_valid. */
+#define CENDCHECKED	(1<<1)
+	/* We've looked for an end match of the regex on the line. */
+#define CHASEND		(1<<2)
+	/* And we found one. */
 
 #endif /* ENABLE_COLOR */
 
@@ -267,10 +357,88 @@ typedef struct filestruct {
     struct filestruct *prev;
 	/* Previous node. */
 #ifdef ENABLE_COLOR
-    short *multidata;		/* Array of which multi-line regexes apply to this line */
+    short *multidata;
+	/* What we know about each multi-line regex on this line; see
+	 * CSTARTSINSIDE and friends. */
+    colorspan *spans;
+	/* The matches of the single-line regexes on this line, in the
+	 * order of their colors, or NULL if not worked out yet. */
+    unsigned int spanhash;
+	/* The hash of the text that they were worked out for. */
+#endif
+#ifndef NANO_TINY
+    ssize_t journalno;
+	/* The number of this line in the file on disk, if it hasn't
+	 * changed since it was read from there; otherwise, minus one
+	 * minus where its text is in the autosave journal, if it hasn't
+	 * changed since it was written there; otherwise, 0. */
+    unsigned int journalsum;
+	/* A hash of its text at that time, to tell whether it has
+	 * changed since. */
 #endif
 } filestruct;
 
+#ifndef NANO_TINY
+typedef struct matchtype {
+    filestruct *line;
+	/* The line a match of a search is on. */
+    size_t x;
+	/* Where in the line it starts. */
+} matchtype;
+#endif
+
+typedef struct rowstate {
+    const filestruct *line;
+	/* The line last painted on this row of the edit window, or NULL
+	 * if we don't know what the row shows. */
+    unsigned int hash;
+	/* The hash of the text of that line at the time. */
+    size_t page_start;
+	/* The column of the line that the row began at. */
+    size_t mark_from;
+    size_t mark_to;
+	/* The part of the line that was shown as selected, if any. */
+    unsigned int colors;
+	/* Which multi-line regexes the line started inside of. */
+} rowstate;
+
+typedef struct lineblock {
+    char *mem;
+	/* The memory that nodes and lines of text are carved out of. */
+    size_t size;
+	/* The size of that memory. */
+    size_t used;
+	/* How much of that memory has been carved out so far. */
+    size_t refs;
+	/* How many carved-out pieces are still in use, plus one while a
+	 * buffer is still carving pieces out of this block. */
+} lineblock;
+
+#ifndef NANO_TINY
+typedef struct pagedtype {
+    char *map;
+	/* The file, mapped in read-only. */
+    size_t map_size;
+	/* How much of it is mapped. */
+    int fd;
+	/* The file, kept open to see whether it gets truncated. */
+    size_t size;
+	/* How much of the mapping we may read, which is less than all
+	 * of it once the file has been truncated. */
+    size_t *starts;
+	/* Where every PAGED_STRIDE'th line starts: starts[i] is where
+	 * line i * PAGED_STRIDE + 1 starts. */
+    size_t starts_len;
+	/* How many of those are known so far. */
+    size_t starts_size;
+	/* How many of them there is room for. */
+    size_t scanned;
+	/* How far into the file we've looked for newlines. */
+    ssize_t newlines;
+	/* How many newlines there are before that. */
+} pagedtype;
+#endif
+
 typedef struct partition {
     filestruct *fileage;
 	/* The top line of this portion of the file. */
@@ -298,6 +466,11 @@ typedef struct undo {
 	/* Where did this  action begin or end */
     char *strdata;
 	/* String type data we will use for ccopying the affected line back */
+    size_t strdata_len;
+	/* How long strdata is, for the types that add to it a character
+	 * at a time */
+    size_t strdata_size;
+	/* And how much room it has */
     char *strdata2;
 	/* Sigh, need this too it looks like */
     int xflags;
@@ -316,6 +489,14 @@ typedef struct undo {
 	/* copy copy copy */
     ssize_t mark_begin_x;
 	/* Another shadow variable */
+    size_t size;
+	/* Roughly how much memory this item took up once it was done, or
+	 * 0 if it hasn't been counted yet */
+    unsigned long group;
+	/* The group of items this one is undone and redone along with,
+	 * or 0 if it's on its own */
+    struct undo *prev;
+	/* The next newer item */
     struct undo *next;
 } undo;
 
@@ -360,13 +541,71 @@ typedef struct openfilestruct {
 	/* Top of the undo list */
     undo *current_undo;
 	/* The current (i.e. n ext) level of undo */
+    undo *undobot;
+	/* Bottom (oldest item) of the undo list */
+    size_t undo_size;
+	/* How much memory the counted items of the undo list take up */
+    char *undo_map;
+	/* The undo history file saved for this file, mapped in until
+	 * it's needed, or NULL */
+    size_t undo_map_len;
+	/* How long the mapped undo history file is */
     undo_type last_action;
+    FILE *journal;
+	/* The autosave journal of this buffer, once it's been started */
+    size_t journal_end;
+	/* How many bytes of it have been written */
+    ssize_t journal_lines;
+	/* How many lines of the file on disk it can refer to */
+    time_t journal_due;
+	/* When the changes that aren't in it yet have to go into it, or
+	 * 0 if there are none */
+    bool journal_ours;
+	/* Whether the autosave journal on disk was made or recovered
+	 * by us, so that it's ours to delete */
+    bool unloaded;
+	/* Whether the text of the file hasn't been read in yet, or has
+	 * been let go of again */
+    time_t last_shown;
+	/* When this buffer was last switched away from */
+    ssize_t unloaded_lineno;
+	/* Which line the cursor was on when the text was let go of */
+    ssize_t unloaded_top;
+	/* And which line was at the top of the edit window */
+    pagedtype *paged;
+	/* The mapped file that this buffer views a window of lines of,
+	 * or NULL if all of the file's lines are in memory */
+    filestruct **lineindex;
+	/* lineindex[i] is line i * LINE_INDEX_STRIDE + 1, as far as
+	 * fsfromline() has walked */
+    size_t lineindex_len;
+	/* How many of the lines in lineindex are still there and still
+	 * have those numbers */
+    size_t lineindex_size;
+	/* How many lines lineindex has room for */
 #endif
+    lineblock *lineblock;
+	/* The block that lines read into this file are carved out of. */
+    filestruct *renumber_pending;
+	/* The first line whose number renumber_lazily() left stale, if
+	 * any. */
 #ifdef ENABLE_COLOR
     syntaxtype *syntax;
 	/* The  syntax struct for this file, if any */
     colortype *colorstrings;
 	/* The current file's associated colors. */
+    ssize_t multi_valid;
+	/* The number of the last line whose multi-line regex state
+	 * (CSTARTSINSIDE) we've worked out; the ones after it have to be
+	 * worked out again from it. */
+    filestruct **endsearch_from;
+	/* For each multi-line regex, the line where we last started
+	 * looking for a line with an end match, if any. */
+    filestruct **endsearch_found;
+	/* And the first line from there on with an end match, if any. */
+    const filestruct *idle_top;
+	/* The top line of the edit window when idle_highlight() last got
+	 * through all lines, or NULL if lines have changed since then. */
 #endif
     struct openfilestruct *next;
 	/* Next node. */
@@ -495,7 +734,10 @@ enum
     BOLD_TEXT,
     QUIET,
     UNDOABLE,
-    SOFTWRAP
+    SOFTWRAP,
+    IDLE_HIGHLIGHT,
+    ATOMIC_SAVE,
+    RC_SNAPSHOT
 };
 
 /* Flags for which menus in which a given function should be present */
@@ -933,4 +1175,38 @@ enum
 /* The maximum number of bytes buffered at one time. */
 #define MAX_BUF_SIZE 128
 
+/* The number of bytes read from a file at one time. */
+#define READ_BLOCK_SIZE 65536
+
+/* The smallest and largest sizes of the blocks that the lines read from
+ * a file are carved out of. */
+#define LINEBLOCK_MIN_SIZE 16384
+#define LINEBLOCK_MAX_SIZE 1048576
+
+/* The smallest file that is paged through rather than read in when
+ * it's only going to be viewed, how many lines of it are kept in
+ * memory at a time, and every how many lines we remember where one
+ * starts. */
+#define PAGED_MIN_SIZE 67108864
+#define PAGED_WINDOW 1024
+#define PAGED_STRIDE 1024
+
+/* Every how many lines fsfromline() remembers the node of one. */
+#define LINE_INDEX_STRIDE 256
+
+/* The most matches of a search that are kept, so that repeating it can
+ * say which one was found. */
+#define MAX_SEARCH_MATCHES 1048576
+
+/* The number of bytes copied from one file to another at one time. */
+#define COPY_CHUNK 1048576
+
+/* The number of pieces of text handed to each writev() call when
+ * writing a file. */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define WRITE_PIECES IOV_MAX
+#else
+#define WRITE_PIECES 1024
+#endif
+
 #endif /* !NANO_H */
@@ -55,9 +55,13 @@ extern filestruct *jusbuffer;
 #endif
 extern partition *filepart;
 extern openfilestruct *openfile;
+extern unsigned long edit_count;
 
 #ifndef NANO_TINY
 extern char *matchbrackets;
+extern ssize_t undomemory;
+extern ssize_t autosave;
+extern ssize_t unload_after;
 #endif
 
 #if !defined(NANO_TINY) && defined(ENABLE_NANORC)
@@ -118,6 +122,7 @@ extern filestruct *replacebot;
 #ifdef HAVE_REGEX_H
 extern regex_t search_regexp;
 extern regmatch_t regmatches[10];
+extern char *search_literal;
 #endif
 
 extern int reverse_attr;
@@ -175,6 +180,7 @@ int mbwidth(const char *c);
 int mb_cur_max(void);
 char *make_mbchar(long chr, int *chr_mb_len);
 int parse_mbchar(const char *buf, char *chr, size_t *col);
+size_t plain_ascii_len(const char *s, size_t len);
 size_t move_mbleft(const char *buf, size_t pos);
 size_t move_mbright(const char *buf, size_t pos);
 #ifndef HAVE_STRCASECMP
@@ -229,7 +235,41 @@ bool is_valid_mbstring(const char *s);
 #ifdef ENABLE_COLOR
 void set_colorpairs(void);
 void color_init(void);
+void add_firstbyte(unsigned char *map, int c, bool icase);
+void add_firstbyte_class(unsigned char *map, int (*isclass)(int));
+bool bracket_firstbytes(const char **p, unsigned char *map, bool icase);
+bool alt_firstbytes(const char **p, unsigned char *map, bool icase);
+unsigned char *regex_firstbytes(const char *regex, bool icase);
+void free_words(char **words, size_t count);
+bool append_words(char ***words, size_t *count, char **suffixes, size_t
+	nsuffixes);
+bool bracket_words(const char **p, char ***words, size_t *count, bool
+	punct);
+bool alt_keywords(const char **p, char ***words, size_t *count, bool
+	punct);
+size_t keyword_hash(const char *word, size_t len);
+void add_keywords(syntaxtype *syntax, colortype *tmpcolor);
+const colorspan *find_keywords(const char *text, size_t *count);
+void calc_spans(filestruct *fileptr);
+regex_t *get_regex(const char *regex, int cflags, char **errstr);
+void free_regexes(void);
+size_t syntax_hash(const char *key);
+void add_syntax_entry(syntaxindextype **list, char *key, exttype *ext,
+	syntaxtype *syntax, size_t order);
+void index_syntaxes(void);
+syntaxtype *syntax_for_filename(const char *filename);
+void free_syntax_index(void);
 void color_update(void);
+bool next_multi_region(const colortype *tmpcolor, const char *text,
+	size_t len, size_t *pos, bool *inside, size_t *so, size_t *eo);
+bool carry_multis(filestruct *fileptr);
+void calc_multis(filestruct *fileptr);
+void forget_endsearches(void);
+bool multi_ends_later(const filestruct *fileptr, const colortype
+	*tmpcolor);
+void reset_multis_after(ssize_t lineno);
+void reset_multis(filestruct *fileptr);
+void idle_highlight(WINDOW *win);
 #endif
 
 /* All functions in cut.c. */
@@ -259,6 +299,24 @@ void make_new_buffer(void);
 void initialize_buffer(void);
 void initialize_buffer_text(void);
 void open_buffer(const char *filename, bool undoable);
+void fill_buffer(FILE *f, int rc, const char *filename, bool undoable,
+	bool new_buffer);
+#if !defined(NANO_TINY) && defined(ENABLE_MULTIBUFFER)
+void open_buffer_lazily(const char *filename);
+void load_buffer(void);
+void unload_buffers(void);
+#endif
+#ifndef NANO_TINY
+bool page_file(FILE *f);
+void free_paged(pagedtype *p);
+bool paged_truncated(void);
+ssize_t paged_lines(void);
+size_t paged_line_start(ssize_t lineno);
+size_t paged_prev_line(size_t offset);
+size_t paged_copy_line(size_t offset, char **buf, size_t *buf_size);
+void paged_window(ssize_t lineno);
+void paged_follow(void);
+#endif
 #ifndef DISABLE_SPELLER
 void replace_buffer(const char *filename);
 #endif
@@ -271,6 +329,8 @@ bool close_buffer(void);
 #endif
 filestruct *read_line(char *buf, filestruct *prevnode, bool
 	*first_line_ins, size_t buf_len);
+void read_append(char **buf, size_t *buf_size, size_t *buf_len, const
+	char *text, size_t len);
 void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkwritable);
 int open_file(const char *filename, bool newfie, FILE **f);
 char *get_next_filename(const char *name, const char *suffix);
@@ -291,8 +351,16 @@ bool check_operating_dir(const char *currpath, bool allow_tabcomp);
 #endif
 #ifndef NANO_TINY
 void init_backup_dir(void);
-#endif
-int copy_file(FILE *inn, FILE *out);
+char *flattened_path(const char *name);
+char *undo_history_name(const char *name);
+void save_undo_history(const char *name);
+void map_undo_history(const char *name);
+void mark_for_journal(void);
+void discard_journal(void);
+long journal_wait(void);
+void autosave_journals(void);
+#endif
+int copy_file(FILE *inn, FILE *out, bool sync);
 bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	append, bool nonamechange);
 #ifndef NANO_TINY
@@ -411,6 +479,8 @@ void delete_node(filestruct *fileptr);
 filestruct *copy_filestruct(const filestruct *src);
 void free_filestruct(filestruct *src);
 void renumber(filestruct *fileptr);
+void renumber_lazily(filestruct *fileptr);
+void renumber_flush(void);
 partition *partition_filestruct(filestruct *top, size_t top_x,
 	filestruct *bot, size_t bot_x);
 void unpartition_filestruct(partition **p);
@@ -544,12 +614,11 @@ char *parse_next_word(char *ptr);
 char *parse_argument(char *ptr);
 #ifdef ENABLE_COLOR
 char *parse_next_regex(char *ptr);
-bool nregcomp(const char *regex, int eflags);
+bool nregcomp(const char *regex, int eflags, bool keep);
 void parse_syntax(char *ptr);
 void parse_include(char *ptr);
 short color_to_short(const char *colorname, bool *bright);
 void parse_colors(char *ptr, bool icase);
-void reset_multis(filestruct *fileptr, bool force);
 void alloc_multidata_if_needed(filestruct *fileptr);
 #endif
 void parse_rcfile(FILE *rcstream
@@ -576,6 +645,13 @@ bool findnextstr(
 	bool no_sameline, const filestruct *begin, size_t begin_x, const
 	char *needle, size_t *needle_len);
 void findnextstr_wrap_reset(void);
+#ifndef NANO_TINY
+long matches_flags_now(void);
+bool matches_are_for(const char *needle);
+void start_matches(const char *needle);
+void idle_find_matches(WINDOW *win);
+bool findnextmatch(const char *needle);
+#endif
 void do_search(void);
 #ifndef NANO_TINY
 void do_research(void);
@@ -634,6 +710,12 @@ void do_enter(bool undoing);
 #ifndef NANO_TINY
 RETSIGTYPE cancel_command(int signal);
 bool execute_command(const char *command);
+void write_undo_history(FILE *f);
+bool check_undo_history(void);
+void load_undo_history(void);
+void forget_undo_history(openfilestruct *fs);
+void begin_undo_group(bool pasting);
+void end_undo_group(void);
 #endif
 #ifndef DISABLE_WRAPPING
 void wrap_reset(void);
@@ -704,6 +786,10 @@ const char *strstrwrapper(const char *haystack, const char *needle,
 void nperror(const char *s);
 void *nmalloc(size_t howmuch);
 void *nrealloc(void *ptr, size_t howmuch);
+void nfree(void *ptr);
+lineblock *lineblock_of(const void *ptr);
+void *lineblock_alloc(lineblock **blockptr, size_t howmuch);
+void lineblock_release(lineblock *block);
 char *mallocstrncpy(char *dest, const char *src, size_t n);
 char *mallocstrcpy(char *dest, const char *src);
 char *mallocstrassn(char *dest, char *src);
@@ -712,15 +798,25 @@ size_t xplustabs(void);
 size_t actual_x(const char *s, size_t column);
 size_t strnlenpt(const char *s, size_t maxlen);
 size_t strlenpt(const char *s);
+unsigned int line_hash(const char *text);
 void new_magicline(void);
 #ifndef NANO_TINY
 void remove_magicline(void);
 void mark_order(const filestruct **top, size_t *top_x, const filestruct
 	**bot, size_t *bot_x, bool *right_side_up);
+void put_packed_number(FILE *f, size_t n);
+void put_packed_string(FILE *f, const char *s);
+bool get_packed_number(const char **p, const char *end, size_t *n);
+bool get_packed_string(const char **p, const char *end, char **s);
 void add_undo(undo_type current_action);
 void update_undo(undo_type action);
 #endif
 size_t get_totsize(const filestruct *begin, const filestruct *end);
+#ifndef NANO_TINY
+void reset_line_index_after(ssize_t lineno);
+void unindex_line(const filestruct *fileptr);
+void index_line(filestruct *fileptr);
+#endif
 filestruct *fsfromline(ssize_t lineno);
 #ifdef DEBUG
 void dump_filestruct(const filestruct *inptr);
@@ -728,6 +824,9 @@ void dump_filestruct_reverse(void);
 #endif
 
 /* All functions in winio.c. */
+#if !defined(NANO_TINY) || defined(ENABLE_COLOR)
+bool idle_interrupted(WINDOW *win);
+#endif
 void get_key_buffer(WINDOW *win);
 size_t get_key_buffer_len(void);
 void unget_input(int *input, size_t input_len);
@@ -757,6 +856,9 @@ void blank_line(WINDOW *win, int y, int x, int n);
 void blank_titlebar(void);
 void blank_topbar(void);
 void blank_edit(void);
+void forget_rows(void);
+void forget_row(int y);
+bool row_unchanged(filestruct *fileptr, int y, size_t page_start);
 void blank_statusbar(void);
 void blank_bottombars(void);
 void check_statusblank(void);
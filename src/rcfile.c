@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
 
 #ifdef ENABLE_NANORC
 
@@ -76,6 +77,7 @@ static const rcoption rcopts[] = {
     {"view", VIEW_MODE},
 #ifndef NANO_TINY
     {"autoindent", AUTOINDENT},
+    {"atomicsave", ATOMIC_SAVE},
     {"backup", BACKUP_FILE},
     {"allow_insecure_backup", INSECURE_BACKUP},
     {"backupdir", 0},
@@ -91,9 +93,18 @@ static const rcoption rcopts[] = {
     {"smooth", SMOOTH_SCROLL},
     {"tabstospaces", TABS_TO_SPACES},
     {"undo", UNDOABLE},
+    {"undomemory", 0},
+    {"autosave", 0},
+    {"unload", 0},
     {"whitespace", 0},
     {"wordbounds", WORD_BOUNDS},
     {"softwrap", SOFTWRAP},
+#endif
+#ifdef ENABLE_COLOR
+    {"idlehighlight", IDLE_HIGHLIGHT},
+#ifndef NANO_TINY
+    {"rcsnapshot", RC_SNAPSHOT},
+#endif
 #endif
     {NULL, 0}
 };
@@ -111,9 +122,497 @@ static exttype *endheader = NULL;
 	/* End of header list */
 static colortype *endcolor = NULL;
 	/* The end of the color list for the current syntax. */
+#ifndef NANO_TINY
+static rcfiletype *rcfiles = NULL, *endrcfile = NULL;
+	/* The rcfiles that were read or looked for, in order. */
+static rcfiletype *toplevel_rcfile = NULL;
+	/* The nanorc we're parsing, as opposed to an included file. */
+static rclinetype *rclines = NULL, *endrcline = NULL;
+	/* The commands from them that aren't about syntaxes. */
+static const rclinetype *replay_line = NULL, *replay_stop = NULL;
+	/* The next command to take from the snapshot, and the one to
+	 * stop at. */
+#endif
+
+#endif
+
+#if defined(ENABLE_COLOR) && !defined(NANO_TINY)
+/* A snapshot of the rcfiles starts with snapshot_magic, followed by
+ * SNAPSHOT_VERSION, the rcfiles with their size, modification time and
+ * inode, the commands from them that don't define syntaxes, and last
+ * the syntaxes, all written with put_packed_number() and
+ * put_packed_string().  The commands are parsed again, but the syntaxes are taken as they are,
+ * without their regexes being checked. */
+static const char snapshot_magic[] = "GNU nano rcfile snapshot\n";
+#define SNAPSHOT_VERSION 1
+
+/* Return $HOME/.nano_rcsnapshot, or NULL if we can't find the home
+ * directory.  The returned string is dynamically allocated, and should
+ * be freed. */
+static char *snapshot_name(void)
+{
+    char *name;
+
+    if (homedir == NULL)
+	return NULL;
+
+    name = charalloc(strlen(homedir) + 18);
+    sprintf(name, "%s/.nano_rcsnapshot", homedir);
+
+    return name;
+}
+
+/* Add the rcfile name to the list of rcfiles that were read or looked
+ * for, and return its entry. */
+static rcfiletype *remember_rcfile(const char *name)
+{
+    rcfiletype *rcfile = (rcfiletype *)nmalloc(sizeof(rcfiletype));
+
+    rcfile->name = mallocstrcpy(NULL, name);
+    rcfile->exists = (stat(name, &rcfile->st) != -1);
+    rcfile->next = NULL;
+
+    if (rcfiles == NULL)
+	rcfiles = rcfile;
+    else
+	endrcfile->next = rcfile;
+    endrcfile = rcfile;
+
+    return rcfile;
+}
+
+/* Add the command text, from line lineno of the rcfile from, to the
+ * list of commands to be replayed from a snapshot. */
+static void remember_rcline(char *text, const rcfiletype *from, size_t
+	lineno)
+{
+    rclinetype *rcline = (rclinetype *)nmalloc(sizeof(rclinetype));
+
+    rcline->text = text;
+    rcline->from = from;
+    rcline->lineno = lineno;
+    rcline->next = NULL;
+
+    if (rclines == NULL)
+	rclines = rcline;
+    else
+	endrcline->next = rcline;
+    endrcline = rcline;
+}
+
+/* Free the lists of rcfiles and commands. */
+static void forget_rcfiles(void)
+{
+    while (rclines != NULL) {
+	rclinetype *rcline = rclines;
+
+	rclines = rcline->next;
+	free(rcline->text);
+	free(rcline);
+    }
+
+    while (rcfiles != NULL) {
+	rcfiletype *rcfile = rcfiles;
+
+	rcfiles = rcfile->next;
+	free(rcfile->name);
+	free(rcfile);
+    }
+
+    endrcline = NULL;
+    endrcfile = NULL;
+    toplevel_rcfile = NULL;
+}
+
+/* Write a snapshot of all that was read from the rcfiles, if that's
+ * wanted and they had no errors, or else get rid of any old one. */
+static void write_snapshot(void)
+{
+    char *name = snapshot_name(), *tempname;
+    const rcfiletype *rcfile;
+    const rclinetype *rcline;
+    const syntaxtype *tmpsyntax;
+    size_t count;
+    FILE *f;
+    int fd;
+
+    if (name == NULL)
+	return;
+
+    if (!ISSET(RC_SNAPSHOT) || errors) {
+	unlink(name);
+	free(name);
+	return;
+    }
+
+    /* Write it under a temporary name first, so that a nano starting up
+     * meanwhile never sees half of it. */
+    tempname = charalloc(strlen(name) + 8);
+    sprintf(tempname, "%s.XXXXXX", name);
+
+    fd = mkstemp(tempname);
+
+    if (fd == -1 || (f = fdopen(fd, "wb")) == NULL) {
+	if (fd != -1) {
+	    close(fd);
+	    unlink(tempname);
+	}
+	free(tempname);
+	free(name);
+	return;
+    }
+
+    fputs(snapshot_magic, f);
+    put_packed_number(f, SNAPSHOT_VERSION);
+
+    for (count = 0, rcfile = rcfiles; rcfile != NULL; rcfile =
+	rcfile->next)
+	count++;
+    put_packed_number(f, count);
+
+    for (rcfile = rcfiles; rcfile != NULL; rcfile = rcfile->next) {
+	put_packed_string(f, rcfile->name);
+	put_packed_number(f, rcfile->exists ? 1 : 0);
+	put_packed_number(f, rcfile->exists ? (size_t)rcfile->st.st_size :
+		0);
+	put_packed_number(f, rcfile->exists ? (size_t)rcfile->st.st_mtime :
+		0);
+	put_packed_number(f, rcfile->exists ? (size_t)rcfile->st.st_ino :
+		0);
+    }
+
+    for (count = 0, rcline = rclines; rcline != NULL; rcline =
+	rcline->next)
+	count++;
+    put_packed_number(f, count);
+
+    for (rcline = rclines; rcline != NULL; rcline = rcline->next) {
+	for (count = 0, rcfile = rcfiles; rcfile != rcline->from; rcfile =
+		rcfile->next)
+	    count++;
+	put_packed_number(f, count);
+	put_packed_number(f, rcline->lineno);
+	put_packed_string(f, rcline->text);
+    }
+
+    for (count = 0, tmpsyntax = syntaxes; tmpsyntax != NULL; tmpsyntax =
+	tmpsyntax->next)
+	count++;
+    put_packed_number(f, count);
+
+    for (tmpsyntax = syntaxes; tmpsyntax != NULL; tmpsyntax =
+	tmpsyntax->next) {
+	const exttype *e;
+	const colortype *tmpcolor;
+
+	put_packed_string(f, tmpsyntax->desc);
+
+	for (count = 0, e = tmpsyntax->extensions; e != NULL; e = e->next)
+	    count++;
+	put_packed_number(f, count);
+	for (e = tmpsyntax->extensions; e != NULL; e = e->next)
+	    put_packed_string(f, e->ext_regex);
+
+	for (count = 0, e = tmpsyntax->headers; e != NULL; e = e->next)
+	    count++;
+	put_packed_number(f, count);
+	for (e = tmpsyntax->headers; e != NULL; e = e->next)
+	    put_packed_string(f, e->ext_regex);
+
+	for (count = 0, tmpcolor = tmpsyntax->color; tmpcolor != NULL;
+		tmpcolor = tmpcolor->next)
+	    count++;
+	put_packed_number(f, count);
+
+	for (tmpcolor = tmpsyntax->color; tmpcolor != NULL; tmpcolor =
+		tmpcolor->next) {
+	    put_packed_number(f, (size_t)(tmpcolor->fg + 1));
+	    put_packed_number(f, (size_t)(tmpcolor->bg + 1));
+	    put_packed_number(f, tmpcolor->bright ? 1 : 0);
+	    put_packed_number(f, tmpcolor->icase ? 1 : 0);
+	    put_packed_string(f, tmpcolor->start_regex);
+	    put_packed_string(f, tmpcolor->end_regex);
+	}
+    }
+
+    if (fclose(f) == EOF || rename(tempname, name) == -1)
+	unlink(tempname);
+
+    free(tempname);
+    free(name);
+}
+
+/* Go through the snapshot from p to end, and return TRUE if it's whole
+ * and the rcfiles it was made from haven't changed since.  If build is
+ * TRUE, also add its syntaxes to the list of syntaxes, and its rcfiles
+ * and commands to the lists to be replayed. */
+static bool parse_snapshot(const char *p, const char *end, bool build)
+{
+    size_t count, nfiles, i, exists, size, mtime, ino, index, line;
+    size_t fg, bg, bright, icase;
+    syntaxtype *endsyn = syntaxes;
+    char *str;
+
+    if ((size_t)(end - p) < sizeof(snapshot_magic) - 1 || memcmp(p,
+	snapshot_magic, sizeof(snapshot_magic) - 1) != 0)
+	return FALSE;
+    p += sizeof(snapshot_magic) - 1;
+
+    if (!get_packed_number(&p, end, &count) || count != SNAPSHOT_VERSION)
+	return FALSE;
+
+    /* Each rcfile has to be just as it was when the snapshot was made,
+     * or still not be there if it wasn't. */
+    if (!get_packed_number(&p, end, &nfiles))
+	return FALSE;
+
+    for (i = 0; i < nfiles; i++) {
+	struct stat st;
+
+	if (!get_packed_string(&p, end, &str) || str == NULL ||
+		!get_packed_number(&p, end, &exists) ||
+		!get_packed_number(&p, end, &size) ||
+		!get_packed_number(&p, end, &mtime) ||
+		!get_packed_number(&p, end, &ino)) {
+	    free(str);
+	    return FALSE;
+	}
+
+	if (build)
+	    remember_rcfile(str);
+	else if (stat(str, &st) == -1 ? exists != 0 : (exists == 0 ||
+		size != (size_t)st.st_size || mtime !=
+		(size_t)st.st_mtime || ino != (size_t)st.st_ino)) {
+	    free(str);
+	    return FALSE;
+	}
+
+	free(str);
+    }
+
+    if (!get_packed_number(&p, end, &count))
+	return FALSE;
+
+    for (; count > 0; count--) {
+	if (!get_packed_number(&p, end, &index) || index >= nfiles ||
+		!get_packed_number(&p, end, &line) || line == 0 ||
+		!get_packed_string(&p, end, &str) || str == NULL ||
+		*str == '\0') {
+	    free(str);
+	    return FALSE;
+	}
+
+	if (build) {
+	    const rcfiletype *from = rcfiles;
+
+	    for (; index > 0; index--)
+		from = from->next;
+	    remember_rcline(str, from, line);
+	} else
+	    free(str);
+    }
+
+    if (build && endsyn != NULL) {
+	while (endsyn->next != NULL)
+	    endsyn = endsyn->next;
+    }
+
+    if (!get_packed_number(&p, end, &count))
+	return FALSE;
+
+    for (; count > 0; count--) {
+	syntaxtype *newsyntax = NULL;
+	exttype **endext = NULL;
+	colortype *endcol = NULL;
+	size_t n, kind;
+
+	if (!get_packed_string(&p, end, &str) || str == NULL)
+	    return FALSE;
+
+	if (build) {
+	    newsyntax = (syntaxtype *)nmalloc(sizeof(syntaxtype));
+	    newsyntax->desc = str;
+	    newsyntax->extensions = NULL;
+	    newsyntax->headers = NULL;
+	    newsyntax->color = NULL;
+	    newsyntax->nmultis = 0;
+	    newsyntax->keywords = NULL;
+	    newsyntax->icase_keywords = FALSE;
+	    newsyntax->next = NULL;
+
+	    if (endsyn == NULL)
+		syntaxes = newsyntax;
+	    else
+		endsyn->next = newsyntax;
+	    endsyn = newsyntax;
+	} else
+	    free(str);
+
+	/* First the extensions, then the headers. */
+	for (kind = 0; kind < 2; kind++) {
+	    if (!get_packed_number(&p, end, &n))
+		return FALSE;
+
+	    if (build)
+		endext = (kind == 0) ? &newsyntax->extensions :
+			&newsyntax->headers;
+
+	    for (; n > 0; n--) {
+		if (!get_packed_string(&p, end, &str) || str == NULL)
+		    return FALSE;
+
+		if (build) {
+		    exttype *newext = (exttype *)nmalloc(sizeof(exttype));
+
+		    newext->ext_regex = str;
+		    newext->ext = NULL;
+		    newext->next = NULL;
+		    *endext = newext;
+		    endext = &newext->next;
+		} else
+		    free(str);
+	    }
+	}
+
+	if (!get_packed_number(&p, end, &n))
+	    return FALSE;
+
+	for (; n > 0; n--) {
+	    char *endstr;
+
+	    if (!get_packed_number(&p, end, &fg) ||
+		!get_packed_number(&p, end, &bg) ||
+		!get_packed_number(&p, end, &bright) ||
+		!get_packed_number(&p, end, &icase) ||
+		!get_packed_string(&p, end, &str))
+		return FALSE;
+	    if (str == NULL || !get_packed_string(&p, end, &endstr)) {
+		free(str);
+		return FALSE;
+	    }
+
+	    if (build) {
+		colortype *newcolor = (colortype *)nmalloc(sizeof(colortype));
+
+		newcolor->fg = (short)fg - 1;
+		newcolor->bg = (short)bg - 1;
+		newcolor->bright = (bright != 0);
+		newcolor->icase = (icase != 0);
+		newcolor->start_regex = str;
+		newcolor->start = NULL;
+		newcolor->firstbytes = NULL;
+		newcolor->keywords = FALSE;
+		newcolor->end_regex = endstr;
+		newcolor->end = NULL;
+		newcolor->next = NULL;
+		newcolor->id = 0;
+
+		if (endstr != NULL)
+		    newcolor->id = newsyntax->nmultis++;
+
+		if (endcol == NULL)
+		    newsyntax->color = newcolor;
+		else
+		    endcol->next = newcolor;
+		endcol = newcolor;
+	    } else {
+		free(str);
+		free(endstr);
+	    }
+	}
+    }
+
+    return (p == end);
+}
 
+/* Read the snapshot of the rcfiles, if it's there and still good, and
+ * get their syntaxes and commands from it.  Return TRUE if we did. */
+static bool read_snapshot(void)
+{
+    char *name = snapshot_name(), *data;
+    struct stat st;
+    bool good = FALSE;
+    int fd;
+
+    if (name == NULL)
+	return FALSE;
+
+    fd = open(name, O_RDONLY);
+    free(name);
+
+    if (fd == -1)
+	return FALSE;
+
+    if (fstat(fd, &st) != -1 && S_ISREG(st.st_mode)) {
+	size_t size = st.st_size, got = 0;
+	ssize_t n = 1;
+
+	data = charalloc(size + 1);
+
+	while (got < size && (n = read(fd, data + got, size - got)) > 0)
+	    got += n;
+
+	/* Check all of it before using any of it. */
+	good = (got == size && parse_snapshot(data, data + size, FALSE));
+	if (good)
+	    parse_snapshot(data, data + size, TRUE);
+
+	free(data);
+    }
+
+    close(fd);
+
+    return good;
+}
+
+/* Replay the commands from the snapshot: first those of the system-wide
+ * nanorc, then those of the current user's. */
+static void replay_snapshot(void)
+{
+    replay_line = rclines;
+    for (replay_stop = rclines; replay_stop != NULL &&
+	replay_stop->from == rcfiles; replay_stop = replay_stop->next)
+	;
+
+    parse_rcfile(NULL, FALSE);
+
+#ifdef DISABLE_ROOTWRAPPING
+    /* As when reading the nanorcs themselves, turn wrapping off in
+     * between if we're root and --disable-wrapping-as-root is used. */
+    if (geteuid() == NANO_ROOT_UID)
+	SET(NO_WRAP);
 #endif
 
+    replay_stop = NULL;
+    parse_rcfile(NULL, FALSE);
+}
+#endif /* ENABLE_COLOR && !NANO_TINY */
+
+/* Read the next line of the rcfile at rcstream into *buf, whose size is
+ * *n, or, if rcstream is NULL, the next command to be replayed from the
+ * snapshot.  Return its length, or -1 if there are no more lines. */
+static ssize_t get_rcline(char **buf, size_t *n, FILE *rcstream)
+{
+#if defined(ENABLE_COLOR) && !defined(NANO_TINY)
+    if (rcstream == NULL) {
+	if (replay_line == replay_stop)
+	    return -1;
+
+	/* Say where the command came from, if it has errors. */
+	nanorc = mallocstrcpy(nanorc, replay_line->from->name);
+	lineno = replay_line->lineno - 1;
+
+	*buf = mallocstrcpy(*buf, replay_line->text);
+	*n = strlen(*buf) + 1;
+	replay_line = replay_line->next;
+
+	return *n - 1;
+    }
+#endif
+
+    return getline(buf, n, rcstream);
+}
+
 /* We have an error in some part of the rcfile.  Print the error message
  * on stderr, and then make the user hit Enter to continue starting
  * nano. */
@@ -223,24 +722,37 @@ char *parse_next_regex(char *ptr)
 }
 
 /* Compile the regular expression regex to see if it's valid.  Return
- * TRUE if it is, or FALSE otherwise. */
-bool nregcomp(const char *regex, int eflags)
+ * TRUE if it is, or FALSE otherwise.  If keep is TRUE, a valid regex
+ * stays compiled, for when a buffer comes to use it. */
+bool nregcomp(const char *regex, int eflags, bool keep)
 {
-    regex_t preg;
     const char *r = fixbounds(regex);
-    int rc = regcomp(&preg, r, REG_EXTENDED | eflags);
+    char *str = NULL;
 
-    if (rc != 0) {
-	size_t len = regerror(rc, &preg, NULL, 0);
-	char *str = charalloc(len);
+    if (keep) {
+	if (get_regex(regex, eflags, &str) != NULL)
+	    return TRUE;
+    } else {
+	regex_t preg;
+	int rc = regcomp(&preg, r, REG_EXTENDED | eflags);
 
-	regerror(rc, &preg, str, len);
-	rcfile_error(N_("Bad regex \"%s\": %s"), r, str);
-	free(str);
+	if (rc != 0) {
+	    size_t len = regerror(rc, &preg, NULL, 0);
+
+	    str = charalloc(len);
+	    regerror(rc, &preg, str, len);
+	}
+
+	regfree(&preg);
+
+	if (rc == 0)
+	    return TRUE;
     }
 
-    regfree(&preg);
-    return (rc == 0);
+    rcfile_error(N_("Bad regex \"%s\": %s"), r, str);
+    free(str);
+
+    return FALSE;
 }
 
 /* Parse the next syntax string from the line at ptr, and add it to the
@@ -305,6 +817,8 @@ void parse_syntax(char *ptr)
     endsyntax->headers = NULL;
     endsyntax->next = NULL;
     endsyntax->nmultis = 0;
+    endsyntax->keywords = NULL;
+    endsyntax->icase_keywords = FALSE;
 
 #ifdef DEBUG
     fprintf(stderr, "Starting a new syntax type: \"%s\"\n", nameptr);
@@ -345,7 +859,7 @@ void parse_syntax(char *ptr)
 	newext = (exttype *)nmalloc(sizeof(exttype));
 
 	/* Save the extension regex if it's valid. */
-	if (nregcomp(fileregptr, REG_NOSUB)) {
+	if (nregcomp(fileregptr, REG_NOSUB, TRUE)) {
 	    newext->ext_regex = mallocstrcpy(NULL, fileregptr);
 	    newext->ext = NULL;
 
@@ -570,6 +1084,10 @@ void parse_include(char *ptr)
 	return;
     }
 
+#ifndef NANO_TINY
+    remember_rcfile(expanded);
+#endif
+
     /* Use the name and line number position of the new syntax file
      * while parsing it, so we can know where any errors in it are. */
     nanorc = expanded;
@@ -724,7 +1242,7 @@ void parse_colors(char *ptr, bool icase)
 
 	/* Save the starting regex string if it's valid, and set up the
 	 * color information. */
-	if (nregcomp(fgstr, icase ? REG_ICASE : 0)) {
+	if (nregcomp(fgstr, icase ? REG_ICASE : 0, FALSE)) {
 	    newcolor->fg = fg;
 	    newcolor->bg = bg;
 	    newcolor->bright = bright;
@@ -732,6 +1250,8 @@ void parse_colors(char *ptr, bool icase)
 
 	    newcolor->start_regex = mallocstrcpy(NULL, fgstr);
 	    newcolor->start = NULL;
+	    newcolor->firstbytes = NULL;
+	    newcolor->keywords = FALSE;
 
 	    newcolor->end_regex = NULL;
 	    newcolor->end = NULL;
@@ -783,7 +1303,7 @@ void parse_colors(char *ptr, bool icase)
 
 	    /* Save the ending regex string if it's valid. */
 	    newcolor->end_regex = (nregcomp(fgstr, icase ? REG_ICASE :
-		0)) ? mallocstrcpy(NULL, fgstr) : NULL;
+		0, FALSE)) ? mallocstrcpy(NULL, fgstr) : NULL;
 
 	    /* Lame way to skip another static counter */
             newcolor->id = endsyntax->nmultis;
@@ -833,7 +1353,7 @@ void parse_headers(char *ptr)
 	newheader = (exttype *)nmalloc(sizeof(exttype));
 
 	/* Save the regex string if it's valid */
-	if (nregcomp(regstr, 0)) {
+	if (nregcomp(regstr, 0, TRUE)) {
 	    newheader->ext_regex = mallocstrcpy(NULL, regstr);
 	    newheader->ext = NULL;
 	    newheader->next = NULL;
@@ -895,7 +1415,7 @@ void parse_rcfile(FILE *rcstream
     ssize_t len;
     size_t n = 0;
 
-    while ((len = getline(&buf, &n, rcstream)) > 0) {
+    while ((len = get_rcline(&buf, &n, rcstream)) > 0) {
 	char *ptr, *keyword, *option;
 	int set = 0;
 	size_t i;
@@ -918,6 +1438,20 @@ void parse_rcfile(FILE *rcstream
 	keyword = ptr;
 	ptr = parse_next_word(ptr);
 
+#if defined(ENABLE_COLOR) && !defined(NANO_TINY)
+	/* Remember the commands that a snapshot would have to parse
+	 * again. */
+	if (rcstream != NULL && !syntax_only && (strcasecmp(keyword,
+		"set") == 0 || strcasecmp(keyword, "unset") == 0 ||
+		strcasecmp(keyword, "bind") == 0 || strcasecmp(keyword,
+		"unbind") == 0)) {
+	    char *text = charalloc(strlen(keyword) + strlen(ptr) + 2);
+
+	    sprintf(text, "%s %s", keyword, ptr);
+	    remember_rcline(text, toplevel_rcfile, lineno);
+	}
+#endif
+
 	/* Try to parse the keyword. */
 	if (strcasecmp(keyword, "set") == 0) {
 #ifdef ENABLE_COLOR
@@ -1039,6 +1573,36 @@ void parse_rcfile(FILE *rcstream
 				free(matchbrackets);
 				matchbrackets = NULL;
 			    }
+			} else if (strcasecmp(rcopts[i].name,
+				"undomemory") == 0) {
+			    if (!parse_num(option, &undomemory) ||
+				undomemory < 0) {
+				rcfile_error(
+					N_("Requested undo memory size \"%s\" is invalid"),
+					option);
+				undomemory = 0;
+			    } else
+				free(option);
+			} else if (strcasecmp(rcopts[i].name,
+				"autosave") == 0) {
+			    if (!parse_num(option, &autosave) ||
+				autosave < 0) {
+				rcfile_error(
+					N_("Requested autosave interval \"%s\" is invalid"),
+					option);
+				autosave = 0;
+			    } else
+				free(option);
+			} else if (strcasecmp(rcopts[i].name,
+				"unload") == 0) {
+			    if (!parse_num(option, &unload_after) ||
+				unload_after < 0) {
+				rcfile_error(
+					N_("Requested unload time \"%s\" is invalid"),
+					option);
+				unload_after = 0;
+			    } else
+				free(option);
 			} else if (strcasecmp(rcopts[i].name,
 				"whitespace") == 0) {
 			    whitespace = option;
@@ -1130,7 +1694,8 @@ void parse_rcfile(FILE *rcstream
 #endif
 
     free(buf);
-    fclose(rcstream);
+    if (rcstream != NULL)
+	fclose(rcstream);
     lineno = 0;
 
     check_vitals_mapped();
@@ -1144,7 +1709,21 @@ void do_rcfile(void)
     struct stat rcinfo;
     FILE *rcstream;
 
+#if defined(ENABLE_COLOR) && !defined(NANO_TINY)
+    /* If the nanorcs haven't changed since the snapshot of them was
+     * made, take everything from there instead. */
+    get_homedir();
+
+    if (read_snapshot()) {
+	replay_snapshot();
+	goto done;
+    }
+#endif
+
     nanorc = mallocstrcpy(nanorc, SYSCONFDIR "/nanorc");
+#if defined(ENABLE_COLOR) && !defined(NANO_TINY)
+    toplevel_rcfile = remember_rcfile(nanorc);
+#endif
 
     /* Don't open directories, character files, or block files. */
     if (stat(nanorc, &rcinfo) != -1) {
@@ -1186,6 +1765,9 @@ void do_rcfile(void)
 #endif
 	nanorc = charealloc(nanorc, strlen(homedir) + strlen(RCFILE_NAME) + 2);
 	sprintf(nanorc, "%s/%s", homedir, RCFILE_NAME);
+#if defined(ENABLE_COLOR) && !defined(NANO_TINY)
+	toplevel_rcfile = remember_rcfile(nanorc);
+#endif
 
 	/* Don't open directories, character files, or block files. */
 	if (stat(nanorc, &rcinfo) != -1) {
@@ -1211,6 +1793,13 @@ void do_rcfile(void)
 		);
     }
 
+#if defined(ENABLE_COLOR) && !defined(NANO_TINY)
+    write_snapshot();
+
+  done:
+    forget_rcfiles();
+#endif
+
     free(nanorc);
     nanorc = NULL;
 
@@ -32,6 +32,27 @@
 
 static bool search_last_line = FALSE;
 	/* Have we gone past the last line while searching? */
+#ifndef NANO_TINY
+static matchtype *matches = NULL;
+	/* All matches of the last search in the buffer, in order. */
+static size_t matches_len = 0;
+	/* The number of matches in matches. */
+static size_t matches_size = 0;
+	/* The number of matches there's room for in matches. */
+static const openfilestruct *matches_file = NULL;
+	/* The buffer matches were found in. */
+static unsigned long matches_edit = 0;
+	/* The value of edit_count when they were found. */
+static char *matches_needle = NULL;
+	/* What was searched for. */
+static long matches_flags = 0;
+	/* The flags that it was searched for with. */
+static filestruct *matches_next = NULL;
+	/* The line to go on finding them from, or NULL if they've all
+	 * been found. */
+static bool matches_toomany = FALSE;
+	/* Were there too many of them to keep? */
+#endif
 #if !defined(NANO_TINY) && defined(ENABLE_NANORC)
 static bool history_changed = FALSE;
 	/* Have any of the history lists changed? */
@@ -39,20 +60,31 @@ static bool history_changed = FALSE;
 #ifdef HAVE_REGEX_H
 static bool regexp_compiled = FALSE;
 	/* Have we compiled any regular expressions? */
+static char *regexp_compiled_str = NULL;
+	/* The regular expression that's compiled in search_regexp. */
+static int regexp_compiled_cflags = 0;
+	/* The flags it was compiled with. */
 
 /* Compile the regular expression regexp to see if it's valid.  Return
- * TRUE if it is, or FALSE otherwise. */
+ * TRUE if it is, or FALSE otherwise.  If it's the same as the last one
+ * compiled, with the same flags, the compiled one is used again. */
 bool regexp_init(const char *regexp)
 {
-    int rc;
-
-    assert(!regexp_compiled);
-
-    rc = regcomp(&search_regexp, regexp, REG_EXTENDED
+    int rc, cflags = REG_EXTENDED
 #ifndef NANO_TINY
 	| (ISSET(CASE_SENSITIVE) ? 0 : REG_ICASE)
 #endif
-	);
+	;
+
+    if (regexp_compiled) {
+	if (cflags == regexp_compiled_cflags &&
+		strcmp(regexp, regexp_compiled_str) == 0)
+	    return TRUE;
+
+	regexp_cleanup();
+    }
+
+    rc = regcomp(&search_regexp, regexp, cflags);
 
     if (rc != 0) {
 	size_t len = regerror(rc, &search_regexp, NULL, 0);
@@ -66,6 +98,14 @@ bool regexp_init(const char *regexp)
     }
 
     regexp_compiled = TRUE;
+    regexp_compiled_str = mallocstrcpy(regexp_compiled_str, regexp);
+    regexp_compiled_cflags = cflags;
+
+    /* If the regular expression matches only itself, searches can skip
+     * regexec() and look for it as plain text. */
+    if (!(cflags & REG_ICASE) && *regexp != '\0' &&
+	strpbrk(regexp, ".[]()*+?{}|^$\\") == NULL)
+	search_literal = mallocstrcpy(search_literal, regexp);
 
     return TRUE;
 }
@@ -77,6 +117,10 @@ void regexp_cleanup(void)
     if (regexp_compiled) {
 	regexp_compiled = FALSE;
 	regfree(&search_regexp);
+	free(regexp_compiled_str);
+	regexp_compiled_str = NULL;
+	free(search_literal);
+	search_literal = NULL;
     }
 }
 #endif
@@ -100,9 +144,9 @@ void not_found_msg(const char *str)
 }
 
 /* Abort the current search or replace.  Clean up by displaying the main
- * shortcut list, updating the screen if the mark was on before, and
- * decompiling the compiled regular expression we used in the last
- * search, if any. */
+ * shortcut list, and updating the screen if the mark was on before.
+ * The compiled regular expression we used in the last search, if any,
+ * is kept for the next one. */
 void search_replace_abort(void)
 {
     display_main_list();
@@ -110,9 +154,6 @@ void search_replace_abort(void)
     if (openfile->mark_set)
 	edit_refresh();
 #endif
-#ifdef HAVE_REGEX_H
-    regexp_cleanup();
-#endif
 }
 
 /* Initialize the global search and replace strings. */
@@ -270,6 +311,143 @@ int search_init(bool replacing, bool use_answer)
     return 0;
 }
 
+#ifndef NANO_TINY
+/* Look for needle the way findnextstr() does, but in the paged file of
+ * the current buffer, going through its lines in the mapping rather
+ * than the ones in memory, so that all of the file is searched.  If
+ * needle is found, get the lines around it into memory. */
+static bool paged_findnextstr(bool no_sameline, ssize_t begin_lineno,
+	size_t begin_x, const char *needle, size_t *needle_len)
+{
+    ssize_t lineno;
+    size_t offset, next;
+    size_t found_len, buf_size = 0;
+    char *buf = NULL;
+    const char *rev_start, *found;
+    const subnfunc *f;
+    time_t lastkbcheck = time(NULL);
+    unsigned int lines_searched = 0;
+
+    /* If the file has been truncated, the line we started on may be
+     * gone, so start from wherever the cursor is now. */
+    if (paged_truncated()) {
+	begin_lineno = openfile->current->lineno;
+	begin_x = openfile->current_x;
+    }
+
+    lineno = openfile->current->lineno;
+    offset = paged_line_start(lineno);
+    next = paged_copy_line(offset, &buf, &buf_size);
+
+    rev_start = buf + (ISSET(BACKWARDS_SEARCH) ?
+	openfile->current_x - 1 : openfile->current_x + 1);
+
+    enable_nodelay();
+    while (TRUE) {
+	if (++lines_searched % 256 == 0) {
+	    /* Where we are may be past the end of the file if it has
+	     * been truncated meanwhile. */
+	    if (paged_truncated()) {
+		statusbar(_("File was truncated"));
+		disable_nodelay();
+		free(buf);
+		return FALSE;
+	    }
+
+	    if (time(NULL) - lastkbcheck > 1) {
+		lastkbcheck = time(NULL);
+		f = getfuncfromkey(edit);
+		if (f && f->scfunc == CANCEL_MSG) {
+		    statusbar(_("Cancelled"));
+		    disable_nodelay();
+		    free(buf);
+		    return FALSE;
+		}
+	    }
+	}
+
+	found = strstrwrapper(buf, needle, rev_start);
+
+	if (found != NULL && (!no_sameline || lineno !=
+		openfile->current->lineno))
+	    break;
+
+	if (search_last_line) {
+	    not_found_msg(needle);
+	    disable_nodelay();
+	    free(buf);
+	    return FALSE;
+	}
+
+	/* Move to the previous or next line in the file, wrapping
+	 * around at its start or end. */
+	if (ISSET(BACKWARDS_SEARCH)) {
+	    if (offset == 0) {
+		lineno = paged_lines();
+		offset = paged_line_start(lineno);
+		statusbar(_("Search Wrapped"));
+	    } else {
+		lineno--;
+		offset = paged_prev_line(offset);
+	    }
+	} else {
+	    if (next > openfile->paged->size) {
+		lineno = 1;
+		offset = 0;
+		statusbar(_("Search Wrapped"));
+	    } else {
+		lineno++;
+		offset = next;
+	    }
+	}
+
+	if (lineno == begin_lineno)
+	    search_last_line = TRUE;
+
+	next = paged_copy_line(offset, &buf, &buf_size);
+
+	rev_start = buf;
+	if (ISSET(BACKWARDS_SEARCH))
+	    rev_start += strlen(buf);
+    }
+
+    disable_nodelay();
+
+    found_len =
+#ifdef HAVE_REGEX_H
+	ISSET(USE_REGEXP) ? (size_t)(regmatches[0].rm_eo -
+	regmatches[0].rm_so) :
+#endif
+	strlen(needle);
+
+    /* Ensure we haven't wrapped around again! */
+    if (search_last_line && ((!ISSET(BACKWARDS_SEARCH) &&
+	(size_t)(found - buf) > begin_x) || (ISSET(BACKWARDS_SEARCH) &&
+	(size_t)(found - buf) < begin_x))) {
+	not_found_msg(needle);
+	free(buf);
+	return FALSE;
+    }
+
+    if (lineno < openfile->fileage->lineno || lineno >
+	openfile->filebot->lineno)
+	paged_window(lineno);
+
+    openfile->current = fsfromline(lineno);
+    openfile->current_x = found - buf;
+    openfile->placewewant = xplustabs();
+    openfile->current_y = openfile->current->lineno -
+	openfile->edittop->lineno;
+
+    free(buf);
+
+    if (needle_len != NULL)
+	*needle_len = found_len;
+
+    return TRUE;
+}
+#endif
+
 /* Look for needle, starting at (current, current_x).  If no_sameline is
  * TRUE, skip over begin when looking for needle.  begin is the line
  * where we first started searching, at column begin_x.  The return
@@ -291,6 +469,15 @@ bool findnextstr(
     const char *rev_start = fileptr->data, *found = NULL;
     const subnfunc *f;
     time_t lastkbcheck = time(NULL);
+    unsigned int lines_searched = 0;
+	/* How many lines we've looked at, so that we only ask for the
+	 * time every so many of them. */
+
+#ifndef NANO_TINY
+    if (openfile->paged != NULL)
+	return paged_findnextstr(no_sameline, begin->lineno, begin_x,
+		needle, needle_len);
+#endif
 
     /* rev_start might end up 1 character before the start or after the
      * end of the line.  This won't be a problem because strstrwrapper()
@@ -307,7 +494,8 @@ bool findnextstr(
     /* Look for needle in the current line we're searching. */
     enable_nodelay();
     while (TRUE) {
-        if (time(NULL) - lastkbcheck > 1) {
+        if (++lines_searched % 256 == 0 &&
+		time(NULL) - lastkbcheck > 1) {
             lastkbcheck = time(NULL);
 	    f = getfuncfromkey(edit);
             if (f && f->scfunc == CANCEL_MSG) {
@@ -329,7 +517,7 @@ bool findnextstr(
 	    found_len =
 #ifdef HAVE_REGEX_H
 		ISSET(USE_REGEXP) ?
-		regmatches[0].rm_eo - regmatches[0].rm_so :
+		(size_t)(regmatches[0].rm_eo - regmatches[0].rm_so) :
 #endif
 		strlen(needle);
 
@@ -444,12 +632,211 @@ void findnextstr_wrap_reset(void)
     search_last_line = FALSE;
 }
 
+#ifndef NANO_TINY
+/* Return the search flags that matter to which matches are found. */
+long matches_flags_now(void)
+{
+    return (ISSET(CASE_SENSITIVE) ? 1 : 0) | (ISSET(USE_REGEXP) ? 2 :
+	0);
+}
+
+/* Return TRUE if the matches we have, or are finding, are those of
+ * needle in the current buffer as it is now. */
+bool matches_are_for(const char *needle)
+{
+    return (matches_file == openfile && matches_edit == edit_count &&
+	matches_flags == matches_flags_now() &&
+	strcmp(matches_needle, needle) == 0);
+}
+
+/* Start finding the matches of needle in the current buffer, which is
+ * done while we're waiting for keys. */
+void start_matches(const char *needle)
+{
+    matches_file = openfile;
+    matches_edit = edit_count;
+    matches_flags = matches_flags_now();
+    matches_needle = mallocstrcpy(matches_needle, needle);
+    matches_len = 0;
+    matches_next = openfile->fileage;
+    matches_toomany = FALSE;
+}
+
+/* While we're waiting for a key on win, go on finding the matches of
+ * the last search in the current buffer, in order, the way
+ * findnextstr() would come across them going forward.  Stop as soon as
+ * a key comes in, leaving it to be read.  Give up if the buffer or the
+ * search has changed since, or if there are more matches than we keep;
+ * until we have them all, searching is done without them. */
+void idle_find_matches(WINDOW *win)
+{
+#ifdef HAVE_REGEX_H
+    regmatch_t regmatches_save[10];
+#endif
+    bool backwards = ISSET(BACKWARDS_SEARCH);
+    int count = 0;
+
+    if (matches_next == NULL)
+	return;
+
+    if (!matches_are_for(matches_needle)) {
+	matches_file = NULL;
+	matches_next = NULL;
+	return;
+    }
+
+#ifdef HAVE_REGEX_H
+    /* Another search, such as one for replacing, may have put its own
+     * regex in place of ours for now. */
+    if (ISSET(USE_REGEXP) && (!regexp_compiled ||
+	regexp_compiled_cflags != (REG_EXTENDED |
+	(ISSET(CASE_SENSITIVE) ? 0 : REG_ICASE)) ||
+	strcmp(regexp_compiled_str, matches_needle) != 0))
+	return;
+
+    /* Leave the subexpressions of the last match alone, since a
+     * replacement may still be made with them. */
+    memcpy(regmatches_save, regmatches, sizeof(regmatches));
+#endif
+
+    /* strstrwrapper() has to look forward. */
+    UNSET(BACKWARDS_SEARCH);
+
+    nodelay(win, TRUE);
+
+    for (; matches_next != NULL; matches_next = matches_next->next) {
+	const char *found = matches_next->data;
+
+	if (++count % 32 == 0 && idle_interrupted(win))
+	    break;
+
+	/* Each match after the first on a line is found by searching
+	 * from the character after the previous one, as findnextstr()
+	 * does. */
+	while ((found = strstrwrapper(matches_next->data, matches_needle,
+		found)) != NULL) {
+	    if (matches_len == MAX_SEARCH_MATCHES) {
+		matches_toomany = TRUE;
+		break;
+	    }
+
+	    if (matches_len == matches_size) {
+		matches_size = (matches_size == 0) ? 64 : matches_size * 2;
+		matches = (matchtype *)nrealloc(matches, matches_size *
+			sizeof(matchtype));
+	    }
+
+	    matches[matches_len].line = matches_next;
+	    matches[matches_len].x = found - matches_next->data;
+	    matches_len++;
+
+	    found++;
+	}
+
+	if (matches_toomany) {
+	    matches_len = 0;
+	    matches_next = NULL;
+	    break;
+	}
+    }
+
+    nodelay(win, FALSE);
+
+    if (backwards)
+	SET(BACKWARDS_SEARCH);
+
+#ifdef HAVE_REGEX_H
+    memcpy(regmatches, regmatches_save, sizeof(regmatches));
+#endif
+}
+
+/* Move to the match of needle after the cursor, or before it when
+ * searching backwards, wrapping around at the end of the buffer, as
+ * findnextstr() does.  If we have all the matches of needle already,
+ * step to it in the list of them and say which of them it is.
+ * Otherwise, look for it with findnextstr(), and start finding all the
+ * matches for the next time.  Return TRUE if there is one. */
+bool findnextmatch(const char *needle)
+{
+    const filestruct *begin = openfile->current;
+    ssize_t lineno = openfile->current->lineno;
+    size_t lo = 0, hi, i;
+    bool wrapped = FALSE;
+
+    if (openfile->paged != NULL || !matches_are_for(needle) ||
+	matches_next != NULL || matches_toomany) {
+	/* A paged file is too big to collect all of its matches. */
+	if (openfile->paged == NULL && !matches_are_for(needle))
+	    start_matches(needle);
+
+	findnextstr_wrap_reset();
+	return findnextstr(
+#ifndef DISABLE_SPELLER
+		FALSE,
+#endif
+		FALSE, openfile->current, openfile->current_x, needle,
+		NULL);
+    }
+
+    if (matches_len == 0) {
+	not_found_msg(needle);
+	return FALSE;
+    }
+
+    /* Find the first match after the cursor. */
+    hi = matches_len;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+
+	if (matches[mid].line->lineno < lineno ||
+		(matches[mid].line->lineno == lineno &&
+		matches[mid].x <= openfile->current_x))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    if (ISSET(BACKWARDS_SEARCH)) {
+	/* Find the last match before the cursor instead. */
+	while (lo > 0 && matches[lo - 1].line == openfile->current &&
+		matches[lo - 1].x == openfile->current_x)
+	    lo--;
+	wrapped = (lo == 0);
+	i = wrapped ? matches_len - 1 : lo - 1;
+    } else {
+	wrapped = (lo == matches_len);
+	i = wrapped ? 0 : lo;
+    }
+
+    /* If we've come around to the line we started on, a further
+     * findnextstr() shouldn't go around again. */
+    search_last_line = (wrapped && matches[i].line == begin);
+
+    openfile->current = matches[i].line;
+    openfile->current_x = matches[i].x;
+    openfile->placewewant = xplustabs();
+    openfile->current_y = openfile->current->lineno -
+	openfile->edittop->lineno;
+
+    if (wrapped)
+	statusbar(_("Search Wrapped"));
+    else
+	statusbar(_("Match %lu of %lu"), (unsigned long)i + 1,
+		(unsigned long)matches_len);
+
+    return TRUE;
+}
+#endif /* !NANO_TINY */
+
 /* Search for a string. */
 void do_search(void)
 {
     filestruct *fileptr = openfile->current;
     size_t fileptr_x = openfile->current_x;
     size_t pww_save = openfile->placewewant;
+#ifndef NANO_TINY
+    unsigned long edit_count_save = edit_count;
+#endif
     int i;
     bool didfind;
 
@@ -484,12 +871,23 @@ void do_search(void)
 	update_history(&search_history, answer);
 #endif
 
+#ifndef NANO_TINY
+    didfind = findnextmatch(answer);
+#else
     findnextstr_wrap_reset();
     didfind = findnextstr(
 #ifndef DISABLE_SPELLER
 	FALSE,
 #endif
 	FALSE, openfile->current, openfile->current_x, answer, NULL);
+#endif
+
+#ifndef NANO_TINY
+    /* If the match is in another part of a paged file, the line we
+     * started on isn't in memory anymore. */
+    if (edit_count != edit_count_save)
+	fileptr = NULL;
+#endif
 
     /* Check to see if there's only one occurrence of the string and
      * we're on it now. */
@@ -521,7 +919,13 @@ void do_search(void)
     }
 
     openfile->placewewant = xplustabs();
-    edit_redraw(fileptr, pww_save);
+#ifndef NANO_TINY
+    if (fileptr == NULL) {
+	edit_update(CENTER);
+	edit_refresh_needed = TRUE;
+    } else
+#endif
+	edit_redraw(fileptr, pww_save);
     search_replace_abort();
 }
 
@@ -532,6 +936,7 @@ void do_research(void)
     filestruct *fileptr = openfile->current;
     size_t fileptr_x = openfile->current_x;
     size_t pww_save = openfile->placewewant;
+    unsigned long edit_count_save = edit_count;
     bool didfind;
 
     search_init_globals();
@@ -543,13 +948,12 @@ void do_research(void)
 	    return;
 #endif
 
-	findnextstr_wrap_reset();
-	didfind = findnextstr(
-#ifndef DISABLE_SPELLER
-		FALSE,
-#endif
-		FALSE, openfile->current, openfile->current_x,
-		last_search, NULL);
+	didfind = findnextmatch(last_search);
+
+	/* If the match is in another part of a paged file, the line we
+	 * started on isn't in memory anymore. */
+	if (edit_count != edit_count_save)
+	    fileptr = NULL;
 
 	/* Check to see if there's only one occurrence of the string and
 	 * we're on it now. */
@@ -583,7 +987,11 @@ void do_research(void)
         statusbar(_("No current search pattern"));
 
     openfile->placewewant = xplustabs();
-    edit_redraw(fileptr, pww_save);
+    if (fileptr == NULL) {
+	edit_update(CENTER);
+	edit_refresh_needed = TRUE;
+    } else
+	edit_redraw(fileptr, pww_save);
     search_replace_abort();
 }
 #endif
@@ -592,14 +1000,11 @@ void do_research(void)
 int replace_regexp(char *string, bool create)
 {
     /* We have a split personality here.  If create is FALSE, just
-     * calculate the size of the replacement line (necessary because of
-     * subexpressions \1 to \9 in the replaced text). */
+     * calculate the length of the replacement text (necessary because
+     * of subexpressions \1 to \9 in it). */
 
     const char *c = last_replace;
-    size_t search_match_count = regmatches[0].rm_eo -
-	regmatches[0].rm_so;
-    size_t new_line_size = strlen(openfile->current->data) + 1 -
-	search_match_count;
+    size_t new_size = 0;
 
     /* Iterate through the replacement text to handle subexpression
      * replacement using \1, \2, \3, etc. */
@@ -611,7 +1016,7 @@ int replace_regexp(char *string, bool create)
 	    if (create)
 		*string++ = *c;
 	    c++;
-	    new_line_size++;
+	    new_size++;
 	} else {
 	    size_t i = regmatches[num].rm_eo - regmatches[num].rm_so;
 
@@ -619,7 +1024,7 @@ int replace_regexp(char *string, bool create)
 	    c += 2;
 
 	    /* But add the length of the subexpression to new_size. */
-	    new_line_size += i;
+	    new_size += i;
 
 	    /* And if create is TRUE, append the result of the
 	     * subexpression match to the new line. */
@@ -634,7 +1039,7 @@ int replace_regexp(char *string, bool create)
     if (create)
 	*string = '\0';
 
-    return new_line_size;
+    return new_size;
 }
 #endif
 
@@ -647,7 +1052,8 @@ char *replace_line(const char *needle)
 #ifdef HAVE_REGEX_H
     if (ISSET(USE_REGEXP)) {
 	search_match_count = regmatches[0].rm_eo - regmatches[0].rm_so;
-	new_line_size = replace_regexp(NULL, FALSE);
+	new_line_size = strlen(openfile->current->data) -
+		search_match_count + replace_regexp(NULL, FALSE) + 1;
     } else {
 #endif
 	search_match_count = strlen(needle);
@@ -680,6 +1086,154 @@ char *replace_line(const char *needle)
     return copy;
 }
 
+/* The match_len bytes at current_x on the current line have just been
+ * replaced by text length_change bytes longer.  Keep mark_begin_x and
+ * real_current_x in sync with the text changes. */
+static void adjust_for_replacement(size_t match_len, size_t length_change,
+	const filestruct *real_current, size_t *real_current_x
+#ifndef NANO_TINY
+	, bool old_mark_set, bool right_side_up
+#endif
+	)
+{
+#ifndef NANO_TINY
+    /* If the mark was on and (mark_begin, mark_begin_x) was the top of
+     * it, don't change mark_begin_x. */
+    if (!old_mark_set || !right_side_up) {
+	if (openfile->current == openfile->mark_begin &&
+		openfile->mark_begin_x > openfile->current_x) {
+	    if (openfile->mark_begin_x < openfile->current_x +
+		match_len)
+		openfile->mark_begin_x = openfile->current_x;
+	    else
+		openfile->mark_begin_x += length_change;
+	}
+    }
+
+    /* If the mark was on and (current, current_x) was the top of it,
+     * don't change real_current_x. */
+    if (!old_mark_set || right_side_up) {
+#endif
+	if (openfile->current == real_current &&
+		openfile->current_x <= *real_current_x) {
+	    if (*real_current_x < openfile->current_x + match_len)
+		*real_current_x = openfile->current_x + match_len;
+	    *real_current_x += length_change;
+	}
+#ifndef NANO_TINY
+    }
+#endif
+}
+
+/* Replace the match of needle, match_len bytes long, at current_x, and
+ * all the matches after it on the current line that a forward
+ * replace-all would get to before leaving the line, making the new line
+ * in one go instead of once for each match.  Leave current_x at the
+ * last character of the last replacement, just like replacing only one
+ * match does, and return the number of matches replaced.  match_len
+ * must not be zero. */
+static size_t replace_all_on_line(const char *needle, size_t match_len,
+	const filestruct *real_current, size_t *real_current_x
+#ifndef NANO_TINY
+	, bool old_mark_set, bool right_side_up
+#endif
+	)
+{
+    static char *copy = NULL;
+	/* Where the new line is put together. */
+    static size_t copy_size = 0;
+	/* The size of copy. */
+    char *line = openfile->current->data, *newline;
+    size_t x = openfile->current_x, done = 0, copy_len = 0, tail_len;
+	/* Where the match is, how much of line comes before the next
+	 * match, and how much of copy is filled in. */
+    size_t numreplaced = 0;
+
+    assert(match_len > 0);
+
+    while (TRUE) {
+	size_t repl_len;
+	const char *found;
+
+#ifdef HAVE_REGEX_H
+	if (ISSET(USE_REGEXP)) {
+	    /* replace_regexp() takes the subexpressions from here. */
+	    openfile->current_x = x;
+	    repl_len = replace_regexp(NULL, FALSE);
+	} else
+#endif
+	    repl_len = strlen(answer);
+
+	if (copy_len + (x - done) + repl_len + 1 > copy_size) {
+	    copy_size = 2 * (copy_len + (x - done) + repl_len + 1);
+	    copy = charealloc(copy, copy_size);
+	}
+
+	/* The text between the last match and this one, and then the
+	 * replacement text. */
+	strncpy(copy + copy_len, line + done, x - done);
+	copy_len += x - done;
+#ifdef HAVE_REGEX_H
+	if (ISSET(USE_REGEXP))
+	    replace_regexp(copy + copy_len, TRUE);
+	else
+#endif
+	    strncpy(copy + copy_len, answer, repl_len);
+
+	openfile->current_x = copy_len;
+	adjust_for_replacement(match_len, repl_len - match_len,
+		real_current, real_current_x
+#ifndef NANO_TINY
+		, old_mark_set, right_side_up
+#endif
+		);
+
+	copy_len += repl_len;
+	done = x + match_len;
+	numreplaced++;
+
+	/* Since the text after the match hasn't changed, the next match
+	 * can be looked for in the old line. */
+	found = strstrwrapper(line, needle, line + done);
+	if (found == NULL)
+	    break;
+
+	x = found - line;
+	match_len =
+#ifdef HAVE_REGEX_H
+		ISSET(USE_REGEXP) ?
+		(size_t)(regmatches[0].rm_eo - regmatches[0].rm_so) :
+#endif
+		strlen(needle);
+
+	/* Leave an empty match, or a match that comes after where we
+	 * started once we've wrapped around, to do_replace_loop(). */
+	if (match_len == 0 || (search_last_line && copy_len +
+		(x - done) > *real_current_x))
+	    break;
+    }
+
+    tail_len = strlen(line + done);
+    newline = charalloc(copy_len + tail_len + 1);
+    strncpy(newline, copy, copy_len);
+    strcpy(newline + copy_len, line + done);
+
+#ifndef NANO_TINY
+    update_undo(REPLACE_ALL);
+#endif
+
+    openfile->totsize += mbstrlen(newline) - mbstrlen(line);
+    nfree(line);
+    openfile->current->data = newline;
+
+    /* Set the cursor at the last character of the replacement text, so
+     * searching will resume after it.  Note that current_x might be
+     * set to (size_t)-1 here. */
+    openfile->current_x = copy_len - 1;
+
+    return numreplaced;
+}
+
 /* Step through each replace word and prompt user before replacing.
  * Parameters real_current and real_current_x are needed in order to
  * allow the cursor position to be updated when a word before the cursor
@@ -720,7 +1274,7 @@ ssize_t do_replace_loop(
 	openfile->edittop = openfile->fileage;
 	openfile->mark_set = FALSE;
 #ifdef ENABLE_COLOR
-	reset_multis(openfile->current, TRUE);
+	reset_multis(openfile->current);
 #endif
 	edit_refresh();
     }
@@ -805,71 +1359,74 @@ ssize_t do_replace_loop(
 #endif
 
 	if (i > 0 || replaceall) {	/* Yes, replace it!!!! */
-	    char *copy;
-	    size_t length_change;
-
+	    if (i == 2) {
+		replaceall = TRUE;
 #ifndef NANO_TINY
-	    update_undo(REPLACE);
+		/* All the replacements from here on are undone as one. */
+		add_undo(REPLACE_ALL);
 #endif
-	    if (i == 2)
-		replaceall = TRUE;
-
-	    copy = replace_line(needle);
+	    }
 
-	    length_change = strlen(copy) -
-		strlen(openfile->current->data);
+	    /* When replacing all going forward, do the rest of the line
+	     * in one go, unless we only want whole words or a bol and/or
+	     * eol regex, or the match is empty. */
+	    if (replaceall && match_len > 0
+#ifdef HAVE_REGEX_H
+		&& !bol_or_eol
+#endif
+#ifndef NANO_TINY
+		&& !ISSET(BACKWARDS_SEARCH)
+#endif
+#ifndef DISABLE_SPELLER
+		&& !whole_word
+#endif
+		)
+		numreplaced += replace_all_on_line(needle, match_len,
+			real_current, real_current_x
+#ifndef NANO_TINY
+			, old_mark_set, right_side_up
+#endif
+			);
+	    else {
+		char *copy;
+		size_t length_change;
 
 #ifndef NANO_TINY
-	    /* If the mark was on and (mark_begin, mark_begin_x) was the
-	     * top of it, don't change mark_begin_x. */
-	    if (!old_mark_set || !right_side_up) {
-		/* Keep mark_begin_x in sync with the text changes. */
-		if (openfile->current == openfile->mark_begin &&
-			openfile->mark_begin_x > openfile->current_x) {
-		    if (openfile->mark_begin_x < openfile->current_x +
-			match_len)
-			openfile->mark_begin_x = openfile->current_x;
-		    else
-			openfile->mark_begin_x += length_change;
-		}
-	    }
+		update_undo(replaceall ? REPLACE_ALL : REPLACE);
+#endif
+		copy = replace_line(needle);
 
-	    /* If the mark was on and (current, current_x) was the top
-	     * of it, don't change real_current_x. */
-	    if (!old_mark_set || right_side_up) {
-#endif
-		/* Keep real_current_x in sync with the text changes. */
-		if (openfile->current == real_current &&
-			openfile->current_x <= *real_current_x) {
-		    if (*real_current_x <
-			openfile->current_x + match_len)
-			*real_current_x = openfile->current_x +
-				match_len;
-		    *real_current_x += length_change;
-		}
+		length_change = strlen(copy) -
+			strlen(openfile->current->data);
+
+		adjust_for_replacement(match_len, length_change,
+			real_current, real_current_x
 #ifndef NANO_TINY
-	    }
+			, old_mark_set, right_side_up
 #endif
+			);
 
-	    /* Set the cursor at the last character of the replacement
-	     * text, so searching will resume after the replacement
-	     * text.  Note that current_x might be set to (size_t)-1
-	     * here. */
+		/* Set the cursor at the last character of the
+		 * replacement text, so searching will resume after the
+		 * replacement text.  Note that current_x might be set
+		 * to (size_t)-1 here. */
 #ifndef NANO_TINY
-	    if (!ISSET(BACKWARDS_SEARCH))
+		if (!ISSET(BACKWARDS_SEARCH))
 #endif
-		openfile->current_x += match_len + length_change - 1;
+		    openfile->current_x += match_len + length_change - 1;
 
-	    /* Cleanup. */
-	    openfile->totsize += mbstrlen(copy) -
-		mbstrlen(openfile->current->data);
-	    free(openfile->current->data);
-	    openfile->current->data = copy;
+		/* Cleanup. */
+		openfile->totsize += mbstrlen(copy) -
+			mbstrlen(openfile->current->data);
+		nfree(openfile->current->data);
+		openfile->current->data = copy;
+
+		numreplaced++;
+	    }
 
 #ifdef ENABLE_COLOR
-	reset_multis(openfile->current, TRUE);
+	    reset_multis(openfile->current);
 #endif
-	edit_refresh();
 	    if (!replaceall) {
 #ifdef ENABLE_COLOR
 		/* If color syntaxes are available and turned on, we
@@ -883,7 +1440,6 @@ ssize_t do_replace_loop(
 	    }
 
 	    set_modified();
-	    numreplaced++;
 	}
     }
 
@@ -986,12 +1542,21 @@ void do_replace(void)
     begin_x = openfile->current_x;
     pww_save = openfile->placewewant;
 
+#ifndef NANO_TINY
+    /* All the replacements of this session are undone as one. */
+    begin_undo_group(FALSE);
+#endif
+
     numreplaced = do_replace_loop(
 #ifndef DISABLE_SPELLER
 	FALSE,
 #endif
 	NULL, begin, &begin_x, last_search);
 
+#ifndef NANO_TINY
+    end_undo_group();
+#endif
+
     /* Restore where we were. */
     openfile->edittop = edittop_save;
     openfile->current = begin;
@@ -1070,9 +1635,22 @@ void do_gotolinecolumn(ssize_t line, ssize_t column, bool use_answer,
 	    column = openfile->placewewant + 1;
     }
 
-    for (openfile->current = openfile->fileage;
-	openfile->current != openfile->filebot && line > 1; line--)
-	openfile->current = openfile->current->next;
+#ifndef NANO_TINY
+    /* In a paged file, get the lines around the line into memory, and
+     * count from the first of them. */
+    if (openfile->paged != NULL) {
+	paged_window(line);
+	line -= openfile->fileage->lineno - 1;
+    }
+#endif
+
+    /* Go to the line, or to the last line if there aren't that many
+     * lines. */
+    if (line > openfile->filebot->lineno - openfile->fileage->lineno)
+	openfile->current = openfile->filebot;
+    else
+	openfile->current = fsfromline(openfile->fileage->lineno + line -
+		1);
 
     openfile->current_x = actual_x(openfile->current->data, column - 1);
     openfile->placewewant = column - 1;
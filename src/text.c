@@ -29,12 +29,25 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <errno.h>
 
 #ifndef NANO_TINY
 static pid_t pid = -1;
 	/* The PID of the forked process in execute_command(), for use
 	 * with the cancel_command() signal handler. */
+static undo *last_cutu = NULL;
+	/* The last cut undo item, to set up the undo item of an uncut. */
+static unsigned long undo_groups = 0;
+	/* How many groups of undo items have been started. */
+static unsigned long undo_group = 0;
+	/* The group that new undo items go into, or 0 if none. */
+static int undo_group_depth = 0;
+	/* How many begin_undo_group() calls are still to be ended. */
+static bool undo_pasting = FALSE;
+	/* Is the text being added by the current group a paste? */
+static undo *paste_undo = NULL;
+	/* The paste undo item that text being pasted goes into. */
 #endif
 #ifndef DISABLE_WRAPPING
 static bool prepend_wrap = FALSE;
@@ -127,7 +140,7 @@ void do_delete(void)
 
 	unlink_node(foo);
 	delete_node(foo);
-	renumber(openfile->current);
+	renumber_lazily(openfile->current);
 	openfile->totsize--;
 
 	/* If the NO_NEWLINES flag isn't set, and text has been added to
@@ -191,6 +204,38 @@ void do_tab(void)
 }
 
 #ifndef NANO_TINY
+/* Save line f as it is before a change, in front of the lines saved
+ * before it by undo item u, as for a replace-all. */
+static void save_undo_line(undo *u, const filestruct *f)
+{
+    filestruct *t = make_new_node(NULL);
+
+    t->data = mallocstrcpy(NULL, f->data);
+    t->lineno = f->lineno;
+    t->next = u->cutbuffer;
+    if (u->cutbuffer != NULL)
+	u->cutbuffer->prev = t;
+    else
+	u->cutbottom = t;
+    u->cutbuffer = t;
+}
+
+/* Save line f as it is before it's indented or unindented, so that the
+ * whole indent can be undone at once, and add the undo item for it
+ * first if *added is FALSE. */
+static void save_indented_line(const filestruct *f, bool *added)
+{
+    if (!ISSET(UNDOABLE))
+	return;
+
+    if (!*added) {
+	add_undo(INDENT);
+	*added = TRUE;
+    }
+
+    save_undo_line(openfile->current_undo, f);
+}
+
 /* Indent or unindent the current line (or, if the mark is on, all lines
  * covered by the mark) len columns, depending on whether len is
  * positive or negative.  If the TABS_TO_SPACES flag is set, indent or
@@ -209,6 +254,8 @@ void do_indent(ssize_t cols)
 	 * it. */
     filestruct *top, *bot, *f;
     size_t top_x, bot_x;
+    bool undo_added = FALSE;
+	/* Whether the undo item for this indent has been added. */
 
     assert(openfile->current != NULL && openfile->current->data != NULL);
 
@@ -267,6 +314,7 @@ void do_indent(ssize_t cols)
 	if (!unindent) {
 	    /* If we're indenting, add the characters in line_indent to
 	     * the beginning of the non-whitespace text of this line. */
+	    save_indented_line(f, &undo_added);
 	    f->data = charealloc(f->data, line_len +
 		line_indent_len + 1);
 	    charmove(&f->data[indent_len + line_indent_len],
@@ -304,6 +352,7 @@ void do_indent(ssize_t cols)
 		/* If we're unindenting, and there's at least cols
 		 * columns' worth of indentation at the beginning of the
 		 * non-whitespace text of this line, remove it. */
+		save_indented_line(f, &undo_added);
 		charmove(&f->data[indent_new], &f->data[indent_len],
 			line_len - indent_shift - indent_new + 1);
 		null_at(&f->data, line_len - indent_shift + 1);
@@ -397,7 +446,7 @@ void redo_cut(undo *u) {
     do_gotolinecolumn(u->lineno, u->begin+1, FALSE, FALSE, FALSE, FALSE);
     openfile->mark_set = u->mark_set;
     if (cutbuffer)
-	free(cutbuffer);
+	nfree(cutbuffer);
     cutbuffer = NULL;
 
     /* Move ahead the same # lines we had if a marked cut */
@@ -430,30 +479,46 @@ void redo_cut(undo *u) {
     edit_refresh_needed = TRUE;
 }
 
-/* Undo the last thing(s) we did */
-void do_undo(void)
+/* Swap the lines saved by a replace-all with the ones now in the file.
+ * When undoing, go from the last saved line to the first, and when
+ * redoing, the other way around, so that a line changed more than once
+ * ends up right. */
+static void swap_replaced_lines(undo *u, bool undoing)
 {
-    undo *u = openfile->current_undo;
-    filestruct *f = openfile->current, *t;
-    int len = 0;
-    char *undidmsg, *data;
-    filestruct *oldcutbuffer = cutbuffer, *oldcutbottom = cutbottom;
+    filestruct *t = undoing ? u->cutbuffer : u->cutbottom;
+    filestruct *f = openfile->fileage;
 
-    if (!u) {
-	statusbar(_("Nothing in undo buffer!"));
-	return;
+    for (; t != NULL; t = undoing ? t->next : t->prev) {
+	char *data;
+
+	while (f->lineno < t->lineno)
+	    f = f->next;
+	while (f->lineno > t->lineno)
+	    f = f->prev;
+
+	openfile->totsize += mbstrlen(t->data) - mbstrlen(f->data);
+	data = f->data;
+	f->data = t->data;
+	t->data = data;
+#ifdef ENABLE_COLOR
+	reset_multis(f);
+#endif
     }
+}
 
+/* Undo the single item u, and return what it was, or NULL if it can't
+ * be undone. */
+static char *undo_one(undo *u)
+{
+    filestruct *f, *t;
+    int len = 0;
+    char *undidmsg, *data;
+    filestruct *oldcutbuffer = cutbuffer, *oldcutbottom = cutbottom;
 
-    if (u->lineno <= f->lineno)
-        for (; f->prev != NULL && f->lineno != u->lineno; f = f->prev)
-	    ;
-    else
-        for (; f->next != NULL && f->lineno != u->lineno; f = f->next)
-	    ;
-    if (f->lineno != u->lineno) {
+    f = fsfromline(u->lineno);
+    if (f == NULL) {
         statusbar(_("Internal error: can't match line %d.  Please save your work"), u->lineno);
-	return;
+	return NULL;
     }
 #ifdef DEBUG
     fprintf(stderr, "data we're about to undo = \"%s\"\n", f->data);
@@ -468,7 +533,7 @@ void do_undo(void)
         data = charalloc(len);
         strncpy(data, f->data, u->begin);
 	strcpy(&data[u->begin], &f->data[u->begin + strlen(u->strdata)]);
-	free(f->data);
+	nfree(f->data);
 	f->data = data;
 	break;
     case DEL:
@@ -479,10 +544,20 @@ void do_undo(void)
 	strncpy(data, f->data, u->begin);
 	strcpy(&data[u->begin], u->strdata);
 	strcpy(&data[u->begin + strlen(u->strdata)], &f->data[u->begin]);
-	free(f->data);
+	nfree(f->data);
 	f->data = data;
-	if (u->xflags == UNDO_DEL_BACKSPACE)
+	if (u->xflags == UNDO_DEL_BACKSPACE) {
+	    /* Backspaced characters were saved backwards. */
+	    char *a = &data[u->begin], *z = a + strlen(u->strdata) - 1;
+
+	    for (; a < z; a++, z--) {
+		char ch = *a;
+
+		*a = *z;
+		*z = ch;
+	    }
 	    openfile->current_x += strlen(u->strdata);
+	}
 	break;
 #ifndef DISABLE_WRAPPING
     case SPLIT:
@@ -492,7 +567,13 @@ void do_undo(void)
 	if (u->strdata2 != NULL)
 	    f->next->data = mallocstrcpy(f->next->data, u->strdata2);
 	else {
-	    filestruct *foo = openfile->current->next;
+	    filestruct *foo = f->next;
+
+	    /* Don't leave anything pointing at the line made by the
+	     * wrap. */
+	    openfile->current = f;
+	    if (openfile->edittop == foo)
+		openfile->edittop = f;
 	    unlink_node(foo);
 	    delete_node(foo);
 	}
@@ -503,9 +584,10 @@ void do_undo(void)
 	undidmsg = _("line join");
 	t = make_new_node(f);
 	t->data = mallocstrcpy(NULL, u->strdata);
-	data = mallocstrncpy(NULL, f->data, u->begin);
+	data = charalloc(u->begin + 1);
+	strncpy(data, f->data, u->begin);
 	data[u->begin] = '\0';
-	free(f->data);
+	nfree(f->data);
 	f->data = data;
 	splice_node(f, t, f->next);
 	renumber(f);
@@ -522,10 +604,21 @@ void do_undo(void)
 	undidmsg = _("line break");
 	if (f->next) {
 	    filestruct *foo = f->next;
+
+	    /* Don't leave anything pointing at the line that goes
+	     * away. */
+	    openfile->current = f;
+	    if (openfile->edittop == foo)
+		openfile->edittop = f;
+	    if (openfile->mark_begin == foo) {
+		openfile->mark_begin = f;
+		openfile->mark_begin_x += strlen(f->data);
+	    }
 	    f->data = (char *) nrealloc(f->data, strlen(f->data) + strlen(f->next->data) + 1);
 	    strcat(f->data,  f->next->data);
 	    unlink_node(foo);
 	    delete_node(foo);
+	    renumber(f);
 	}
 	break;
     case INSERT:
@@ -552,6 +645,38 @@ void do_undo(void)
 	u->strdata = f->data;
 	f->data = data;
 	break;
+    case REPLACE_ALL:
+	undidmsg = _("text replace");
+	swap_replaced_lines(u, TRUE);
+	break;
+    case INDENT:
+	undidmsg = _("indent");
+	swap_replaced_lines(u, TRUE);
+	if (u->mark_set) {
+	    openfile->mark_begin = fsfromline(u->mark_begin_lineno);
+	    openfile->mark_begin_x = u->mark_begin_x;
+	}
+	break;
+    case PASTE:
+	undidmsg = _("text paste");
+	/* Cut away everything from where the paste began to where it
+	 * ended, and keep it for a redo. */
+	cutbuffer = NULL;
+	cutbottom = NULL;
+	openfile->mark_begin = f;
+	openfile->mark_begin_x = u->begin;
+	openfile->mark_set = TRUE;
+	openfile->current = fsfromline(u->mark_begin_lineno);
+	openfile->current_x = u->mark_begin_x;
+	cut_marked();
+	if (u->cutbuffer != NULL)
+	    free_filestruct(u->cutbuffer);
+	u->cutbuffer = cutbuffer;
+	u->cutbottom = cutbottom;
+	cutbuffer = oldcutbuffer;
+	cutbottom = oldcutbottom;
+	openfile->mark_set = FALSE;
+	break;
 
     default:
 	undidmsg = _("Internal error: unknown type.  Please save your work");
@@ -559,39 +684,62 @@ void do_undo(void)
 
     }
     renumber(f);
-    do_gotolinecolumn(u->lineno, u->begin, FALSE, FALSE, FALSE, TRUE);
-    statusbar(_("Undid action (%s)"), undidmsg);
-    openfile->current_undo = openfile->current_undo->next;
-    openfile->last_action = OTHER;
+    openfile->current_undo = u->next;
+
+    return undidmsg;
 }
 
-void do_redo(void)
+/* Undo the last thing(s) we did */
+void do_undo(void)
 {
-    undo *u = openfile->undotop;
-    filestruct *f = openfile->current;
-    int len = 0;
-    char *undidmsg, *data;
+    undo *u = openfile->current_undo;
+    char *undidmsg;
+
+    /* If everything since the file was opened has been undone, go on
+     * with its saved history, if it has any. */
+    if (!u && openfile->undo_map != NULL) {
+	load_undo_history();
+	u = openfile->current_undo;
+    }
 
-    for (; u != NULL && u->next != openfile->current_undo; u = u->next)
-	;
     if (!u) {
-	statusbar(_("Nothing to re-do!"));
+	statusbar(_("Nothing in undo buffer!"));
 	return;
     }
-    if (u->next != openfile->current_undo) {
-	statusbar(_("Internal error: Redo setup failed.  Please save your work"));
-	return;
+
+    /* Undo all the items of a group, from the newest to the oldest. */
+    while (TRUE) {
+	bool last = (u->group == 0 || u->next == NULL ||
+		u->next->group != u->group);
+
+	undidmsg = undo_one(u);
+	if (undidmsg == NULL)
+	    return;
+
+	do_gotolinecolumn(u->lineno, u->begin, FALSE, FALSE, FALSE, last);
+	mark_for_journal();
+
+	if (last)
+	    break;
+	u = u->next;
     }
 
-    if (u->lineno <= f->lineno)
-        for (; f->prev != NULL && f->lineno != u->lineno; f = f->prev)
-	    ;
-    else
-        for (; f->next != NULL && f->lineno != u->lineno; f = f->next)
-	    ;
-    if (f->lineno != u->lineno) {
+    statusbar(_("Undid action (%s)"), undidmsg);
+    openfile->last_action = OTHER;
+}
+
+/* Redo the single item u, and return what it was, or NULL if it can't
+ * be redone. */
+static char *redo_one(undo *u)
+{
+    filestruct *f;
+    int len = 0;
+    char *undidmsg, *data;
+
+    f = fsfromline(u->lineno);
+    if (f == NULL) {
         statusbar(_("Internal error: can't match line %d.  Please save your work"), u->lineno);
-	return;
+	return NULL;
     }
 #ifdef DEBUG
     fprintf(stderr, "data we're about to redo = \"%s\"\n", f->data);
@@ -606,7 +754,7 @@ void do_redo(void)
 	strncpy(data, f->data, u->begin);
 	strcpy(&data[u->begin], u->strdata);
 	strcpy(&data[u->begin + strlen(u->strdata)], &f->data[u->begin]);
-	free(f->data);
+	nfree(f->data);
 	f->data = data;
 	break;
     case DEL:
@@ -615,7 +763,7 @@ void do_redo(void)
 	data = charalloc(len);
         strncpy(data, f->data, u->begin);
 	strcpy(&data[u->begin], &f->data[u->begin + strlen(u->strdata)]);
-	free(f->data);
+	nfree(f->data);
 	f->data = data;
 	break;
     case ENTER:
@@ -626,22 +774,35 @@ void do_redo(void)
 #ifndef DISABLE_WRAPPING
     case SPLIT:
 	undidmsg = _("line wrap");
-	if (u->xflags & UNDO_SPLIT_MADENEW)
-	    prepend_wrap = TRUE;
+	/* Wrap the way it was done, whatever the wraps before it left
+	 * behind. */
+	prepend_wrap = (u->xflags & UNDO_SPLIT_MADENEW) ? TRUE : FALSE;
+	openfile->current = f;
         do_wrap(f, TRUE);
 	renumber(f);
 	break;
 #endif /* DISABLE_WRAPPING */
     case UNSPLIT:
 	undidmsg = _("line join");
-	len = strlen(f->data) + strlen(u->strdata + 1);
+	len = strlen(f->data) + strlen(u->strdata) + 1;
 	data = charalloc(len);
 	strcpy(data, f->data);
 	strcat(data, u->strdata);
-	free(f->data);
+	nfree(f->data);
 	f->data = data;
 	if (f->next != NULL) {
 	    filestruct *tmp = f->next;
+
+	    /* Don't leave anything pointing at the line that goes
+	     * away. */
+	    openfile->current = f;
+	    if (openfile->edittop == tmp)
+		openfile->edittop = f;
+	    if (openfile->mark_begin == tmp) {
+		openfile->mark_begin = f;
+		openfile->mark_begin_x += strlen(f->data) -
+			strlen(u->strdata);
+	    }
 	    unlink_node(tmp);
 	    delete_node(tmp);
 	}
@@ -661,6 +822,21 @@ void do_redo(void)
 	u->strdata = f->data;
 	f->data = data;
 	break;
+    case REPLACE_ALL:
+	undidmsg = _("text replace");
+	swap_replaced_lines(u, FALSE);
+	break;
+    case INDENT:
+	undidmsg = _("indent");
+	swap_replaced_lines(u, FALSE);
+	break;
+    case PASTE:
+	undidmsg = _("text paste");
+	openfile->current = f;
+	openfile->current_x = u->begin;
+	if (u->cutbuffer != NULL)
+	    copy_from_filestruct(u->cutbuffer, u->cutbottom);
+	break;
     case INSERT:
 	undidmsg = _("text insert");
 	do_gotolinecolumn(u->lineno, u->begin+1, FALSE, FALSE, FALSE, FALSE);
@@ -672,12 +848,47 @@ void do_redo(void)
 	break;
 
     }
-    do_gotolinecolumn(u->lineno, u->begin, FALSE, FALSE, FALSE, TRUE);
-    statusbar(_("Redid action (%s)"), undidmsg);
-
     openfile->current_undo = u;
-    openfile->last_action = OTHER;
 
+    return undidmsg;
+}
+
+/* Redo the last thing(s) we undid */
+void do_redo(void)
+{
+    undo *u = openfile->undotop;
+    char *undidmsg;
+
+    for (; u != NULL && u->next != openfile->current_undo; u = u->next)
+	;
+    if (!u) {
+	statusbar(_("Nothing to re-do!"));
+	return;
+    }
+    if (u->next != openfile->current_undo) {
+	statusbar(_("Internal error: Redo setup failed.  Please save your work"));
+	return;
+    }
+
+    /* Redo all the items of a group, from the oldest to the newest. */
+    while (TRUE) {
+	bool last = (u->group == 0 || u->prev == NULL ||
+		u->prev->group != u->group);
+
+	undidmsg = redo_one(u);
+	if (undidmsg == NULL)
+	    return;
+
+	do_gotolinecolumn(u->lineno, u->begin, FALSE, FALSE, FALSE, last);
+	mark_for_journal();
+
+	if (last)
+	    break;
+	u = u->prev;
+    }
+
+    statusbar(_("Redid action (%s)"), undidmsg);
+    openfile->last_action = OTHER;
 }
 #endif /* !NANO_TINY */
 
@@ -730,7 +941,7 @@ void do_enter(bool undoing)
     splice_node(openfile->current, newnode,
 	openfile->current->next);
 
-    renumber(openfile->current);
+    renumber_lazily(openfile->current);
     openfile->current = newnode;
 
     openfile->totsize++;
@@ -835,13 +1046,94 @@ bool execute_command(const char *command)
     return TRUE;
 }
 
+/* Free undo item u and everything it holds. */
+static void free_undo(undo *u)
+{
+    if (u->strdata != NULL)
+	nfree(u->strdata);
+    if (u->strdata2 != NULL)
+	nfree(u->strdata2);
+    if (u->cutbuffer != NULL)
+	free_filestruct(u->cutbuffer);
+    if (u == last_cutu)
+	last_cutu = NULL;
+    if (u == paste_undo)
+	paste_undo = NULL;
+    free(u);
+}
+
+/* Work out roughly how much memory undo item u takes up. */
+static size_t undo_item_size(const undo *u)
+{
+    size_t size = sizeof(undo);
+    const filestruct *t;
+
+    if (u->strdata != NULL)
+	size += (u->strdata_size > 0) ? u->strdata_size :
+		strlen(u->strdata) + 1;
+    if (u->strdata2 != NULL)
+	size += strlen(u->strdata2) + 1;
+    for (t = u->cutbuffer; t != NULL; t = t->next)
+	size += sizeof(filestruct) + strlen(t->data) + 1;
+
+    return size;
+}
+
+/* Forget the oldest undo items of the current buffer until the ones
+ * that have been counted take up no more than undomemory kilobytes.
+ * The newest item is always kept. */
+static void trim_undo_list(void)
+{
+    openfilestruct *fs = openfile;
+
+    while (fs->undo_size > (size_t)undomemory * 1024 &&
+	fs->undobot != fs->undotop) {
+	undo *u = fs->undobot;
+
+	fs->undobot = u->prev;
+	fs->undobot->next = NULL;
+	fs->undo_size -= u->size;
+	free_undo(u);
+
+	/* The saved history would no longer follow on from ours. */
+	forget_undo_history(fs);
+    }
+}
+
+/* Add character c to the end of the text of undo item u.  Its room is
+ * doubled whenever it runs out, so that a long run of typing costs
+ * only constant time per character. */
+static void append_undo_char(undo *u, char c)
+{
+    /* Deleting at the end of a line gives us its terminating null,
+     * which leaves the text as it is. */
+    if (c == '\0')
+	return;
+
+    if (u->strdata_len + 2 > u->strdata_size) {
+	u->strdata_size = 2 * (u->strdata_len + 2);
+	u->strdata = charealloc(u->strdata, u->strdata_size);
+    }
+
+    u->strdata[u->strdata_len++] = c;
+    u->strdata[u->strdata_len] = '\0';
+}
+
+/* Note where the text of the paste going on ends, so that undoing the
+ * paste item takes away all of it, and stop adding to that item. */
+static void seal_paste_undo(void)
+{
+    paste_undo->mark_begin_lineno = openfile->current->lineno;
+    paste_undo->mark_begin_x = openfile->current_x;
+    paste_undo = NULL;
+}
+
 /* Add a new undo struct to the top of the current pile */
 void add_undo(undo_type current_action)
 {
     undo *u;
     char *data;
     openfilestruct *fs = openfile;
-    static undo *last_cutu = NULL; /* Last thing we cut to set up the undo for uncut */
     ssize_t wrap_loc;	/* For calculating split beginning */
 
     if (!ISSET(UNDOABLE))
@@ -854,15 +1146,34 @@ void add_undo(undo_type current_action)
 	&& !u->mark_set && u->lineno == fs->current->lineno)
 	return;
 
+    /* The text and line breaks of a paste all go into one item, which
+     * ends where anything else begins. */
+    if (paste_undo != NULL) {
+	if (paste_undo == fs->undotop && (current_action == ADD ||
+		current_action == ENTER))
+	    return;
+	seal_paste_undo();
+    }
+
     /* Blow away the old undo stack if we are starting from the middle */
     while (fs->undotop != NULL && fs->undotop != fs->current_undo) {
 	undo *u2 = fs->undotop;
 	fs->undotop = fs->undotop->next;
-	if (u2->strdata != NULL)
-	    free(u2->strdata);
-	if (u2->cutbuffer)
-	    free_filestruct(u2->cutbuffer);
-	free(u2);
+	fs->undo_size -= u2->size;
+	free_undo(u2);
+    }
+    if (fs->undotop != NULL)
+	fs->undotop->prev = NULL;
+    else
+	fs->undobot = NULL;
+
+    /* The item that was on top is done now, so count how much memory
+     * it takes up, and forget the oldest items if it's too much. */
+    if (undomemory > 0 && fs->undotop != NULL &&
+	fs->undotop->size == 0) {
+	fs->undotop->size = undo_item_size(fs->undotop);
+	fs->undo_size += fs->undotop->size;
+	trim_undo_list();
     }
 
     /* Allocate and initialize a new undo type */
@@ -870,10 +1181,17 @@ void add_undo(undo_type current_action)
     u->type = current_action;
     u->lineno = fs->current->lineno;
     u->begin = fs->current_x;
+    u->prev = NULL;
     u->next = fs->undotop;
+    if (fs->undotop != NULL)
+	fs->undotop->prev = u;
+    else
+	fs->undobot = u;
     fs->undotop = u;
     fs->current_undo = u;
     u->strdata = NULL;
+    u->strdata_len = 0;
+    u->strdata_size = 0;
     u->strdata2 = NULL;
     u->cutbuffer = NULL;
     u->cutbottom  = NULL;
@@ -882,21 +1200,24 @@ void add_undo(undo_type current_action)
     u->mark_begin_x = 0;
     u->xflags = 0;
     u->to_end = FALSE;
+    u->size = 0;
+    u->group = undo_group;
+
+    if (undo_pasting && (current_action == ADD || current_action ==
+	ENTER)) {
+	u->type = PASTE;
+	paste_undo = u;
+    }
 
     switch (u->type) {
     /* We need to start copying data into the undo buffer or we wont be able
        to restore it later */
     case ADD:
-        data = charalloc(2);
-        data[0] = fs->current->data[fs->current_x];
-        data[1] = '\0';
-        u->strdata = data;
+	append_undo_char(u, fs->current->data[fs->current_x]);
 	break;
     case DEL:
 	if (u->begin != strlen(fs->current->data)) {
-            data = mallocstrncpy(NULL, &fs->current->data[u->begin], 2);
-            data[1] = '\0';
-            u->strdata = data;
+	    append_undo_char(u, fs->current->data[u->begin]);
 	    break;
 	}
 	/* Else purposely fall into unsplit code */
@@ -922,11 +1243,29 @@ void add_undo(undo_type current_action)
 	u->begin = wrap_loc;
 	break;
 #endif /* DISABLE_WRAPPING */
-    case INSERT:
     case REPLACE:
 	data = mallocstrcpy(NULL, fs->current->data);
 	u->strdata = data;
 	break;
+    case INSERT:
+	/* Undoing an insert cuts the inserted text, so the line itself
+	 * isn't needed. */
+	break;
+    case REPLACE_ALL:
+	/* The lines are saved by update_undo(), as each is changed. */
+	break;
+    case PASTE:
+	/* Where the paste ends is filled in once it's over. */
+	break;
+    case INDENT:
+	/* The lines are saved by do_indent(), as each is changed, but
+	 * the mark moves along with them, so keep where it was. */
+	u->mark_set = openfile->mark_set;
+	if (u->mark_set) {
+	    u->mark_begin_lineno = openfile->mark_begin->lineno;
+	    u->mark_begin_x = openfile->mark_begin_x;
+	}
+	break;
     case CUT:
 	u->mark_set = openfile->mark_set;
 	if (u->mark_set) {
@@ -939,9 +1278,13 @@ void add_undo(undo_type current_action)
     case UNCUT:
 	if (!last_cutu)
 	    statusbar(_("Internal error: can't setup uncut.  Please save your work."));
-	else if (last_cutu->type == CUT) {
-	    u->cutbuffer = last_cutu->cutbuffer;
-	    u->cutbottom = last_cutu->cutbottom;
+	else if (last_cutu->type == CUT && last_cutu->cutbuffer != NULL) {
+	    /* Keep a copy of our own, so that the cut and the uncut can
+	     * be freed separately. */
+	    u->cutbuffer = copy_filestruct(last_cutu->cutbuffer);
+	    for (u->cutbottom = u->cutbuffer; u->cutbottom->next != NULL;
+		u->cutbottom = u->cutbottom->next)
+		;
 	}
 	break;
     case ENTER:
@@ -959,6 +1302,38 @@ void add_undo(undo_type current_action)
     fs->last_action = current_action;
 }
 
+/* If the cutbuffer is the one that undo item u has a copy of, with text
+ * added at its end, as when cutting several lines in a row, bring the
+ * copy up to date by copying only the lines that changed, and return
+ * TRUE.  Otherwise, return FALSE. */
+static bool extend_cut_copy(undo *u)
+{
+    filestruct *c = u->cutbuffer, *t = cutbuffer;
+
+    if (c == NULL)
+	return FALSE;
+
+    for (; c != u->cutbottom; c = c->next, t = t->next)
+	if (t->next == NULL || strcmp(c->data, t->data) != 0)
+	    return FALSE;
+
+    /* The last line of the copy may have had text added to it. */
+    if (strncmp(c->data, t->data, strlen(c->data)) != 0)
+	return FALSE;
+
+    c->data = mallocstrcpy(c->data, t->data);
+
+    for (t = t->next; t != NULL; t = t->next) {
+	c->next = copy_node(t);
+	c->next->prev = c;
+	c = c->next;
+    }
+    c->next = NULL;
+    u->cutbottom = c;
+
+    return TRUE;
+}
+
 /* Update an undo item, or determine whether a new one
    is really needed and bounce the data to add_undo
    instead.  The latter functionality just feels
@@ -967,13 +1342,16 @@ void add_undo(undo_type current_action)
 void update_undo(undo_type action)
 {
     undo *u;
-    char *data;
-    int len = 0;
     openfilestruct *fs = openfile;
 
     if (!ISSET(UNDOABLE))
 	return;
 
+    /* Text being pasted goes into the paste item as a whole, when that
+     * is undone, so there's nothing to add to it. */
+    if (action == ADD && paste_undo != NULL && paste_undo == fs->undotop)
+	return;
+
 #ifdef DEBUG
         fprintf(stderr, "action = %d, fs->last_action = %d,  openfile->current->lineno = %lu",
 		action, fs->last_action, (unsigned long) openfile->current->lineno);
@@ -987,6 +1365,7 @@ void update_undo(undo_type action)
        that we should be using */
     if (action != fs->last_action
 	|| (action != CUT && action != INSERT && action != SPLIT
+	    && action != REPLACE_ALL
 	    && openfile->current->lineno != fs->current_undo->lineno)) {
         add_undo(action);
 	return;
@@ -1001,18 +1380,13 @@ void update_undo(undo_type action)
         fprintf(stderr, "fs->current->data = \"%s\", current_x = %lu, u->begin = %d\n",
 			fs->current->data, (unsigned long) fs->current_x, u->begin);
 #endif
-        len = strlen(u->strdata) + 2;
-        data = (char *) nrealloc((void *) u->strdata, len * sizeof(char *));
-        data[len-2] = fs->current->data[fs->current_x];
-        data[len-1] = '\0';
-        u->strdata = (char *) data;
+	append_undo_char(u, fs->current->data[fs->current_x]);
 #ifdef DEBUG
 	fprintf(stderr, "current undo data now \"%s\"\n", u->strdata);
 #endif
 	break;
     case DEL:
-	len = strlen(u->strdata) + 2;
-	assert(len > 2);
+	assert(u->strdata_len > 0);
         if (fs->current_x == u->begin) {
 	    /* They're deleting */
 	    if (!u->xflags)
@@ -1021,25 +1395,17 @@ void update_undo(undo_type action)
 		add_undo(action);
 		return;
 	    }
-	    data = charalloc(len);
-	    strcpy(data, u->strdata);
-	    data[len-2] = fs->current->data[fs->current_x];;
-	    data[len-1] = '\0';
-	    free(u->strdata);
-	    u->strdata = data;
+	    append_undo_char(u, fs->current->data[fs->current_x]);
 	} else if (fs->current_x == u->begin - 1) {
-	    /* They're backspacing */
+	    /* They're backspacing.  The characters are added at the end
+	     * too, so strdata holds them backwards until it's used. */
 	    if (!u->xflags)
 		u->xflags = UNDO_DEL_BACKSPACE;
 	    else if (u->xflags != UNDO_DEL_BACKSPACE) {
 		add_undo(action);
 		return;
 	    }
-	    data = charalloc(len);
-	    data[0] = fs->current->data[fs->current_x];
-	    strcpy(&data[1], u->strdata);
-	    free(u->strdata);
-	    u->strdata = data;
+	    append_undo_char(u, fs->current->data[fs->current_x]);
 	    u->begin--;
 	} else {
 	    /* They deleted something else on the line */
@@ -1053,8 +1419,10 @@ void update_undo(undo_type action)
     case CUT:
 	if (!cutbuffer)
 	    break;
+	if (extend_cut_copy(u))
+	    break;
 	if (u->cutbuffer)
-	    free(u->cutbuffer);
+	    free_filestruct(u->cutbuffer);
 	u->cutbuffer = copy_filestruct(cutbuffer);
         /* Compute cutbottom for the uncut using out copy */
         for (u->cutbottom = u->cutbuffer; u->cutbottom->next != NULL; u->cutbottom = u->cutbottom->next)
@@ -1064,6 +1432,10 @@ void update_undo(undo_type action)
     case UNCUT:
 	add_undo(action);
 	break;
+    case REPLACE_ALL:
+	/* Save the line as it is before this replacement. */
+	save_undo_line(u, fs->current);
+	break;
     case INSERT:
 	u->mark_begin_lineno = openfile->current->lineno;
 	break;
@@ -1077,6 +1449,8 @@ void update_undo(undo_type action)
     case UNSPLIT:
 	/* These cases are handled by the earlier check for a new line and action */
     case ENTER:
+    case PASTE:
+    case INDENT:
     case OTHER:
 	break;
     }
@@ -1093,6 +1467,291 @@ void update_undo(undo_type action)
     fs->last_action = action;
 }
 
+/* Start a group of undo items that are undone and redone all at once,
+ * as for a paste, a replace, or a spell check.  Groups can be nested,
+ * in which case the outermost one counts.  If pasting is TRUE, the
+ * text and line breaks added until the group ends are a paste, and go
+ * into a single item. */
+void begin_undo_group(bool pasting)
+{
+    undo *u = openfile->undotop;
+
+    if (undo_group_depth++ == 0) {
+	undo_group = ++undo_groups;
+	undo_pasting = pasting;
+
+	/* A paste that comes in bits goes on in the item of the bit
+	 * before it, if nothing has been done since. */
+	if (pasting && u != NULL && u == openfile->current_undo &&
+		u->type == PASTE && u->mark_begin_lineno ==
+		openfile->current->lineno && (size_t)u->mark_begin_x ==
+		openfile->current_x) {
+	    undo_group = u->group;
+	    paste_undo = u;
+	}
+    }
+
+    /* Nothing in the group should be added to an item from before. */
+    openfile->last_action = OTHER;
+}
+
+/* End the group of undo items started by begin_undo_group(). */
+void end_undo_group(void)
+{
+    assert(undo_group_depth > 0);
+
+    if (--undo_group_depth > 0)
+	return;
+
+    if (paste_undo != NULL)
+	seal_paste_undo();
+
+    undo_group = 0;
+    undo_pasting = FALSE;
+
+    /* Nothing after the group should be added to an item in it. */
+    openfile->last_action = OTHER;
+}
+
+/* The undo history file of a buffer starts with undo_magic, and then
+ * the version of its format, the size and modification time of the
+ * file it was written for, and a hash of that file's text.  After that
+ * come the undo items, from the one that would be undone next down to
+ * the oldest one. */
+static const char undo_magic[] = "GNU nano undo history\n";
+#define UNDO_HISTORY_VERSION 2
+
+/* Return a hash of the text of the current buffer, to tell whether an
+ * undo history file was written for it. */
+static unsigned int buffer_hash(void)
+{
+    const filestruct *f;
+    unsigned int hash = 0;
+
+    for (f = openfile->fileage; f != NULL; f = f->next)
+	hash = (hash ^ line_hash(f->data)) * 16777619U;
+
+    return hash;
+}
+
+/* Read the header of an undo history file from *p, without going past
+ * end, into *size, *mtime, and *hash.  Return FALSE if it isn't one, or
+ * if its format is one we don't know. */
+static bool get_undo_header(const char **p, const char *end, size_t
+	*size, size_t *mtime, size_t *hash)
+{
+    size_t version;
+
+    if ((size_t)(end - *p) < sizeof(undo_magic) - 1 ||
+	memcmp(*p, undo_magic, sizeof(undo_magic) - 1) != 0)
+	return FALSE;
+    *p += sizeof(undo_magic) - 1;
+
+    return (get_packed_number(p, end, &version) &&
+	version == UNDO_HISTORY_VERSION &&
+	get_packed_number(p, end, size) &&
+	get_packed_number(p, end, mtime) &&
+	get_packed_number(p, end, hash));
+}
+
+/* Read one undo item from *p, without going past end.  Return NULL if
+ * it's cut off or makes no sense. */
+static undo *get_undo_item(const char **p, const char *end)
+{
+    undo *u = (undo *)nmalloc(sizeof(undo));
+    size_t type, lineno, begin, xflags, mark_set, to_end;
+    size_t mark_begin_lineno, mark_begin_x, group, lines;
+    filestruct *t = NULL;
+
+    u->strdata = NULL;
+    u->strdata2 = NULL;
+    u->cutbuffer = NULL;
+    u->cutbottom = NULL;
+
+    if (!get_packed_number(p, end, &type) || type > OTHER ||
+	!get_packed_number(p, end, &lineno) ||
+	!get_packed_number(p, end, &begin) ||
+	!get_packed_number(p, end, &xflags) ||
+	!get_packed_number(p, end, &mark_set) ||
+	!get_packed_number(p, end, &to_end) ||
+	!get_packed_number(p, end, &mark_begin_lineno) ||
+	!get_packed_number(p, end, &mark_begin_x) ||
+	!get_packed_number(p, end, &group) ||
+	!get_packed_string(p, end, &u->strdata) ||
+	!get_packed_string(p, end, &u->strdata2) ||
+	!get_packed_number(p, end, &lines)) {
+	free_undo(u);
+	return NULL;
+    }
+
+    /* The saved lines, as for a cut or a replace-all. */
+    for (; lines > 0; lines--) {
+	size_t cutlineno;
+	char *data;
+
+	if (!get_packed_number(p, end, &cutlineno) ||
+		!get_packed_string(p, end, &data) || data == NULL) {
+	    free_undo(u);
+	    return NULL;
+	}
+
+	t = make_new_node(t);
+	t->data = data;
+	t->lineno = (ssize_t)cutlineno;
+	if (t->prev != NULL)
+	    t->prev->next = t;
+	else
+	    u->cutbuffer = t;
+	u->cutbottom = t;
+    }
+
+    u->type = (undo_type)type;
+    u->lineno = (ssize_t)lineno;
+    u->begin = (int)begin;
+    u->xflags = (int)xflags;
+    u->mark_set = (mark_set != 0);
+    u->to_end = (to_end != 0);
+    u->mark_begin_lineno = (ssize_t)mark_begin_lineno;
+    u->mark_begin_x = (ssize_t)mark_begin_x;
+    u->group = (unsigned long)group;
+    u->strdata_len = (u->strdata != NULL) ? strlen(u->strdata) : 0;
+    u->strdata_size = (u->strdata != NULL) ? u->strdata_len + 1 : 0;
+    u->size = 0;
+
+    return u;
+}
+
+/* Write the undo history of the current buffer to f, from the item
+ * that would be undone next down to the oldest one.  Any saved history
+ * that hasn't been read in yet should have been read in first. */
+void write_undo_history(FILE *f)
+{
+    const undo *u;
+    const filestruct *t;
+
+    assert(openfile->undo_map == NULL && openfile->current_stat != NULL);
+
+    fputs(undo_magic, f);
+    put_packed_number(f, UNDO_HISTORY_VERSION);
+    put_packed_number(f, (size_t)openfile->current_stat->st_size);
+    put_packed_number(f, (size_t)openfile->current_stat->st_mtime);
+    put_packed_number(f, buffer_hash());
+
+    for (u = openfile->current_undo; u != NULL; u = u->next) {
+	size_t lines = 0;
+
+	for (t = u->cutbuffer; t != NULL; t = t->next)
+	    lines++;
+
+	put_packed_number(f, u->type);
+	put_packed_number(f, (size_t)u->lineno);
+	put_packed_number(f, (size_t)u->begin);
+	put_packed_number(f, (size_t)u->xflags);
+	put_packed_number(f, u->mark_set);
+	put_packed_number(f, u->to_end);
+	put_packed_number(f, (size_t)u->mark_begin_lineno);
+	put_packed_number(f, (size_t)u->mark_begin_x);
+	put_packed_number(f, u->group);
+	put_packed_string(f, u->strdata);
+	put_packed_string(f, u->strdata2);
+	put_packed_number(f, lines);
+
+	for (t = u->cutbuffer; t != NULL; t = t->next) {
+	    put_packed_number(f, (size_t)t->lineno);
+	    put_packed_string(f, t->data);
+	}
+    }
+}
+
+/* Return TRUE if the undo history file mapped in for the current buffer
+ * was written for the file that was just read into it. */
+bool check_undo_history(void)
+{
+    const char *p = openfile->undo_map;
+    const struct stat *st = openfile->current_stat;
+    size_t size, mtime, hash;
+
+    if (st == NULL || !get_undo_header(&p, p + openfile->undo_map_len,
+	&size, &mtime, &hash))
+	return FALSE;
+
+    return (size == (size_t)st->st_size &&
+	mtime == (size_t)st->st_mtime && hash == buffer_hash());
+}
+
+/* Read in the undo history file mapped in for the current buffer, if
+ * any, and add its items below all the ones we have, since they come
+ * from before the file was opened.  Then unmap it.  It was checked by
+ * check_undo_history() when it was mapped in. */
+void load_undo_history(void)
+{
+    openfilestruct *fs = openfile;
+    const char *p = fs->undo_map, *end = p + fs->undo_map_len;
+    size_t size, mtime, hash;
+    unsigned long saved_group = 0;
+    undo *first = NULL;
+
+    if (p == NULL)
+	return;
+
+    if (fs->undotop == NULL)
+	fs->last_action = OTHER;
+
+    if (get_undo_header(&p, end, &size, &mtime, &hash)) {
+	while (p < end) {
+	    undo *u = get_undo_item(&p, end);
+
+	    /* If the rest is damaged, make do with what we have. */
+	    if (u == NULL)
+		break;
+
+	    /* Give the groups of the saved items numbers of our own. */
+	    if (u->group != 0) {
+		if (u->group != saved_group) {
+		    saved_group = u->group;
+		    undo_groups++;
+		}
+		u->group = undo_groups;
+	    }
+
+	    u->prev = fs->undobot;
+	    u->next = NULL;
+	    if (fs->undobot != NULL)
+		fs->undobot->next = u;
+	    else
+		fs->undotop = u;
+	    fs->undobot = u;
+
+	    if (undomemory > 0) {
+		u->size = undo_item_size(u);
+		fs->undo_size += u->size;
+	    }
+
+	    if (first == NULL)
+		first = u;
+	}
+    }
+
+    /* If everything we had was undone, the file is as it was when it
+     * was opened, so the saved history goes on from here. */
+    if (fs->current_undo == NULL)
+	fs->current_undo = first;
+
+    forget_undo_history(fs);
+}
+
+/* Unmap the undo history file mapped in for buffer fs, if any, without
+ * reading it in. */
+void forget_undo_history(openfilestruct *fs)
+{
+    if (fs->undo_map == NULL)
+	return;
+
+    munmap(fs->undo_map, fs->undo_map_len);
+    fs->undo_map = NULL;
+    fs->undo_map_len = 0;
+}
+
 #endif /* !NANO_TINY */
 
 #ifndef DISABLE_WRAPPING
@@ -1171,9 +1830,6 @@ bool do_wrap(filestruct *line, bool undoing)
 	return FALSE;
 
 #ifndef NANO_TINY
-    if (!undoing)
-	add_undo(SPLIT);
-
     /* If autoindent is turned on, and we're on the character just after
      * the indentation, we don't wrap. */
     if (ISSET(AUTOINDENT)) {
@@ -1184,6 +1840,10 @@ bool do_wrap(filestruct *line, bool undoing)
 	if (wrap_loc == indent_len)
 	    return FALSE;
     }
+
+    /* Only now that we know we're wrapping can it be undone. */
+    if (!undoing)
+	add_undo(SPLIT);
 #endif
 
     /* Step 2, making the new wrap line.  It will consist of indentation
@@ -1274,7 +1934,7 @@ bool do_wrap(filestruct *line, bool undoing)
 	 * the indentation that we already copied above. */
 	strcat(new_line, next_line);
 
-	free(line->next->data);
+	nfree(line->next->data);
 	line->next->data = new_line;
 
 	/* If the NO_NEWLINES flag isn't set, and text has been added to
@@ -1617,7 +2277,7 @@ void justify_format(filestruct *paragraph, size_t skip)
     if (shift > 0) {
 	openfile->totsize -= shift;
 	null_at(&new_paragraph_data, new_end - new_paragraph_data);
-	free(paragraph->data);
+	nfree(paragraph->data);
 	paragraph->data = new_paragraph_data;
 
 #ifndef NANO_TINY
@@ -2659,8 +3319,12 @@ const char *do_int_speller(const char *tempfile_name)
     *read_buff_ptr = '\0';
     close(uniq_fd[0]);
 
-    /* Process the spelling errors. */
+    /* Process the spelling errors.  All the words fixed are undone as
+     * one. */
     read_buff_word = read_buff_ptr = read_buff;
+#ifndef NANO_TINY
+    begin_undo_group(FALSE);
+#endif
 
     while (*read_buff_ptr != '\0') {
 	if ((*read_buff_ptr == '\r') || (*read_buff_ptr == '\n')) {
@@ -2680,6 +3344,10 @@ const char *do_int_speller(const char *tempfile_name)
     if (read_buff_word != read_buff_ptr)
 	do_int_spell_fix(read_buff_word);
 
+#ifndef NANO_TINY
+    end_undo_group();
+#endif
+
     free(read_buff);
     search_replace_abort();
     edit_refresh_needed = TRUE;
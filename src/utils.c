@@ -319,6 +319,27 @@ bool is_whole_word(size_t pos, const char *buf, const char *word)
 }
 #endif /* !DISABLE_SPELLER */
 
+#ifdef HAVE_REGEX_H
+/* Fill in regmatches for the match of search_regexp that starts at
+ * found and is len bytes long.  Only if the regular expression has
+ * parenthetical subexpressions do we need to run it again to get their
+ * match positions. */
+static void set_regmatches(const char *found, regoff_t len)
+{
+    size_t i;
+
+    if (search_regexp.re_nsub > 0) {
+	regexec(&search_regexp, found, 10, regmatches, 0);
+	return;
+    }
+
+    regmatches[0].rm_so = 0;
+    regmatches[0].rm_eo = len;
+    for (i = 1; i < 10; i++)
+	regmatches[i].rm_so = regmatches[i].rm_eo = -1;
+}
+#endif
+
 /* If we are searching backwards, we will find the last match that
  * starts no later than start.  Otherwise we find the first match
  * starting no earlier than start.  If we are doing a regexp search, we
@@ -337,33 +358,45 @@ const char *strstrwrapper(const char *haystack, const char *needle,
 
 #ifdef HAVE_REGEX_H
     if (ISSET(USE_REGEXP)) {
+	const char *retval = NULL;
+	regoff_t len = 0;
+
+	if (search_literal != NULL) {
+#ifndef NANO_TINY
+	    if (ISSET(BACKWARDS_SEARCH))
+		retval = revstrstr(haystack, search_literal, start);
+	    else
+#endif
+		retval = strstr(start, search_literal);
+	    len = strlen(search_literal);
 #ifndef NANO_TINY
-	if (ISSET(BACKWARDS_SEARCH)) {
+	} else if (ISSET(BACKWARDS_SEARCH)) {
 	    if (regexec(&search_regexp, haystack, 1, regmatches,
 		0) == 0 && haystack + regmatches[0].rm_so <= start) {
-		const char *retval = haystack + regmatches[0].rm_so;
+		retval = haystack + regmatches[0].rm_so;
+		len = regmatches[0].rm_eo - regmatches[0].rm_so;
 
 		/* Search forward until there are no more matches. */
 		while (regexec(&search_regexp, retval + 1, 1,
 			regmatches, REG_NOTBOL) == 0 &&
-			retval + regmatches[0].rm_so + 1 <= start)
+			retval + regmatches[0].rm_so + 1 <= start) {
 		    retval += regmatches[0].rm_so + 1;
-		/* Finally, put the subexpression matches in global
-		 * variable regmatches.  The REG_NOTBOL flag doesn't
-		 * matter now. */
-		regexec(&search_regexp, retval, 10, regmatches, 0);
-		return retval;
+		    len = regmatches[0].rm_eo - regmatches[0].rm_so;
+		}
 	    }
-	} else
-#endif /* !NANO_TINY */
-	if (regexec(&search_regexp, start, 10, regmatches,
+#endif
+	} else if (regexec(&search_regexp, start, 1, regmatches,
 		(start > haystack) ? REG_NOTBOL : 0) == 0) {
-	    const char *retval = start + regmatches[0].rm_so;
-
-	    regexec(&search_regexp, retval, 10, regmatches, 0);
-	    return retval;
+	    retval = start + regmatches[0].rm_so;
+	    len = regmatches[0].rm_eo - regmatches[0].rm_so;
 	}
-	return NULL;
+
+	/* Finally, put the subexpression matches of the match we found
+	 * in global variable regmatches. */
+	if (retval != NULL)
+	    set_regmatches(retval, len);
+
+	return retval;
     }
 #endif /* HAVE_REGEX_H */
 #if !defined(NANO_TINY) || !defined(DISABLE_SPELLER)
@@ -408,10 +441,25 @@ void *nmalloc(size_t howmuch)
 }
 
 /* This is a wrapper for the realloc() function that properly handles
- * things when we run out of memory. */
+ * things when we run out of memory.  It also handles memory carved out
+ * of a line block, which can't be resized in place: the string there is
+ * moved into memory of its own. */
 void *nrealloc(void *ptr, size_t howmuch)
 {
-    void *r = realloc(ptr, howmuch);
+    lineblock *block = lineblock_of(ptr);
+    void *r;
+
+    if (block != NULL) {
+	size_t len = strlen((const char *)ptr) + 1;
+
+	r = nmalloc(howmuch);
+	memcpy(r, ptr, (len < howmuch) ? len : howmuch);
+	lineblock_release(block);
+
+	return r;
+    }
+
+    r = realloc(ptr, howmuch);
 
     if (r == NULL && howmuch != 0)
 	die(_("nano is out of memory!"));
@@ -419,6 +467,126 @@ void *nrealloc(void *ptr, size_t howmuch)
     return r;
 }
 
+/* This is a wrapper for the free() function that also handles memory
+ * carved out of a line block. */
+void nfree(void *ptr)
+{
+    lineblock *block = lineblock_of(ptr);
+
+    if (block != NULL)
+	lineblock_release(block);
+    else
+	free(ptr);
+}
+
+/* All the line blocks that still have pieces in use, sorted by
+ * address. */
+static lineblock **lineblocks = NULL;
+static size_t lineblocks_len = 0;
+
+/* Return the line block that the memory at ptr was carved out of, or
+ * NULL if it wasn't carved out of one. */
+lineblock *lineblock_of(const void *ptr)
+{
+    const char *p = (const char *)ptr;
+    size_t lo = 0, hi = lineblocks_len;
+
+    if (p == NULL)
+	return NULL;
+
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+
+	if (p < lineblocks[mid]->mem)
+	    hi = mid;
+	else if (p >= lineblocks[mid]->mem + lineblocks[mid]->size)
+	    lo = mid + 1;
+	else
+	    return lineblocks[mid];
+    }
+
+    return NULL;
+}
+
+/* Carve howmuch bytes out of the line block at *blockptr, moving on to
+ * a new, bigger block if there isn't enough room left in it, or if
+ * there's no block yet.  Return NULL if howmuch is too big to be worth
+ * carving out of a block, in which case the caller should use nmalloc()
+ * instead. */
+void *lineblock_alloc(lineblock **blockptr, size_t howmuch)
+{
+    lineblock *block = *blockptr;
+    void *r;
+
+    /* Keep every piece suitably aligned for a filestruct. */
+    howmuch = (howmuch + sizeof(void *) - 1) / sizeof(void *) *
+	sizeof(void *);
+
+    if (howmuch > LINEBLOCK_MAX_SIZE / 16)
+	return NULL;
+
+    if (block == NULL || block->used + howmuch > block->size) {
+	size_t size = LINEBLOCK_MIN_SIZE, i;
+
+	if (block != NULL) {
+	    if (block->size < LINEBLOCK_MAX_SIZE)
+		size = block->size * 2;
+	    else
+		size = LINEBLOCK_MAX_SIZE;
+
+	    /* We're done carving pieces out of the old block. */
+	    lineblock_release(block);
+	}
+
+	block = (lineblock *)nmalloc(sizeof(lineblock));
+	block->mem = charalloc(size);
+	block->size = size;
+	block->used = 0;
+	block->refs = 1;
+
+	/* Add the new block to the list, keeping it sorted. */
+	for (i = lineblocks_len; i > 0 && lineblocks[i - 1]->mem >
+		block->mem; i--)
+	    ;
+	lineblocks = (lineblock **)nrealloc(lineblocks,
+		(lineblocks_len + 1) * sizeof(lineblock *));
+	memmove(lineblocks + i + 1, lineblocks + i, (lineblocks_len -
+		i) * sizeof(lineblock *));
+	lineblocks[i] = block;
+	lineblocks_len++;
+
+	*blockptr = block;
+    }
+
+    r = block->mem + block->used;
+    block->used += howmuch;
+    block->refs++;
+
+    return r;
+}
+
+/* Drop one reference to the line block block, freeing it once nothing
+ * uses it anymore.  This is how all the lines of a file are freed in
+ * bulk when its buffer is closed. */
+void lineblock_release(lineblock *block)
+{
+    size_t i;
+
+    assert(block != NULL && block->refs > 0);
+
+    if (--block->refs > 0)
+	return;
+
+    for (i = 0; lineblocks[i] != block; i++)
+	;
+    lineblocks_len--;
+    memmove(lineblocks + i, lineblocks + i + 1, (lineblocks_len - i) *
+	sizeof(lineblock *));
+
+    free(block->mem);
+    free(block);
+}
+
 /* Copy the first n characters of one malloc()ed string to another
  * pointer.  Should be used as: "dest = mallocstrncpy(dest, src,
  * n);". */
@@ -428,7 +596,7 @@ char *mallocstrncpy(char *dest, const char *src, size_t n)
 	src = "";
 
     if (src != dest)
-	free(dest);
+	nfree(dest);
 
     dest = charalloc(n);
     strncpy(dest, src, n);
@@ -484,17 +652,36 @@ size_t actual_x(const char *s, size_t column)
 	/* The position in s, returned. */
     size_t len = 0;
 	/* The screen display width to s[i]. */
+    size_t left;
+	/* The number of bytes of s after s[i]. */
 
     assert(s != NULL);
 
-    while (*s != '\0') {
-	int s_len = parse_mbchar(s, NULL, &len);
+    left = strlen(s);
+
+    while (left > 0) {
+	/* Take in the printable ASCII characters up to column in one
+	 * go. */
+	size_t run = plain_ascii_len(s, (left < column - len) ? left :
+		column - len);
+	int s_len;
+
+	i += run;
+	s += run;
+	len += run;
+	left -= run;
+
+	if (left == 0)
+	    break;
+
+	s_len = parse_mbchar(s, NULL, &len);
 
 	if (len > column)
 	    break;
 
 	i += s_len;
 	s += s_len;
+	left -= s_len;
     }
 
     return i;
@@ -507,21 +694,36 @@ size_t strnlenpt(const char *s, size_t maxlen)
 {
     size_t len = 0;
 	/* The screen display width to s[i]. */
+    size_t left;
+	/* The number of bytes of s we may still look at. */
 
     if (maxlen == 0)
 	return 0;
 
     assert(s != NULL);
 
-    while (*s != '\0') {
-	int s_len = parse_mbchar(s, NULL, &len);
+    left = strnlen(s, maxlen);
+
+    while (left > 0) {
+	/* Take in the printable ASCII characters in one go. */
+	size_t run = plain_ascii_len(s, left);
+	int s_len;
+
+	s += run;
+	len += run;
+	left -= run;
+
+	if (left == 0)
+	    break;
+
+	s_len = parse_mbchar(s, NULL, &len);
 
 	s += s_len;
 
-	if (maxlen <= s_len)
+	if (left <= (size_t)s_len)
 	    break;
 
-	maxlen -= s_len;
+	left -= s_len;
     }
 
     return len;
@@ -534,6 +736,18 @@ size_t strlenpt(const char *s)
     return strnlenpt(s, (size_t)-1);
 }
 
+/* Return a hash of the line text, to tell whether what we've worked out
+ * for a line, or painted for it, is still good. */
+unsigned int line_hash(const char *text)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; *text != '\0'; text++)
+	hash = (hash ^ (unsigned char)*text) * 16777619U;
+
+    return hash;
+}
+
 /* Append a new magicline to filebot. */
 void new_magicline(void)
 {
@@ -544,6 +758,10 @@ void new_magicline(void)
     openfile->filebot->next->lineno = openfile->filebot->lineno + 1;
 #ifdef ENABLE_COLOR
     openfile->filebot->next->multidata = NULL;
+    openfile->filebot->next->spans = NULL;
+#endif
+#ifndef NANO_TINY
+    openfile->filebot->next->journalno = 0;
 #endif
     openfile->filebot = openfile->filebot->next;
     openfile->totsize++;
@@ -594,6 +812,78 @@ void mark_order(const filestruct **top, size_t *top_x, const filestruct
 	    *right_side_up = FALSE;
     }
 }
+
+/* Write n to the file f, seven bits at a time, lowest first, with the
+ * high bit set on every byte but the last, so that small numbers take
+ * up only one byte.  Undo history files, autosave journals and rcfile
+ * snapshots are all made of such numbers and of strings. */
+void put_packed_number(FILE *f, size_t n)
+{
+    while (n >= 0x80) {
+	putc((int)((n & 0x7F) | 0x80), f);
+	n >>= 7;
+    }
+    putc((int)n, f);
+}
+
+/* Write s to the file f, as its length plus one and then its text, or
+ * as 0 if s is NULL. */
+void put_packed_string(FILE *f, const char *s)
+{
+    size_t len;
+
+    if (s == NULL) {
+	put_packed_number(f, 0);
+	return;
+    }
+
+    len = strlen(s);
+    put_packed_number(f, len + 1);
+    fwrite(s, sizeof(char), len, f);
+}
+
+/* Read a number written by put_packed_number() from *p into *n, without
+ * going past end.  Return FALSE if the number is cut off. */
+bool get_packed_number(const char **p, const char *end, size_t *n)
+{
+    size_t shift = 0;
+
+    *n = 0;
+
+    while (*p < end && shift < sizeof(size_t) * 8) {
+	unsigned char c = (unsigned char)*(*p)++;
+
+	*n |= (size_t)(c & 0x7F) << shift;
+	if (!(c & 0x80))
+	    return TRUE;
+	shift += 7;
+    }
+
+    return FALSE;
+}
+
+/* Read a string written by put_packed_string() from *p into a new *s,
+ * without going past end.  Return FALSE if the string is cut off. */
+bool get_packed_string(const char **p, const char *end, char **s)
+{
+    size_t len;
+
+    *s = NULL;
+
+    if (!get_packed_number(p, end, &len))
+	return FALSE;
+    if (len-- == 0)
+	return TRUE;
+    if ((size_t)(end - *p) < len)
+	return FALSE;
+
+    *s = charalloc(len + 1);
+    memcpy(*s, *p, len);
+    (*s)[len] = '\0';
+    *p += len;
+
+    return TRUE;
+}
 #endif
 
 /* Calculate the number of characters between begin and end, and return
@@ -626,20 +916,141 @@ size_t get_totsize(const filestruct *begin, const filestruct *end)
     return totsize;
 }
 
-/* Get back a pointer given a line number in the current openfilestruct */
+#ifndef NANO_TINY
+/* Forget the lines that the line index of the current openfilestruct
+ * has after line number lineno, since their numbers are changing or
+ * some of them may be going away. */
+void reset_line_index_after(ssize_t lineno)
+{
+    size_t keep = (lineno < 1) ? 0 : (lineno - 1) / LINE_INDEX_STRIDE +
+	1;
+
+    if (openfile != NULL && openfile->lineindex_len > keep)
+	openfile->lineindex_len = keep;
+}
+
+/* If the line index of the current openfilestruct has fileptr, which is
+ * about to be deleted, forget it and the lines after it. */
+void unindex_line(const filestruct *fileptr)
+{
+    size_t i;
+
+    if (openfile == NULL || fileptr->lineno < 1)
+	return;
+
+    i = (fileptr->lineno - 1) / LINE_INDEX_STRIDE;
+
+    if (i < openfile->lineindex_len && openfile->lineindex[i] == fileptr)
+	openfile->lineindex_len = i;
+}
+
+/* If fileptr is the next line that the line index of the current
+ * openfilestruct is missing, add it. */
+void index_line(filestruct *fileptr)
+{
+    if (openfile == NULL || fileptr->lineno < 1 || (fileptr->lineno -
+	1) % LINE_INDEX_STRIDE != 0 || (size_t)(fileptr->lineno - 1) /
+	LINE_INDEX_STRIDE != openfile->lineindex_len)
+	return;
+
+    if (openfile->lineindex_len == openfile->lineindex_size) {
+	openfile->lineindex_size = (openfile->lineindex_size == 0) ? 64 :
+		openfile->lineindex_size * 2;
+	openfile->lineindex = (filestruct **)nrealloc(openfile->lineindex,
+		openfile->lineindex_size * sizeof(filestruct *));
+    }
+
+    openfile->lineindex[openfile->lineindex_len++] = fileptr;
+}
+
+/* Return the line in the line index of the current openfilestruct that
+ * is nearest before line number lineno, first walking on from its last
+ * line to add the lines up to lineno if it doesn't reach that far yet.
+ * Return NULL if the index doesn't have a line before lineno. */
+static filestruct *indexed_line(ssize_t lineno)
+{
+    size_t i = (lineno - 1) / LINE_INDEX_STRIDE;
+    filestruct *f;
+
+    if (i < openfile->lineindex_len)
+	return openfile->lineindex[i];
+
+    /* The index starts at the first line of the file, which isn't the
+     * first line of the buffer in a paged file. */
+    if (openfile->lineindex_len == 0) {
+	if (openfile->fileage->lineno != 1)
+	    return NULL;
+
+	index_line(openfile->fileage);
+    }
+
+    f = openfile->lineindex[openfile->lineindex_len - 1];
+
+    while (openfile->lineindex_len <= i) {
+	int count;
+
+	/* Don't index lines whose numbers renumber_lazily() has left
+	 * stale. */
+	for (count = 0; count < LINE_INDEX_STRIDE && f->next != NULL &&
+		f->next != openfile->renumber_pending; count++)
+	    f = f->next;
+
+	if (count < LINE_INDEX_STRIDE)
+	    break;
+
+	index_line(f);
+    }
+
+    return openfile->lineindex[openfile->lineindex_len - 1];
+}
+#endif
+
+/* Get back a pointer given a line number in the current openfilestruct.
+ * We walk to it from whichever of the top line, the bottom line, the
+ * current line of the file and the lines in the line index is nearest.
+ * Return NULL if there is no line with that number. */
 filestruct *fsfromline(ssize_t lineno)
 {
     filestruct *f = openfile->current;
+#ifndef NANO_TINY
+    filestruct *g;
+    ssize_t distance;
+	/* How many lines there are between f and the wanted line. */
+#endif
 
-    if (lineno <= openfile->current->lineno)
-	for (; f->lineno != lineno && f != openfile->fileage; f = f->prev)
-	   ;
-    else
-        for (; f->lineno != lineno && f->next != NULL; f = f->next)
-	    ;
+    if (lineno < openfile->fileage->lineno || lineno >
+	openfile->filebot->lineno)
+	return NULL;
+
+    if (lineno <= f->lineno) {
+	if (lineno - openfile->fileage->lineno < f->lineno - lineno)
+	    f = openfile->fileage;
+    } else {
+	if (openfile->filebot->lineno - lineno < lineno - f->lineno)
+	    f = openfile->filebot;
+    }
+
+#ifndef NANO_TINY
+    distance = (f->lineno < lineno) ? lineno - f->lineno : f->lineno -
+	lineno;
+
+    /* In a partition, lines in the index may be outside of it. */
+    if (distance >= LINE_INDEX_STRIDE && filepart == NULL) {
+	g = indexed_line(lineno);
+
+	if (g != NULL && lineno - g->lineno < distance)
+	    f = g;
+    }
+#endif
+
+    while (f->lineno > lineno && f->prev != NULL)
+	f = f->prev;
+    while (f->lineno < lineno && f->next != NULL)
+	f = f->next;
 
     if (f->lineno != lineno)
 	f = NULL;
+
     return f;
 }
 
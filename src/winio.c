@@ -28,6 +28,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <signal.h>
 
 static int *key_buffer = NULL;
 	/* The keystroke buffer, containing all the keystrokes we
@@ -40,6 +41,22 @@ static int statusblank = 0;
 static bool disable_cursorpos = FALSE;
 	/* Should we temporarily disable constant cursor position
 	 * display? */
+static rowstate *rows = NULL;
+	/* What we last painted on each row of the edit window. */
+static int rows_len = 0;
+	/* The number of rows in rows. */
+static char *expanded = NULL;
+	/* The scratch buffer that text is expanded into for display. */
+static size_t expanded_len = 0;
+	/* The length of memory allocated for expanded. */
+static char *buf_mb = NULL;
+	/* Room for a multibyte character of the text being expanded. */
+static char *rep_mb = NULL;
+	/* Room for the displayed form of that character. */
+static size_t *line_columns = NULL;
+	/* The screen column of each byte of the line being painted. */
+static size_t line_columns_len = 0;
+	/* The number of entries in line_columns. */
 
 /* Control character compatibility:
  *
@@ -100,6 +117,58 @@ static bool disable_cursorpos = FALSE;
  * - F16 on FreeBSD console == Shift-Down on rxvt/Eterm; the former is
  *   omitted.  (Same as above.) */
 
+#ifndef NANO_TINY
+/* While there are changes that have to go into an autosave journal
+ * later on, wait for a key on win only until they're due, and then put
+ * them there if no key has come in by then.  Return the key that came
+ * in, or ERR if there are no changes left to wait for. */
+static int wait_for_journals(WINDOW *win)
+{
+    int input = ERR;
+    long wait;
+
+    while (input == ERR && (wait = journal_wait()) >= 0) {
+	if (wait > 0)
+	    wtimeout(win, wait);
+	else
+	    nodelay(win, TRUE);
+
+	input = wgetch(win);
+	nodelay(win, FALSE);
+
+	if (input == ERR && wait == 0)
+	    autosave_journals();
+    }
+
+    return input;
+}
+#endif
+
+#if !defined(NANO_TINY) || defined(ENABLE_COLOR)
+/* Return TRUE if a key has come in on win, which is in nodelay mode,
+ * leaving it to be read, or if a window size change is pending. */
+bool idle_interrupted(WINDOW *win)
+{
+    int input = wgetch(win);
+#ifndef NANO_TINY
+    sigset_t pending;
+#endif
+
+    if (input != ERR) {
+	ungetch(input);
+	return TRUE;
+    }
+
+#ifndef NANO_TINY
+    sigpending(&pending);
+    if (sigismember(&pending, SIGWINCH))
+	return TRUE;
+#endif
+
+    return FALSE;
+}
+#endif
+
 /* Read in a sequence of keystrokes from win and save them in the
  * keystroke buffer.  This should only be called when the keystroke
  * buffer is empty. */
@@ -112,20 +181,36 @@ void get_key_buffer(WINDOW *win)
     if (key_buffer != NULL)
 	return;
 
+    /* Just before reading in the first character, display any pending
+     * screen updates. */
+    doupdate();
+
+#ifdef ENABLE_COLOR
+    /* Until a key comes in, highlight the lines around the edit window
+     * ahead of time. */
+    if (!nodelay_mode)
+	idle_highlight(win);
+#endif
+#ifndef NANO_TINY
+    /* And find the matches of the last search. */
+    if (!nodelay_mode)
+	idle_find_matches(win);
+#endif
+
     /* Read in the first character using blocking input. */
 #ifndef NANO_TINY
     allow_pending_sigwinch(TRUE);
 #endif
 
-    /* Just before reading in the first character, display any pending
-     * screen updates. */
-    doupdate();
-
     errcount = 0;
     if (nodelay_mode) {
 	if ((input =  wgetch(win)) == ERR)
            return;
     } else
+#ifndef NANO_TINY
+	/* Don't wait longer than the autosave journals can. */
+	if ((input = wait_for_journals(win)) == ERR)
+#endif
 	while ((input = wgetch(win)) == ERR) {
 	    errcount++;
 
@@ -1856,6 +1941,89 @@ void blank_edit(void)
 
     for (i = 0; i < editwinrows; i++)
 	blank_line(edit, i, 0, COLS);
+
+    forget_rows();
+}
+
+/* Forget what we painted on the rows of the edit window, so that
+ * update_line() paints them all again, and make room for editwinrows
+ * rows. */
+void forget_rows(void)
+{
+    int i;
+
+    if (rows_len != editwinrows) {
+	rows_len = editwinrows;
+	rows = (rowstate *)nrealloc(rows, rows_len * sizeof(rowstate));
+    }
+
+    for (i = 0; i < rows_len; i++)
+	rows[i].line = NULL;
+}
+
+/* Forget what we painted on row y of the edit window. */
+void forget_row(int y)
+{
+    if (y >= 0 && y < rows_len)
+	rows[y].line = NULL;
+}
+
+/* Work out what update_line() would paint on row y of the edit window
+ * for fileptr, starting at column page_start, and return TRUE if that's
+ * what the row already shows.  Otherwise, remember it as what the row
+ * shows from now on. */
+bool row_unchanged(filestruct *fileptr, int y, size_t page_start)
+{
+    rowstate now;
+
+    if (y < 0 || y >= rows_len)
+	return FALSE;
+
+    now.line = fileptr;
+    now.hash = line_hash(fileptr->data);
+    now.page_start = page_start;
+    now.mark_from = 0;
+    now.mark_to = 0;
+    now.colors = 0;
+
+#ifndef NANO_TINY
+    if (openfile->mark_set && (fileptr->lineno <=
+	openfile->mark_begin->lineno || fileptr->lineno <=
+	openfile->current->lineno) && (fileptr->lineno >=
+	openfile->mark_begin->lineno || fileptr->lineno >=
+	openfile->current->lineno)) {
+	const filestruct *top, *bot;
+	size_t top_x, bot_x;
+
+	mark_order(&top, &top_x, &bot, &bot_x, NULL);
+
+	now.mark_from = (top == fileptr) ? top_x : 0;
+	now.mark_to = (bot == fileptr) ? bot_x : (size_t)-1;
+    }
+#endif
+
+#ifdef ENABLE_COLOR
+    if (openfile->colorstrings != NULL && !ISSET(NO_COLOR_SYNTAX) &&
+	openfile->syntax->nmultis > 0) {
+	int i;
+
+	calc_multis(fileptr);
+
+	for (i = 0; i < openfile->syntax->nmultis; i++)
+	    now.colors = now.colors * 31 + (fileptr->multidata[i] &
+		CSTARTSINSIDE);
+    }
+#endif
+
+    if (rows[y].line == now.line && rows[y].hash == now.hash &&
+	rows[y].page_start == now.page_start && rows[y].mark_from ==
+	now.mark_from && rows[y].mark_to == now.mark_to &&
+	rows[y].colors == now.colors)
+	return TRUE;
+
+    rows[y] = now;
+
+    return FALSE;
 }
 
 /* Blank the first line of the bottom portion of the window. */
@@ -1891,44 +2059,28 @@ void check_statusblank(void)
     }
 }
 
-/* Convert buf into a string that can be displayed on screen.  The
- * caller wants to display buf starting with column start_col, and
- * extending for at most len columns.  start_col is zero-based.  len is
- * one-based, so len == 0 means you get "" returned.  The returned
- * string is dynamically allocated, and should be freed.  If dollars is
- * TRUE, the caller might put "$" at the beginning or end of the line if
- * it's too long. */
-char *display_string(const char *buf, size_t start_col, size_t len, bool
-	dollars)
+/* Expand buf, from index start_index on, which is at column column,
+ * into the scratch buffer expanded, replacing tabs with spaces and
+ * control characters with their displayed forms, and return what of it
+ * shows from column start_col on in at most len columns.  dollars is as
+ * for display_string().  The returned string is overwritten by the next
+ * call. */
+static const char *expand_string(const char *buf, size_t start_index,
+	size_t column, size_t start_col, size_t len, bool dollars)
 {
-    size_t start_index;
-	/* Index in buf of the first character shown. */
-    size_t column;
-	/* Screen column that start_index corresponds to. */
-    size_t alloc_len;
-	/* The length of memory allocated for converted. */
-    char *converted;
-	/* The string we return. */
+    size_t stop_col = start_col + len;
+	/* The column past which nothing more of buf shows. */
     size_t index;
-	/* Current position in converted. */
-    char *buf_mb;
-    int buf_mb_len;
-
-    /* If dollars is TRUE, make room for the "$" at the end of the
-     * line. */
-    if (dollars && len > 0 && strlenpt(buf) > start_col + len)
-	len--;
-
-    if (len == 0)
-	return mallocstrcpy(NULL, "");
-
-    buf_mb = charalloc(mb_cur_max());
-
-    start_index = actual_x(buf, start_col);
-    column = strnlenpt(buf, start_index);
+	/* Current position in expanded. */
+    int buf_mb_len, rep_mb_len, i;
 
     assert(column <= start_col);
 
+    if (buf_mb == NULL) {
+	buf_mb = charalloc(mb_cur_max());
+	rep_mb = charalloc(mb_cur_max());
+    }
+
     /* Make sure there's enough room for the initial character, whether
      * it's a multibyte control character, a non-control multibyte
      * character, a tab character, or a null terminator.  Rationale:
@@ -1942,8 +2094,10 @@ char *display_string(const char *buf, size_t start_col, size_t len, bool
      *
      * Since tabsize has a minimum value of 1, it can substitute for 1
      * byte above. */
-    alloc_len = (mb_cur_max() + tabsize + 1) * MAX_BUF_SIZE;
-    converted = charalloc(alloc_len);
+    if (expanded_len == 0) {
+	expanded_len = (mb_cur_max() + tabsize + 1) * MAX_BUF_SIZE;
+	expanded = charalloc(expanded_len);
+    }
 
     index = 0;
 
@@ -1955,18 +2109,12 @@ char *display_string(const char *buf, size_t start_col, size_t len, bool
 
 	if (is_cntrl_mbchar(buf_mb)) {
 	    if (column < start_col) {
-		char *ctrl_buf_mb = charalloc(mb_cur_max());
-		int ctrl_buf_mb_len, i;
-
-		ctrl_buf_mb = control_mbrep(buf_mb, ctrl_buf_mb,
-			&ctrl_buf_mb_len);
+		control_mbrep(buf_mb, rep_mb, &rep_mb_len);
 
-		for (i = 0; i < ctrl_buf_mb_len; i++)
-		    converted[index++] = ctrl_buf_mb[i];
+		for (i = 0; i < rep_mb_len; i++)
+		    expanded[index++] = rep_mb[i];
 
-		start_col += mbwidth(ctrl_buf_mb);
-
-		free(ctrl_buf_mb);
+		start_col += mbwidth(rep_mb);
 
 		start_index += buf_mb_len;
 	    }
@@ -1974,11 +2122,11 @@ char *display_string(const char *buf, size_t start_col, size_t len, bool
 #ifdef ENABLE_UTF8
 	else if (using_utf8() && mbwidth(buf_mb) == 2) {
 	    if (column >= start_col) {
-		converted[index++] = ' ';
+		expanded[index++] = ' ';
 		start_col++;
 	    }
 
-	    converted[index++] = ' ';
+	    expanded[index++] = ' ';
 	    start_col++;
 
 	    start_index += buf_mb_len;
@@ -1986,98 +2134,156 @@ char *display_string(const char *buf, size_t start_col, size_t len, bool
 #endif
     }
 
-    while (buf[start_index] != '\0') {
+    /* Stop once we're past the last column that shows, but not before
+     * any zero-width characters that still belong to it. */
+    while (buf[start_index] != '\0' && start_col <= stop_col) {
 	buf_mb_len = parse_mbchar(buf + start_index, buf_mb, NULL);
 
 	/* Make sure there's enough room for the next character, whether
 	 * it's a multibyte control character, a non-control multibyte
 	 * character, a tab character, or a null terminator. */
-	if (index + mb_cur_max() + tabsize + 1 >= alloc_len - 1) {
-	    alloc_len += (mb_cur_max() + tabsize + 1) * MAX_BUF_SIZE;
-	    converted = charealloc(converted, alloc_len);
+	if (index + mb_cur_max() + tabsize + 1 >= expanded_len - 1) {
+	    expanded_len += (mb_cur_max() + tabsize + 1) * MAX_BUF_SIZE;
+	    expanded = charealloc(expanded, expanded_len);
 	}
 
 	/* If buf contains a tab character, interpret it. */
 	if (*buf_mb == '\t') {
 #if !defined(NANO_TINY) && defined(ENABLE_NANORC)
 	    if (ISSET(WHITESPACE_DISPLAY)) {
-		int i;
-
 		for (i = 0; i < whitespace_len[0]; i++)
-		    converted[index++] = whitespace[i];
+		    expanded[index++] = whitespace[i];
 	    } else
 #endif
-		converted[index++] = ' ';
+		expanded[index++] = ' ';
 	    start_col++;
 	    while (start_col % tabsize != 0) {
-		converted[index++] = ' ';
+		expanded[index++] = ' ';
 		start_col++;
 	    }
 	/* If buf contains a control character, interpret it.  If buf
 	 * contains an invalid multibyte control character, display it
 	 * as such.*/
 	} else if (is_cntrl_mbchar(buf_mb)) {
-	    char *ctrl_buf_mb = charalloc(mb_cur_max());
-	    int ctrl_buf_mb_len, i;
-
-	    converted[index++] = '^';
+	    expanded[index++] = '^';
 	    start_col++;
 
-	    ctrl_buf_mb = control_mbrep(buf_mb, ctrl_buf_mb,
-		&ctrl_buf_mb_len);
+	    control_mbrep(buf_mb, rep_mb, &rep_mb_len);
 
-	    for (i = 0; i < ctrl_buf_mb_len; i++)
-		converted[index++] = ctrl_buf_mb[i];
+	    for (i = 0; i < rep_mb_len; i++)
+		expanded[index++] = rep_mb[i];
 
-	    start_col += mbwidth(ctrl_buf_mb);
-
-	    free(ctrl_buf_mb);
+	    start_col += mbwidth(rep_mb);
 	/* If buf contains a space character, interpret it. */
 	} else if (*buf_mb == ' ') {
 #if !defined(NANO_TINY) && defined(ENABLE_NANORC)
 	    if (ISSET(WHITESPACE_DISPLAY)) {
-		int i;
-
 		for (i = whitespace_len[0]; i < whitespace_len[0] +
 			whitespace_len[1]; i++)
-		    converted[index++] = whitespace[i];
+		    expanded[index++] = whitespace[i];
 	    } else
 #endif
-		converted[index++] = ' ';
+		expanded[index++] = ' ';
 	    start_col++;
 	/* If buf contains a non-control character, interpret it.  If
 	 * buf contains an invalid multibyte non-control character,
 	 * display it as such. */
 	} else {
-	    char *nctrl_buf_mb = charalloc(mb_cur_max());
-	    int nctrl_buf_mb_len, i;
-
-	    nctrl_buf_mb = mbrep(buf_mb, nctrl_buf_mb,
-		&nctrl_buf_mb_len);
+	    mbrep(buf_mb, rep_mb, &rep_mb_len);
 
-	    for (i = 0; i < nctrl_buf_mb_len; i++)
-		converted[index++] = nctrl_buf_mb[i];
+	    for (i = 0; i < rep_mb_len; i++)
+		expanded[index++] = rep_mb[i];
 
-	    start_col += mbwidth(nctrl_buf_mb);
-
-	    free(nctrl_buf_mb);
+	    start_col += mbwidth(rep_mb);
 	}
 
 	start_index += buf_mb_len;
     }
 
-    free(buf_mb);
+    assert(expanded_len >= index + 1);
+
+    /* Null-terminate expanded. */
+    expanded[index] = '\0';
+
+    /* Make sure expanded takes up no more than len columns. */
+    expanded[actual_x(expanded, len)] = '\0';
+
+    return expanded;
+}
+
+/* Convert buf into a string that can be displayed on screen.  The
+ * caller wants to display buf starting with column start_col, and
+ * extending for at most len columns.  start_col is zero-based.  len is
+ * one-based, so len == 0 means you get "" returned.  The returned
+ * string is dynamically allocated, and should be freed.  If dollars is
+ * TRUE, the caller might put "$" at the beginning or end of the line if
+ * it's too long. */
+char *display_string(const char *buf, size_t start_col, size_t len, bool
+	dollars)
+{
+    size_t start_index;
+	/* Index in buf of the first character shown. */
+
+    /* If dollars is TRUE, make room for the "$" at the end of the
+     * line. */
+    if (dollars && len > 0 && strlenpt(buf) > start_col + len)
+	len--;
+
+    if (len == 0)
+	return mallocstrcpy(NULL, "");
+
+    start_index = actual_x(buf, start_col);
+
+    return mallocstrcpy(NULL, expand_string(buf, start_index,
+	strnlenpt(buf, start_index), start_col, len, dollars));
+}
+
+/* Work out the screen column of each byte of text, as strnlenpt() would
+ * give it, into line_columns, and return how many columns wide text
+ * is. */
+static size_t map_columns(const char *text)
+{
+    size_t index = 0, column = 0, len = strlen(text);
+
+    if (line_columns_len < len + 1) {
+	line_columns_len = len + 1;
+	line_columns = (size_t *)nrealloc(line_columns,
+		line_columns_len * sizeof(size_t));
+    }
+
+    line_columns[0] = 0;
 
-    assert(alloc_len >= index + 1);
+    while (text[index] != '\0') {
+	int char_len = parse_mbchar(text + index, NULL, &column), i;
 
-    /* Null-terminate converted. */
-    converted[index] = '\0';
+	/* strnlenpt() counts a character that's only partly taken in
+	 * as a whole. */
+	for (i = 1; i <= char_len; i++)
+	    line_columns[index + i] = column;
 
-    /* Make sure converted takes up no more than len columns. */
-    index = actual_x(converted, len);
-    null_at(&converted, index);
+	index += char_len;
+    }
 
-    return converted;
+    return column;
+}
+
+/* Expand the part of the line text, which is width columns wide, that
+ * shows on a row of the edit window from column start_col on, the way
+ * display_string() does, but without allocating anything, since
+ * line_columns holds the map of text.  The returned string is
+ * overwritten by the next call. */
+static const char *display_line(const char *text, size_t width, size_t
+	start_col, bool dollars)
+{
+    size_t len = COLS, start_index;
+
+    if (dollars && width > start_col + len)
+	len--;
+
+    start_index = actual_x(text, start_col);
+
+    return expand_string(text, start_index, line_columns[start_index],
+	start_col, len, dollars);
 }
 
 /* If path is NULL, we're in normal editing mode, so display the current
@@ -2255,6 +2461,11 @@ void titlebar(const char *path)
  * update the titlebar to display the file's new status. */
 void set_modified(void)
 {
+    edit_count++;
+#ifndef NANO_TINY
+    mark_for_journal();
+#endif
+
     if (!openfile->modified) {
 	openfile->modified = TRUE;
 	titlebar(NULL);
@@ -2462,7 +2673,8 @@ void reset_cursor(void)
  * regular characters.  start is the column number of the first
  * character of this page.  That is, the first character of converted
  * corresponds to character number actual_x(fileptr->data, start) of the
- * line. */
+ * line.  line_columns has to hold the columns of fileptr->data, as
+ * update_line() works them out. */
 void edit_draw(filestruct *fileptr, const char *converted, int
 	line, size_t start)
 {
@@ -2490,15 +2702,19 @@ void edit_draw(filestruct *fileptr, const char *converted, int
      * them. */
     if (openfile->colorstrings != NULL && !ISSET(NO_COLOR_SYNTAX)) {
 	const colortype *tmpcolor = openfile->colorstrings;
+	const colorspan *span;
+	    /* The next match of a single-line regex to paint. */
+
+	/* Work out the matches of the single-line regexes on the line,
+	 * if they're not known yet. */
+	calc_spans(fileptr);
+	span = fileptr->spans;
+
+	/* Work out which multi-line regexes the line starts inside of,
+	 * if it's not yet calculated. */
+	if (openfile->syntax != NULL && openfile->syntax->nmultis > 0)
+	    calc_multis(fileptr);
 
-	/* Set up multi-line color data for this line if it's not yet calculated  */
-        if (fileptr->multidata == NULL && openfile->syntax
-		&& openfile->syntax->nmultis > 0) {
- 	    int i;
-	    fileptr->multidata = (short *) nmalloc(openfile->syntax->nmultis * sizeof(short));
-            for (i = 0; i < openfile->syntax->nmultis; i++)
-		fileptr->multidata[i] = -1;	/* Assue this applies until we know otherwise */
-	}
 	for (; tmpcolor != NULL; tmpcolor = tmpcolor->next) {
 	    int x_start;
 		/* Starting column for mvwaddnstr.  Zero-based. */
@@ -2507,242 +2723,70 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 		 * COLS characters on a whole line. */
 	    size_t index;
 		/* Index in converted where we paint. */
-	    regmatch_t startmatch;
-		/* Match position for start_regex. */
-	    regmatch_t endmatch;
-		/* Match position for end_regex. */
 
 	    if (tmpcolor->bright)
 		wattron(edit, A_BOLD);
 	    wattron(edit, COLOR_PAIR(tmpcolor->pairnum));
-	    /* Two notes about regexec().  A return value of zero means
-	     * that there is a match.  Also, rm_eo is the first
-	     * non-matching character after the match. */
 
-	    /* First case, tmpcolor is a single-line expression. */
+	    /* First case, tmpcolor is a single-line expression.  Its
+	     * matches come next in the spans. */
 	    if (tmpcolor->end == NULL) {
-		size_t k = 0;
-
-		/* We increment k by rm_eo, to move past the end of the
-		 * last match.  Even though two matches may overlap, we
-		 * want to ignore them, so that we can highlight e.g. C
-		 * strings correctly. */
-		while (k < endpos) {
-		    /* Note the fifth parameter to regexec().  It says
-		     * not to match the beginning-of-line character
-		     * unless k is zero.  If regexec() returns
-		     * REG_NOMATCH, there are no more matches in the
-		     * line. */
-		    if (regexec(tmpcolor->start, &fileptr->data[k], 1,
-			&startmatch, (k == 0) ? 0 : REG_NOTBOL) ==
-			REG_NOMATCH)
-			break;
-		    /* Translate the match to the beginning of the
-		     * line. */
-		    startmatch.rm_so += k;
-		    startmatch.rm_eo += k;
-
-		    /* Skip over a zero-length regex match. */
-		    if (startmatch.rm_so == startmatch.rm_eo)
-			startmatch.rm_eo++;
-		    else if (startmatch.rm_so < endpos &&
-			startmatch.rm_eo > startpos) {
-			x_start = (startmatch.rm_so <= startpos) ? 0 :
-				strnlenpt(fileptr->data,
-				startmatch.rm_so) - start;
+		for (; span->color == tmpcolor; span++) {
+		    if (span->so >= endpos || span->eo <= startpos)
+			continue;
 
-			index = actual_x(converted, x_start);
+		    x_start = (span->so <= startpos) ? 0 :
+			line_columns[span->so] - start;
 
-			paintlen = actual_x(converted + index,
-				strnlenpt(fileptr->data,
-				startmatch.rm_eo) - start - x_start);
+		    index = actual_x(converted, x_start);
 
-			assert(0 <= x_start && 0 <= paintlen);
+		    paintlen = actual_x(converted + index,
+			line_columns[span->eo] - start - x_start);
 
-			mvwaddnstr(edit, line, x_start, converted +
-				index, paintlen);
-		    }
-		    k = startmatch.rm_eo;
-		}
-	    } else if (fileptr->multidata != NULL && fileptr->multidata[tmpcolor->id] != CNONE) {
-		/* This is a multi-line regex.  There are two steps.
-		 * First, we have to see if the beginning of the line is
-		 * colored by a start on an earlier line, and an end on
-		 * this line or later.
-		 *
-		 * We find the first line before fileptr matching the
-		 * start.  If every match on that line is followed by an
-		 * end, then go to step two.  Otherwise, find the next
-		 * line after start_line matching the end.  If that line
-		 * is not before fileptr, then paint the beginning of
-		 * this line. */
-		const filestruct *start_line = fileptr->prev;
-		    /* The first line before fileptr matching start. */
-		regoff_t start_col;
-		    /* Where it starts in that line. */
-		const filestruct *end_line;
-		short md = fileptr->multidata[tmpcolor->id];
-
-		if (md == -1)
-		    fileptr->multidata[tmpcolor->id] = CNONE; /* until we find out otherwise */
-		else if (md == CNONE)
-		    continue;
-		else if (md == CWHOLELINE) {
-		    mvwaddnstr(edit, line, 0, converted, -1);
-		    continue;
-		} else if (md == CBEGINBEFORE) {
-		    regexec(tmpcolor->end, fileptr->data, 1, &endmatch, 0);
-		    paintlen = actual_x(converted, strnlenpt(fileptr->data,
-			endmatch.rm_eo) - start);
-		    mvwaddnstr(edit, line, 0, converted, paintlen);
-		    continue;
-		}
+		    assert(0 <= x_start && 0 <= paintlen);
 
-		while (start_line != NULL && regexec(tmpcolor->start,
-			start_line->data, 1, &startmatch, 0) ==
-			REG_NOMATCH) {
-		    /* If there is an end on this line, there is no need
-		     * to look for starts on earlier lines. */
-		    if (regexec(tmpcolor->end, start_line->data, 0,
-			NULL, 0) == 0)
-			goto step_two;
-		    start_line = start_line->prev;
+		    mvwaddnstr(edit, line, x_start, converted + index,
+			paintlen);
 		}
-
-		/* Skip over a zero-length regex match. */
-		if (startmatch.rm_so == startmatch.rm_eo)
-		    startmatch.rm_eo++;
-		else {
-		    /* No start found, so skip to the next step. */
-		    if (start_line == NULL)
-			goto step_two;
-		    /* Now start_line is the first line before fileptr
-		     * containing a start match.  Is there a start on
-		     * this line not followed by an end on this line? */
-		    start_col = 0;
-		    while (TRUE) {
-			start_col += startmatch.rm_so;
-			startmatch.rm_eo -= startmatch.rm_so;
-			if (regexec(tmpcolor->end, start_line->data +
-				start_col + startmatch.rm_eo, 0, NULL,
-				(start_col + startmatch.rm_eo == 0) ?
-				0 : REG_NOTBOL) == REG_NOMATCH)
-			    /* No end found after this start. */
-			    break;
-			start_col++;
-			if (regexec(tmpcolor->start, start_line->data +
-				start_col, 1, &startmatch,
-				REG_NOTBOL) == REG_NOMATCH)
-			    /* No later start on this line. */
-			    goto step_two;
-		    }
-		    /* Indeed, there is a start not followed on this
-		     * line by an end. */
-
-		    /* We have already checked that there is no end
-		     * before fileptr and after the start.  Is there an
-		     * end after the start at all?  We don't paint
-		     * unterminated starts. */
-		    end_line = fileptr;
-		    while (end_line != NULL && regexec(tmpcolor->end,
-			end_line->data, 1, &endmatch, 0) == REG_NOMATCH)
-			end_line = end_line->next;
-
-		    /* No end found, or it is too early. */
-		    if (end_line == NULL || (end_line == fileptr &&
-			endmatch.rm_eo <= startpos))
-			goto step_two;
-
-		    /* Now paint the start of fileptr.  If the start of
-		     * fileptr is on a different line from the end,
-		     * paintlen is -1, meaning that everything on the
-		     * line gets painted.  Otherwise, paintlen is the
-		     * expanded location of the end of the match minus
-		     * the expanded location of the beginning of the
-		     * page. */
-		    if (end_line != fileptr) {
-			paintlen = -1;
-			fileptr->multidata[tmpcolor->id] = CWHOLELINE;
-		    } else {
-			paintlen = actual_x(converted,
-				strnlenpt(fileptr->data,
-				endmatch.rm_eo) - start);
-			fileptr->multidata[tmpcolor->id] = CBEGINBEFORE;
-		    }
-		    mvwaddnstr(edit, line, 0, converted, paintlen);
-  step_two:
-		    /* Second step, we look for starts on this line. */
-		    start_col = 0;
-
-		    while (start_col < endpos) {
-			if (regexec(tmpcolor->start, fileptr->data +
-				start_col, 1, &startmatch, (start_col ==
-				0) ? 0 : REG_NOTBOL) == REG_NOMATCH ||
-				start_col + startmatch.rm_so >= endpos)
-			    /* No more starts on this line. */
-			    break;
-			/* Translate the match to be relative to the
-			 * beginning of the line. */
-			startmatch.rm_so += start_col;
-			startmatch.rm_eo += start_col;
-
-			x_start = (startmatch.rm_so <= startpos) ? 0 :
-				strnlenpt(fileptr->data,
-				startmatch.rm_so) - start;
+	    } else {
+		/* This is a multi-line regex.  We paint its regions on
+		 * this line, beginning with the one the line starts
+		 * inside of, if any.  A region that doesn't end on this
+		 * line is only painted if there is an end on a later
+		 * line: we don't paint unterminated starts. */
+		size_t len = strlen(fileptr->data), pos = 0;
+		size_t so, eo;
+		    /* Where a region starts and ends in the line. */
+		bool inside = (fileptr->multidata[tmpcolor->id] &
+			CSTARTSINSIDE);
+
+		while (next_multi_region(tmpcolor, fileptr->data, len,
+			&pos, &inside, &so, &eo) && so < endpos) {
+		    if (inside && !multi_ends_later(fileptr, tmpcolor))
+			break;
+
+		    /* Does the region appear on this page, and is it
+		     * more than zero characters long? */
+		    if (eo > startpos && eo > so) {
+			x_start = (so <= startpos) ? 0 :
+				line_columns[so] - start;
 
 			index = actual_x(converted, x_start);
 
-			if (regexec(tmpcolor->end, fileptr->data +
-				startmatch.rm_eo, 1, &endmatch,
-				(startmatch.rm_eo == 0) ? 0 :
-				REG_NOTBOL) == 0) {
-			    /* Translate the end match to be relative to
-			     * the beginning of the line. */
-			    endmatch.rm_so += startmatch.rm_eo;
-			    endmatch.rm_eo += startmatch.rm_eo;
-			    /* There is an end on this line.  But does
-			     * it appear on this page, and is the match
-			     * more than zero characters long? */
-			    if (endmatch.rm_eo > startpos &&
-				endmatch.rm_eo > startmatch.rm_so) {
-				paintlen = actual_x(converted + index,
-					strnlenpt(fileptr->data,
-					endmatch.rm_eo) - start -
-					x_start);
-
-				assert(0 <= x_start && x_start < COLS);
-
-				mvwaddnstr(edit, line, x_start,
-					converted + index, paintlen);
-				if (paintlen > 0)
-				    fileptr->multidata[tmpcolor->id] = CSTARTENDHERE;
+			/* If the region runs on to a later line,
+			 * paintlen is -1, meaning that everything on
+			 * the line gets painted. */
+			paintlen = inside ? -1 : (int)actual_x(converted +
+				index, line_columns[eo] - start - x_start);
 
-			    }
-			} else {
-			    /* There is no end on this line.  But we
-			     * haven't yet looked for one on later
-			     * lines. */
-			    end_line = fileptr->next;
-
-			    while (end_line != NULL &&
-				regexec(tmpcolor->end, end_line->data,
-				0, NULL, 0) == REG_NOMATCH)
-				end_line = end_line->next;
-
-			    if (end_line != NULL) {
-				assert(0 <= x_start && x_start < COLS);
-
-				mvwaddnstr(edit, line, x_start,
-					converted + index, -1);
-				/* We painted to the end of the line, so
-				 * don't bother checking any more
-				 * starts. */
-				fileptr->multidata[tmpcolor->id] = CENDAFTER;
-				break;
-			    }
-			}
-			start_col = startmatch.rm_so + 1;
+			assert(0 <= x_start && x_start < COLS);
+
+			mvwaddnstr(edit, line, x_start, converted +
+				index, paintlen);
 		    }
+
+		    if (inside)
+			break;
 		}
 	    }
 
@@ -2787,7 +2831,7 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 
 	    /* x_start is the expanded location of the beginning of the
 	     * mark minus the beginning of the page. */
-	    x_start = strnlenpt(fileptr->data, top_x) - start;
+	    x_start = line_columns[top_x] - start;
 
 	    /* If the end of the mark is off the page, paintlen is -1,
 	     * meaning that everything on the line gets painted.
@@ -2797,8 +2841,7 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 	    if (bot_x >= endpos)
 		paintlen = -1;
 	    else
-		paintlen = strnlenpt(fileptr->data, bot_x) - (x_start +
-			start);
+		paintlen = line_columns[bot_x] - (x_start + start);
 
 	    /* If x_start is before the beginning of the page, shift
 	     * paintlen x_start characters to compensate, and put
@@ -2834,9 +2877,11 @@ int update_line(filestruct *fileptr, size_t index)
     int line = 0;
     int extralinesused = 0;
 	/* The line in the edit window that we want to update. */
-    char *converted;
+    const char *converted;
 	/* fileptr->data converted to have tabs and control characters
 	 * expanded. */
+    size_t width;
+	/* How many columns wide fileptr->data is. */
     size_t page_start;
     filestruct *tmp;
 
@@ -2852,10 +2897,7 @@ int update_line(filestruct *fileptr, size_t index)
     if (line < 0 || line >= editwinrows)
 	return 1;
 
-    /* First, blank out the line. */
-    blank_line(edit, line, 0, COLS);
-
-    /* Next, convert variables that index the line to their equivalent
+    /* First, convert variables that index the line to their equivalent
      * positions in the expanded line. */
     if (ISSET(SOFTWRAP))
 	index = 0;
@@ -2863,9 +2905,23 @@ int update_line(filestruct *fileptr, size_t index)
 	index = strnlenpt(fileptr->data, index);
     page_start = get_page_start(index);
 
+    /* If the row already shows the line as it would be painted now,
+     * leave it alone.  With soft wrapping, a line can take up several
+     * rows, so we don't keep track of them. */
+    if (!ISSET(SOFTWRAP) && row_unchanged(fileptr, line, page_start))
+	return 0;
+
+    /* Next, blank out the line. */
+    blank_line(edit, line, 0, COLS);
+
+    /* Work out the column of each character of the line once, for
+     * everything below to use. */
+    width = map_columns(fileptr->data);
+
     /* Expand the line, replacing tabs with spaces, and control
      * characters with their displayed forms. */
-    converted = display_string(fileptr->data, page_start, COLS, !ISSET(SOFTWRAP));
+    converted = display_line(fileptr->data, width, page_start,
+	!ISSET(SOFTWRAP));
 
 #ifdef DEBUG
     if (ISSET(SOFTWRAP) && strlen(converted) >= COLS - 2)
@@ -2875,16 +2931,14 @@ int update_line(filestruct *fileptr, size_t index)
 
     /* Paint the line. */
     edit_draw(fileptr, converted, line, page_start);
-    free(converted);
 
     if (!ISSET(SOFTWRAP)) {
 	if (page_start > 0)
 	    mvwaddch(edit, line, 0, '$');
-	if (strlenpt(fileptr->data) > page_start + COLS)
+	if (width > page_start + COLS)
 	    mvwaddch(edit, line, COLS - 1, '$');
     } else {
-        int full_length = strlenpt(fileptr->data);
-	for (index += COLS; index <= full_length && line < editwinrows; index += COLS) {
+	for (index += COLS; index <= width && line < editwinrows; index += COLS) {
 	    line++;
 #ifdef DEBUG
 	    fprintf(stderr, "update_line(): Softwrap code, moving to %d index %lu\n", line, (unsigned long) index);
@@ -2893,7 +2947,8 @@ int update_line(filestruct *fileptr, size_t index)
 
 	    /* Expand the line, replacing tabs with spaces, and control
  	     * characters with their displayed forms. */
-	    converted = display_string(fileptr->data, index, COLS, !ISSET(SOFTWRAP));
+	    converted = display_line(fileptr->data, width, index,
+		!ISSET(SOFTWRAP));
 #ifdef DEBUG
 	    if (ISSET(SOFTWRAP) && strlen(converted) >= COLS - 2)
 		fprintf(stderr, "update_line(): converted(2) line = %s\n", converted);
@@ -2901,7 +2956,6 @@ int update_line(filestruct *fileptr, size_t index)
 
 	    /* Paint the line. */
 	    edit_draw(fileptr, converted, line, index);
- 	    free(converted);
 	    extralinesused++;
 	}
     }
@@ -3054,6 +3108,19 @@ void edit_scroll(scroll_dir direction, ssize_t nlines)
     wscrl(edit, (direction == UP_DIR) ? -nlines : nlines);
     scrollok(edit, FALSE);
 
+    /* What we painted on the rows has moved along with them. */
+    if (direction == UP_DIR) {
+	for (i = rows_len - 1; i >= nlines; i--)
+	    rows[i] = rows[i - nlines];
+	for (; i >= 0; i--)
+	    rows[i].line = NULL;
+    } else {
+	for (i = 0; i < rows_len - nlines; i++)
+	    rows[i] = rows[i + nlines];
+	for (; i < rows_len; i++)
+	    rows[i].line = NULL;
+    }
+
     /* Part 2: nlines is the number of lines in the scrolled region of
      * the edit window that we need to draw. */
 
@@ -3239,8 +3306,10 @@ void edit_refresh(void)
 	foo = foo->next;
     }
 
-    for (; nlines < editwinrows; nlines++)
+    for (; nlines < editwinrows; nlines++) {
 	blank_line(edit, nlines, 0, COLS);
+	forget_row(nlines);
+    }
 
     reset_cursor();
     wnoutrefresh(edit);
@@ -3328,10 +3397,25 @@ void do_cursorpos(bool constant)
     char c;
     size_t i, cur_xpt = xplustabs() + 1;
     size_t cur_lenpt = strlenpt(openfile->current->data) + 1;
+    ssize_t lines;
     int linepct, colpct, charpct;
 
     assert(openfile->fileage != NULL && openfile->current != NULL);
 
+#ifndef NANO_TINY
+    /* Only part of a paged file is in memory, so count in bytes in the
+     * file itself. */
+    if (openfile->paged != NULL) {
+	paged_truncated();
+	lines = paged_lines();
+	i = paged_line_start(openfile->current->lineno) +
+		openfile->current_x;
+    } else {
+#endif
+    /* We need the number of the last line. */
+    renumber_flush();
+    lines = openfile->filebot->lineno;
+
     f = openfile->current->next;
     c = openfile->current->data[openfile->current_x];
 
@@ -3342,6 +3426,9 @@ void do_cursorpos(bool constant)
 
     openfile->current->data[openfile->current_x] = c;
     openfile->current->next = f;
+#ifndef NANO_TINY
+    }
+#endif
 
     if (constant && disable_cursorpos) {
 	disable_cursorpos = FALSE;
@@ -3350,16 +3437,14 @@ void do_cursorpos(bool constant)
 
     /* Display the current cursor position on the statusbar, and set
      * disable_cursorpos to FALSE. */
-    linepct = 100 * openfile->current->lineno /
-	openfile->filebot->lineno;
+    linepct = 100 * openfile->current->lineno / lines;
     colpct = 100 * cur_xpt / cur_lenpt;
     charpct = (openfile->totsize == 0) ? 0 : 100 * i /
 	openfile->totsize;
 
     statusbar(
 	_("line %ld/%ld (%d%%), col %lu/%lu (%d%%), char %lu/%lu (%d%%)"),
-	(long)openfile->current->lineno,
-	(long)openfile->filebot->lineno, linepct,
+	(long)openfile->current->lineno, (long)lines, linepct,
 	(unsigned long)cur_xpt, (unsigned long)cur_lenpt, colpct,
 	(unsigned long)i, (unsigned long)openfile->totsize, charpct);
 
@@ -3403,6 +3488,8 @@ void do_replace_highlight(bool highlight, const char *word)
     reset_cursor();
     wnoutrefresh(edit);
 
+    forget_row(openfile->current_y);
+
     if (highlight)
 	wattron(edit, reverse_attr);
 